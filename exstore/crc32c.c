@@ -0,0 +1,190 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * CRC-32C (Castagnoli), used to checksum items flushed to external storage
+ * and to verify them again when they are read back.
+ *
+ * The hardware path runs the SSE4.2 crc32 instruction over three adjacent
+ * blocks at once, which hides the instruction's three cycle latency, then
+ * merges the three block CRCs with a carry-less multiply (PCLMULQDQ) by
+ * x^n mod P instead of running zeros through the register. The software
+ * path is slicing-by-8 over tables built in crc32_init().
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC32C_HAVE_HW 1
+#endif
+#include "crc32c.h"
+
+/* Castagnoli polynomial, bit reflected */
+#define POLY 0x82f63b78
+
+crc_func crc32c = crc32c_sw;
+
+/* slicing-by-8 tables, little-endian byte order */
+static uint32_t crc32c_table[8][256];
+
+/* Build the tables for the software CRC. */
+static void crc32c_sw_init(void) {
+    uint32_t n, crc, k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *next = buf;
+
+    crc = ~crc;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, next, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_HAVE_HW
+
+/* Block sizes for the three-way interleave. LONG blocks keep the merge cost
+ * negligible on big items; SHORT blocks still pay off for small ones.
+ */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+/* x^(8n - 33) mod P for n = LONG, 2*LONG, SHORT, 2*SHORT */
+static uint32_t crc32c_long_k1, crc32c_long_k2;
+static uint32_t crc32c_short_k1, crc32c_short_k2;
+
+/* x^n mod P in the reflected domain, where 0x80000000 is x^0. Only used to
+ * build the merge constants at startup.
+ */
+static uint32_t crc32c_xpow(uint32_t n) {
+    uint32_t p = 0x80000000;
+    while (n--)
+        p = p & 1 ? (p >> 1) ^ POLY : p >> 1;
+    return p;
+}
+
+/* crc32(0, clmul(a, b)) is A*B*x^33 mod P, so a constant of x^(8n - 33)
+ * moves a CRC past n bytes of data. Two CRCs are shifted with one reduction.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64_t crc32c_merge(uint64_t crc_a, uint32_t k_a,
+        uint64_t crc_b, uint32_t k_b) {
+    __m128i a = _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc_a),
+            _mm_cvtsi32_si128(k_a), 0);
+    __m128i b = _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc_b),
+            _mm_cvtsi32_si128(k_b), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(_mm_xor_si128(a, b)));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *next = buf;
+    const unsigned char *end;
+    uint64_t crc0, crc1, crc2;
+    uint64_t word;
+
+    crc0 = ~crc & 0xffffffff;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+
+    while (len >= CRC32C_LONG * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + CRC32C_LONG;
+        do {
+            memcpy(&word, next, 8);
+            crc0 = _mm_crc32_u64(crc0, word);
+            memcpy(&word, next + CRC32C_LONG, 8);
+            crc1 = _mm_crc32_u64(crc1, word);
+            memcpy(&word, next + CRC32C_LONG * 2, 8);
+            crc2 = _mm_crc32_u64(crc2, word);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_merge(crc0, crc32c_long_k2, crc1, crc32c_long_k1) ^ crc2;
+        next += CRC32C_LONG * 2;
+        len -= CRC32C_LONG * 3;
+    }
+
+    while (len >= CRC32C_SHORT * 3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + CRC32C_SHORT;
+        do {
+            memcpy(&word, next, 8);
+            crc0 = _mm_crc32_u64(crc0, word);
+            memcpy(&word, next + CRC32C_SHORT, 8);
+            crc1 = _mm_crc32_u64(crc1, word);
+            memcpy(&word, next + CRC32C_SHORT * 2, 8);
+            crc2 = _mm_crc32_u64(crc2, word);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_merge(crc0, crc32c_short_k2, crc1, crc32c_short_k1) ^ crc2;
+        next += CRC32C_SHORT * 2;
+        len -= CRC32C_SHORT * 3;
+    }
+
+    while (len >= 8) {
+        memcpy(&word, next, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+    return ~(uint32_t)crc0;
+}
+#endif
+
+void crc32_init(void) {
+    crc32c_sw_init();
+    crc32c = crc32c_sw;
+#ifdef CRC32C_HAVE_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        crc32c_long_k1 = crc32c_xpow(CRC32C_LONG * 8 - 33);
+        crc32c_long_k2 = crc32c_xpow(CRC32C_LONG * 2 * 8 - 33);
+        crc32c_short_k1 = crc32c_xpow(CRC32C_SHORT * 8 - 33);
+        crc32c_short_k2 = crc32c_xpow(CRC32C_SHORT * 2 * 8 - 33);
+        crc32c = crc32c_hw;
+    }
+#endif
+}
@@ -0,0 +1,23 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Return the CRC-32C (Castagnoli) of buf[0..len-1] given the starting CRC
+ * crc. Pass the previous return value to checksum a sequence of buffers a
+ * chunk at a time; the first call must be with crc == 0.
+ *
+ * crc32c points at the SSE4.2 crc32 + PCLMUL implementation when the CPU
+ * has both, and at the table driven one otherwise. crc32_init() must run
+ * before the first call.
+ */
+typedef uint32_t (*crc_func)(uint32_t crc, const void *buf, size_t len);
+extern crc_func crc32c;
+
+void crc32_init(void);
+
+/* The same CRC, never using the hardware instruction. */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32C_H */
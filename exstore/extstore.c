@@ -14,7 +14,11 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 #include "extstore.h"
 
 // TODO: better if an init option turns this on/off
@@ -41,6 +45,11 @@
     pthread_mutex_unlock(&e->stats_mutex); \
 }
 
+/* O_DIRECT transfers must start, end and land on this boundary. 4k covers
+ * both 512b and 4k logical block devices.
+ */
+#define EXTSTORE_DIRECT_ALIGN 4096
+
 typedef struct __store_wbuf {
     struct __store_wbuf *next;
     char *buf;
@@ -48,6 +57,7 @@ typedef struct __store_wbuf {
     unsigned int free;
     unsigned int size;
     unsigned int offset; // offset into page this wirte starts at
+    int buf_index;      // registered buffer slot for io_uring, -1 if none
     bool full;          // doen writing to this page
     bool flushed;       // whether wbuf has been flushed to disk
 } _store_wbuf;
@@ -65,6 +75,7 @@ typedef struct _store_page {
     unsigned int free_bucket; // whtich bucket this page returns to when freed
     int fd;
     unsigned short id;
+    bool direct;    // fd is O_DIRECT; reads go through an aligned bounce buffer
     bool active;    // actively being written to
     bool closed;    // closed and draining before free
     bool free;      // on freelist
@@ -73,12 +84,30 @@ typedef struct _store_page {
 } store_page;
 
 typedef struct store_engine store_engine;
+
+/* Per in-flight IO state owned by an IO thread. O_DIRECT reads are widened
+ * to block boundaries and land in the bounce buffer, then trimmed back out.
+ */
+typedef struct {
+    obj_io *io;
+    char *bounce;               // aligned, grows to the largest direct read
+    unsigned int bounce_size;
+    unsigned int head;          // bytes from the aligned start to the object
+    bool do_op;                 // holds a page refcount until completion
+} store_io_slot;
+
 typedef struct {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     obj_io *queue;
     store_engine *e;
     unsigned int depth; // queue depth
+    store_io_slot *slots;   // one per IO in a batch (io_depth)
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool uring;         // batch goes through the ring instead of pread/pwrite
+    bool fixed_bufs;    // wbufs are registered with the ring
+#endif
 } stroe_io_thread;
 
 typedef struct {
@@ -114,14 +143,15 @@ static _store_wbuf *wbuf_new(size_t size) {
     _store_wbuf *b = calloc(1, sizeof(_store_wbuf));
     if (b == NULL)
         return NULL;
-    b->buf = malloc(size);
-    if (b->buf == NULL) {
+    // aligned so the buffer can be written straight to an O_DIRECT fd.
+    if (posix_memalign((void **)&b->buf, EXTSTORE_DIRECT_ALIGN, size) != 0) {
         free(b);
         return NULL;
     }
     b->buf_pos = b->buf;
     b->free = size;
     b->size = size;
+    b->buf_index = -1;
     return b;
 }
 
@@ -211,10 +241,42 @@ const char *extstore_err(enum extstore_res res) {
         break;
     case EXTSTORE_INIT_THREAD_FAIL:
         break;
+    case EXTSTORE_INIT_IO_ENGINE_FAIL:
+        rv = "failed to set up io_uring IO engine";
+        break;
     }
     return rv;
 }
 
+/* Each IO thread gets its own ring, sized to hold a full io_depth batch.
+ * The wbufs are registered with every ring so flushes can use fixed-buffer
+ * writes; if the kernel refuses (RLIMIT_MEMLOCK) writes just go unregistered.
+ */
+static int _io_uring_setup(store_engine *e, store_io_thread *t,
+        unsigned int wbuf_count) {
+#ifdef HAVE_LIBURING
+    unsigned int entries = e->io_depth ? e->io_depth : 1;
+    if (io_uring_queue_init(entries, &t->ring, 0) != 0) {
+        return -1;
+    }
+    t->uring = true;
+
+    struct iovec *iov = calloc(wbuf_count, sizeof(struct iovec));
+    if (iov == NULL) {
+        return 0;
+    }
+    for (_store_wbuf *w = e->wbuf_stack; w != NULL; w = w->next) {
+        iov[w->buf_index].iov_base = w->buf;
+        iov[w->buf_index].iov_len = w->size;
+    }
+    t->fixed_bufs = io_uring_register_buffers(&t->ring, iov, wbuf_count) == 0;
+    free(iov);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 // TODO: #define's for DEFAULT_BUCKET， FREE_VERSION, etc
 void *extstore_init(struct extstore_conf_file *h, struct extstore_conf *cf,
         enum extstore_res *res) {
@@ -252,7 +314,12 @@ void *extstore_init(struct extstore_conf_file *h, struct extstore_conf *cf,
     e->page_size = cf->page_size;
     uint64_t temp_page_count = 0;
     for (f = fh; f != NULL; f = f->next) {
-        f->fd = open(f->file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        int flags = O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+        if (f->direct_io)
+            flags |= O_DIRECT;
+#endif
+        f->fd = open(f->file, flags, 0644);
         if (f->fd < 0) {
             *res = EXTSTORE_INIT_OPEN_FAIL;
 #ifdef EXTSTORE_DEBUG
@@ -261,6 +328,11 @@ void *extstore_init(struct extstore_conf_file *h, struct extstore_conf *cf,
             free(e);
             return NULL;
         }
+#ifdef POSIX_FADV_RANDOM
+        // object reads are scattered; readahead only evicts useful memory.
+        if (!f->readahead)
+            posix_fadvise(f->fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
         temp_page_count += f->page_count;
         f->offset = 0;
     }
@@ -299,6 +371,9 @@ void *extstore_init(struct extstore_conf_file *h, struct extstore_conf *cf,
         pthread_mutex_init(&e->pages[i].mutex, NULL);
         e->pages[i].id = i;
         e->pages[i].fd = f->fd;
+#ifdef O_DIRECT
+        e->pages[i].direct = f->direct_io;
+#endif
         e->pages[i].free_bucket = f->free_bucket;
         e->pages[i].offset = f->offset;
         e->pages[i].free = true;
@@ -340,6 +415,7 @@ void *extstore_init(struct extstore_conf_file *h, struct extstore_conf *cf,
         _store_wbuf *w = wbuf_new(cf->wbuf_size);
         obj_io *io = calloc(1, sizeof(obj_io));
         /* TODO: on error, loop again and free stack. */
+        w->buf_index = i;
         w->next = e->wbuf_stack;
         e->wbuf_stack = w;
         io->next = e->io_stack;
@@ -357,8 +433,19 @@ void *extstore_init(struct extstore_conf_file *h, struct extstore_conf *cf,
         pthread_mutex_init(&e->io_threads[i].mutex, NULL);
         pthread_cond_init(&e->io_threads[i].cond, NULL);
         e->io_threads[i].e = e;
+        e->io_threads[i].slots = calloc(cf->io_depth ? cf->io_depth : 1,
+                sizeof(store_io_slot));
+        if (e->io_threads[i].slots == NULL) {
+            *res = EXTSTORE_INIT_OOM;
+            return NULL;
+        }
+        if (cf->io_engine == EXTSTORE_IO_URING &&
+                _io_uring_setup(e, &e->io_threads[i], cf->wbuf_count) != 0) {
+            *res = EXTSTORE_INIT_IO_ENGINE_FAIL;
+            return NULL;
+        }
         // FIXME: error handling
-        pthread_create(&thread, NULL, extstore_io_thread, &e->io_threads[i]);
+        pthread_create(&thread, cf->thread_attr, extstore_io_thread, &e->io_threads[i]);
     }
     e->io_threadcount = cf->io_threadcount;
 
@@ -367,7 +454,7 @@ void *extstore_init(struct extstore_conf_file *h, struct extstore_conf *cf,
     // FIXME: error handling
     pthread_mutex_init(&e->maint_thread->mutex, NULL);
     pthread_cond_init(&e->maint_thread->cond, NULL);
-    pthread_create(&thread, NULL, extstore_maint_thread, e->maint_thread);
+    pthread_create(&thread, cf->thread_attr, extstore_maint_thread, e->maint_thread);
 
     extstore_run_maint(e);
 
@@ -565,6 +652,13 @@ int extstore_write_request(void *ptr, unsigned int bucket,
  * fills the rest of io structure.
  */
 void extstore_write(void *ptr, obj_io *io) {
+    extstore_write_batch(ptr, io, 1);
+}
+
+/* As extstore_write, for a request holding count objects packed back to
+ * back. io->offset is that of the first one.
+ */
+void extstore_write_batch(void *ptr, obj_io *io, unsigned int count) {
     store_engine *e = (store_engine *)ptr;
     store_page *p = &e->pages[io->page_id];
 
@@ -573,12 +667,12 @@ void extstore_write(void *ptr, obj_io *io) {
     p->wbuf->buf_pos += io->len;
     p->wbuf->free -= io->len;
     p->bytes_used += io->len;
-    p->obj_count++;
+    p->obj_count += count;
     STAT_L(e);
     e->stats.bytes_written += io->len;
     e->stats.bytes_used += io->len;
-    e->stats.objects_written++;
-    e->stats.objects_used++;
+    e->stats.objects_written += count;
+    e->stats.objects_used += count;
     STAT_UL(e);
 
     pthread_mutex_unlock(&p->mutex);
@@ -709,9 +803,240 @@ static inline int _read_from_wbuf(store_page *p, obj_io *io) {
     return io->len;
 }
 
+/* Checks a read against its page before it is issued.
+ * Returns true if the read has to go to the device; the page refcount is then
+ * held until the IO completes. Otherwise the read was served from an
+ * unflushed wbuf, or the page is gone, and *ret holds the result.
+ */
+static bool _read_prepare(store_engine *e, store_page *p, obj_io *io, int *ret) {
+    bool do_op = false;
+    // Page is currently open. deal if read is past the end.
+    pthread_mutex_lock(&p->mutex);
+    if (!p->free && !p->closed && p->version == io->page_version) {
+        if (p->active && io->offset >= p->written) {
+            *ret = _read_from_wbuf(p, io);
+        } else {
+            p->refcount++;
+            do_op = true;
+        }
+        STAT_L(e);
+        e->stats.bytes_read += io->len;
+        e->stats.objects_read++;
+        STAT_UL(e);
+    } else {
+        *ret = -2; // TODO: enum in IO for status?
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return do_op;
+}
+
+/* O_DIRECT reads must be block aligned in offset, length and memory. Widens
+ * the read to block boundaries inside the slot's bounce buffer.
+ * Returns the aligned length to read and moves *off back to the aligned
+ * start, or returns 0 if no bounce buffer could be had.
+ */
+static unsigned int _direct_read_prep(store_io_slot *s, obj_io *io, off_t *off) {
+    off_t start = *off & ~((off_t)EXTSTORE_DIRECT_ALIGN - 1);
+    off_t end = (*off + io->len + EXTSTORE_DIRECT_ALIGN - 1) &
+        ~((off_t)EXTSTORE_DIRECT_ALIGN - 1);
+    unsigned int len = end - start;
+
+    if (s->bounce_size < len) {
+        free(s->bounce);
+        s->bounce_size = 0;
+        if (posix_memalign((void **)&s->bounce, EXTSTORE_DIRECT_ALIGN, len) != 0) {
+            s->bounce = NULL;
+            return 0;
+        }
+        s->bounce_size = len;
+    }
+    s->head = *off - start;
+    *off = start;
+    return len;
+}
+
+/* Copies the object back out of a completed bounce read. */
+static int _direct_read_trim(store_io_slot *s, obj_io *io, int ret) {
+    char *src = s->bounce + s->head;
+    if (ret < 0)
+        return ret;
+    if (ret <= s->head)
+        return 0;
+    ret -= s->head;
+    if (ret > io->len)
+        ret = io->len;
+
+    if (io->iov == NULL) {
+        memcpy(io->buf, src, ret);
+    } else {
+        unsigned int left = ret;
+        for (int x = 0; x < io->iovcnt && left; x++) {
+            unsigned int n = io->iov[x].iov_len < left ? io->iov[x].iov_len : left;
+            memcpy(io->iov[x].iov_base, src, n);
+            src += n;
+            left -= n;
+        }
+    }
+    return ret;
+}
+
+/* Hands a finished IO back to its owner and drops the page reference a
+ * device read was holding.
+ */
+static void _io_complete(store_engine *e, obj_io *io, int ret, bool do_op) {
+    // The callback may reuse the obj_io, so look the page up first.
+    store_page *p = &e->pages[io->page_id];
+    if (ret == 0) {
+        E_DEBUG("read returned nothing\n");
+    }
+
+#ifdef EXTSTORE_DEBUG
+    if (ret == -1) {
+        perror("read/write op failed");
+    }
+#endif
+    io->cb(e, io, ret);
+    if (do_op) {
+        pthread_mutex_lock(&p->mutex);
+        p->refcount--;
+        pthread_mutex_unlock(&p->mutex);
+    }
+}
+
+// Blocking engine: one syscall per IO, callbacks run inline after each.
+static void _io_run_sync(store_io_thread *me, obj_io *cur_io) {
+    store_engine *e = me->e;
+    store_io_slot *s = &me->slots[0];
+    while (cur_io) {
+        // We need to note next before the callback in case the obj_io
+        // gets resued.
+        obj_io *next = cur_io->next;
+        int ret = 0;
+        bool do_op = false;
+        store_page *p = &e->pages[cur_io->page_id];
+        off_t off = p->offset + cur_io->offset;
+        // TODO: loop if not enough bytes were read/written.
+        switch (cur_io->mode) {
+        case OBJ_IO_READ:
+            do_op = _read_prepare(e, p, cur_io, &ret);
+            if (do_op && p->direct) {
+                unsigned int len = _direct_read_prep(s, cur_io, &off);
+                ret = len ? pread(p->fd, s->bounce, len, off) : -1;
+                ret = _direct_read_trim(s, cur_io, ret);
+            } else if (do_op) {
+                if (cur_io->iov == NULL) {
+                    ret = pread(p->fd, cur_io->buf, cur_io->len, off);
+                } else {
+                    ret = preadv(p->fd, cur_io->iov, cur_io->iovcnt, off);
+                }
+            }
+            break;
+        case OBJ_IO_WRITE:
+            // FIXME: Should hold refcount during write, doesn't
+            // currently matter since page can't free while active
+            ret = pwrite(p->fd, cur_io->buf, cur_io->len, off);
+            break;
+        }
+        _io_complete(e, cur_io, ret, do_op);
+        cur_io = next;
+    }
+}
+
+#ifdef HAVE_LIBURING
+/* io_uring engine: the whole batch goes out in one submit, then completions
+ * are reaped in whatever order the device finishes them. A batch is never
+ * larger than io_depth, which is what the ring and slot array were sized to.
+ */
+static void _io_run_uring(store_io_thread *me, obj_io *cur_io) {
+    store_engine *e = me->e;
+    unsigned int inflight = 0;
+
+    while (cur_io) {
+        obj_io *next = cur_io->next;
+        store_page *p = &e->pages[cur_io->page_id];
+        store_io_slot *s = &me->slots[inflight];
+        struct io_uring_sqe *sqe;
+        off_t off = p->offset + cur_io->offset;
+        unsigned int dlen = 0;
+        int ret = 0;
+
+        s->io = cur_io;
+        s->do_op = false;
+        s->head = 0;
+        if (cur_io->mode == OBJ_IO_READ) {
+            s->do_op = _read_prepare(e, p, cur_io, &ret);
+            if (s->do_op && p->direct) {
+                dlen = _direct_read_prep(s, cur_io, &off);
+                if (dlen == 0) {
+                    ret = -1;
+                }
+            }
+            if (!s->do_op || (p->direct && dlen == 0)) {
+                _io_complete(e, cur_io, ret, s->do_op);
+                cur_io = next;
+                continue;
+            }
+        }
+
+        sqe = io_uring_get_sqe(&me->ring);
+        assert(sqe != NULL);
+        switch (cur_io->mode) {
+        case OBJ_IO_READ:
+            if (p->direct) {
+                io_uring_prep_read(sqe, p->fd, s->bounce, dlen, off);
+            } else if (cur_io->iov == NULL) {
+                io_uring_prep_read(sqe, p->fd, cur_io->buf, cur_io->len, off);
+            } else {
+                io_uring_prep_readv(sqe, p->fd, cur_io->iov, cur_io->iovcnt, off);
+            }
+            break;
+        case OBJ_IO_WRITE:
+            // wbuf flushes always write the whole registered buffer.
+            if (me->fixed_bufs && cur_io->cb == _wbuf_cb) {
+                _store_wbuf *w = (_store_wbuf *)cur_io->data;
+                io_uring_prep_write_fixed(sqe, p->fd, cur_io->buf, cur_io->len,
+                        off, w->buf_index);
+            } else {
+                io_uring_prep_write(sqe, p->fd, cur_io->buf, cur_io->len, off);
+            }
+            break;
+        }
+        io_uring_sqe_set_data(sqe, s);
+        inflight++;
+        cur_io = next;
+    }
+
+    if (inflight == 0)
+        return;
+
+    io_uring_submit(&me->ring);
+    while (inflight) {
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(&me->ring, &cqe);
+        if (ret != 0) {
+            // only -EINTR is expected here.
+            continue;
+        }
+        store_io_slot *s = (store_io_slot *)io_uring_cqe_get_data(cqe);
+        ret = cqe->res;
+        io_uring_cqe_seen(&me->ring, cqe);
+        // callbacks expect the pread/pwrite convention.
+        if (ret < 0) {
+            errno = -ret;
+            ret = -1;
+        }
+        if (s->do_op && e->pages[s->io->page_id].direct) {
+            ret = _direct_read_trim(s, s->io, ret);
+        }
+        _io_complete(e, s->io, ret, s->do_op);
+        inflight--;
+    }
+}
+#endif
+
 // engine IO thread; takes engine context
 // manage writes/reads
-// runs IO callbacks inline after each IO
+// runs IO callbacks as each IO completes
 //
 //FIXME: protect from reading past page
 static void *extstore_io_thread(void *arg) {
@@ -743,67 +1068,13 @@ static void *extstore_io_thread(void *arg) {
         }
         pthread_mutex_unlock(&me->mutex);
 
-        obj_io *cur_io = io_stack;
-        while (cur_io) {
-            // We need to note next before the callback in case the obj_io
-            // gets resued.
-            obj_io *next = cur_io->next;
-            int ret = 0;
-            int do_op = 1;
-            store_page *p = &e->pages[cur_io->page_id];
-            // TODO: loop if not enough bytes were read/written.
-            switch (cur_io->mode) {
-            case BOJ_IO_READ:
-                // Page is currently open. deal if read is past the end.
-                pthread_mutex_lock(&p->mutex);
-                if (!p->free && !p->closed && p->version == cur_io->page_version) {
-                    if (p->active && cur_io->offset >= p->written) {
-                        ret = _read_from_wbuf(p, cur_io);
-                        do_op = 0;
-                    } else {
-                        p->refcount++;
-                    }
-                    STAT_L(e);
-                    e->stats.bytes_read += cur_io->len;
-                    e->stats.objects_read++;
-                    STAT_UL(e);
-                } else {
-                    do_op = 0;
-                    ret = -2; // TODO: enum in IO for status?
-                }
-                pthread_mutex_unlock(&p->mutex);
-                if (do_op) {
-                    if (cur_io->iov == NULL) {
-                        ret = pread(p->fd, cur_io->buf, cur_io->len, p->offset + cur_io->offset);
-                    } else {
-                        ret = preadv(p->fd, cur_io->iov, cur_io->iovcnt, p->offset + cur_io->offset);
-                    }
-                }
-                break;
-            case OBJ_IO_WRITE:
-                do_op = 0;
-                // FIXME: Should hold refcount during write, doesn't
-                // currently matter since page can't free while active
-                ret = pwrite(p->fd, cur_io->buf, cur_io->len, p->offset + cur_io->offset);
-                break;
-            }
-            if (ret == 0) {
-                E_DEBUG("read returned nothing\n");
-            }
-
-#ifdef EXTSTORE_DEBUG
-            if (ret == -1) {
-                perror("read/write op failed");
-            }
-#endif
-            cur_io->cb(e, cur_io, ret);
-            if (do_op) {
-                pthread_mutex_lock(&p->mutex);
-                p->refcount--;
-                pthread_mutex_unlock(&p->mutex);
-            }
-            cur_io = next;
+#ifdef HAVE_LIBURING
+        if (me->uring) {
+            _io_run_uring(me, io_stack);
+            continue;
         }
+#endif
+        _io_run_sync(me, io_stack);
     }
 
     return NULL;
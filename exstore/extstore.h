@@ -38,6 +38,12 @@ struct extstore_stats {
     struct extstore_page_data *page_data;
 };
 
+/* How the IO threads issue their batch of reads and writes. */
+enum extstore_io_engine {
+    EXTSTORE_IO_THREADS = 0,    // blocking pread/pwrite, one IO at a time
+    EXTSTORE_IO_URING,          // whole batch submitted to an io_uring
+};
+
 // TODO: Temporary configuration structure. A "real" library should have an
 // extstore_set(enum, void *ptr) which hides the implementation.
 // this is plenty for quick development.
@@ -50,6 +56,8 @@ struct extstore_conf {
     unsigned int wbuf_count;    // this might get locked to "2 per active page"
     unsigned int io_threadcount;
     unsigned int io_depth;      // with normal I/O, hits locks less. req'd for AIO
+    enum extstore_io_engine io_engine;
+    pthread_attr_t *thread_attr;    // for the IO and maintenance threads, NULL for defaults
 };
 
 struct extstore_conf_file {
@@ -59,6 +67,8 @@ struct extstore_conf_file {
     uint64_t offset;            // internal usage
     unsigned int bucket;        // free page bucket
     unsigned int free_bucket;   // specialized free bucket
+    bool direct_io;             // O_DIRECT: bypass the page cache
+    bool readahead;             // false to tell the kernel reads are random
     struct extstore_conf_file *next;
 };
 
@@ -97,13 +107,15 @@ enum extstore_res {
     EXTSTORE_INIT_TOO_MANY_PAGES,
     EXTSTORE_INT_OOM,
     EXTSTORE_INIT_OPEN_FAIL,
-    EXTSTORE_INIT_THREAD_FAIL
+    EXTSTORE_INIT_THREAD_FAIL,
+    EXTSTORE_INIT_IO_ENGINE_FAIL
 };
 
 const char *extstore_err(enum extstore_res res);
 void *extstore_init(struct extstore_conf_file *fh, struct extstore_conf *cf, enum extstore_res *res);
 int extstore_write_request(void *ptr, unsigned int bucket, unsigned  int free_bucket, obj_io *io);
 void extstore_write(void *ptr, obj_io *io);
+void extstore_write_batch(void *ptr, obj_io *io, unsigned int count);
 int extstore_submit(void *ptr, obj_io *io);
 /* count are the number of objects being removed, bytes are the original
  * length of those objects. Bytes is optional but you can't track
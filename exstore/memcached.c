@@ -10,11 +10,30 @@ int main (int argc, char **argv) {
 
     enum {
         // 其他相关代码
+        HASH_INDEX,
+        SLAB_HUGEPAGES,
+        SLAB_NUMA,
+        REUSEPORT,
+        REUSEPORT_CPU,
+        CONN_DISPATCH,
+        CONN_MIGRATE,
+        EVENT_ENGINE,
+        BUSY_POLL,
+        ZEROCOPY_MIN,
+        UDP_BATCH,
+        SCHED_BYTES,
+        SCHED_USEC,
+        SCHED_COALESCE,
+        WORKER_CPUS,
+        WORKER_NODES,
+        WORKER_RXQ,
+        BG_CPUS,
 #ifdef EXTSTORE
         EXT_PAGE_SIZE,
         EXT_WBUF_SIZE,
         EXT_THREADS,
         EXT_IO_DEPTH,
+        EXT_IO_ENGINE,
         EXT_PATH,
         EXT_ITEM_SIZE,
         EXT_ITEM_AGE,
@@ -30,11 +49,30 @@ int main (int argc, char **argv) {
 
     char *const subopts_tokens[] = {
         // 其他代码
+        [HASH_INDEX] = "hash_index",
+        [SLAB_HUGEPAGES] = "slab_hugepages",
+        [SLAB_NUMA] = "slab_numa",
+        [REUSEPORT] = "reuseport",
+        [REUSEPORT_CPU] = "reuseport_cpu",
+        [CONN_DISPATCH] = "conn_dispatch",
+        [CONN_MIGRATE] = "conn_migrate",
+        [EVENT_ENGINE] = "event_engine",
+        [BUSY_POLL] = "busy_poll",
+        [ZEROCOPY_MIN] = "zerocopy_min",
+        [UDP_BATCH] = "udp_batch",
+        [SCHED_BYTES] = "sched_bytes",
+        [SCHED_USEC] = "sched_usec",
+        [SCHED_COALESCE] = "sched_coalesce",
+        [WORKER_CPUS] = "worker_cpus",
+        [WORKER_NODES] = "worker_nodes",
+        [WORKER_RXQ] = "worker_rxq",
+        [BG_CPUS] = "bg_cpus",
 #ifdef EXTSTORE
         [EXT_PAGE_SIZE] = "ext_page_size",
         [EXT_WBUF_SIZE] = "ext_wbuf_size",
         [EXT_THREADS] = "ext_threads",
         [EXT_IO_DEPTH] = "ext_io_depth",
+        [EXT_IO_ENGINE] = "ext_io_engine",
         [EXT_PATH] = "ext_path",
         [EXT_ITEM_SIZE] = "ext_item_size",
         [EXT_ITEM_AGE] = "ext_item_age",
@@ -65,6 +103,7 @@ int main (int argc, char **argv) {
     ext_cf.wbuf_size = settings.ext_wbuf_size;
     ext_cf.io_threadcount = 1;
     ext_cf.io_depth = 1;
+    ext_cf.io_engine = EXTSTORE_IO_THREADS;
     ext_cf.page_buckets = 4;
     ext_cf.wbuf_count = ext_cf.page_buckets;
 #endif
@@ -158,6 +197,189 @@ int main (int argc, char **argv) {
                 
                 switch (getsubopt(&subopts, subopts_tokens, &subopts_value)) {
                 // 其他代码
+                case HASH_INDEX:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing hash_index argument\n");
+                        return 1;
+                    }
+                    if (strcmp(subopts_value, "chained") == 0) {
+                        settings.hash_index = HASH_INDEX_CHAINED;
+                    } else if (strcmp(subopts_value, "bucketed") == 0) {
+                        settings.hash_index = HASH_INDEX_BUCKETED;
+                    } else {
+                        fprintf(stderr, "hash_index must be one of: chained, bucketed\n");
+                        return 1;
+                    }
+                    break;
+                case SLAB_HUGEPAGES:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing slab_hugepages argument\n");
+                        return 1;
+                    }
+                    if (strcmp(subopts_value, "thp") == 0) {
+                        settings.slab_hugepages = SLAB_HUGEPAGES_THP;
+                    } else if (strcmp(subopts_value, "2m") == 0) {
+                        settings.slab_hugepages = SLAB_HUGEPAGES_2M;
+                    } else if (strcmp(subopts_value, "1g") == 0) {
+                        settings.slab_hugepages = SLAB_HUGEPAGES_1G;
+                    } else {
+                        fprintf(stderr, "slab_hugepages must be one of: thp, 2m, 1g\n");
+                        return 1;
+                    }
+                    // huge pages only back the preallocated region
+                    preallocate = true;
+                    break;
+                case SLAB_NUMA:
+                    settings.slab_numa = true;
+                    preallocate = true;
+                    break;
+                case REUSEPORT:
+                    settings.reuseport = true;
+                    break;
+                case REUSEPORT_CPU:
+                    settings.reuseport = true;
+                    settings.reuseport_cpu = true;
+                    break;
+                case CONN_DISPATCH:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing conn_dispatch argument\n");
+                        return 1;
+                    }
+                    if (strcmp(subopts_value, "rr") == 0) {
+                        settings.conn_dispatch_load = false;
+                    } else if (strcmp(subopts_value, "load") == 0) {
+                        settings.conn_dispatch_load = true;
+                    } else {
+                        fprintf(stderr, "conn_dispatch must be one of: rr, load\n");
+                        return 1;
+                    }
+                    break;
+                case CONN_MIGRATE:
+                    // migration decisions come from the load samples
+                    settings.conn_dispatch_load = true;
+                    settings.conn_migrate = true;
+                    break;
+                case EVENT_ENGINE:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing event_engine argument\n");
+                        return 1;
+                    }
+                    if (strcmp(subopts_value, "libevent") == 0) {
+                        settings.event_epoll = false;
+                    } else if (strcmp(subopts_value, "epoll") == 0) {
+#ifdef __linux__
+                        settings.event_epoll = true;
+#else
+                        fprintf(stderr, "event_engine=epoll is only available on Linux\n");
+                        return 1;
+#endif
+                    } else {
+                        fprintf(stderr, "event_engine must be one of: libevent, epoll\n");
+                        return 1;
+                    }
+                    break;
+                case BUSY_POLL:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing busy_poll argument\n");
+                        return 1;
+                    }
+                    if (!safe_strtol(subopts_value, &settings.busy_poll_us) ||
+                            settings.busy_poll_us < 0) {
+                        fprintf(stderr, "could not parse argument to busy_poll\n");
+                        return 1;
+                    }
+#ifdef __linux__
+                    // spinning only makes sense on the epoll engine
+                    if (settings.busy_poll_us > 0)
+                        settings.event_epoll = true;
+#else
+                    fprintf(stderr, "busy_poll is only available on Linux\n");
+                    return 1;
+#endif
+                    break;
+                case ZEROCOPY_MIN:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing zerocopy_min argument\n");
+                        return 1;
+                    }
+                    if (!safe_strtol(subopts_value, &settings.zerocopy_min) ||
+                            settings.zerocopy_min < 0) {
+                        fprintf(stderr, "could not parse argument to zerocopy_min\n");
+                        return 1;
+                    }
+#ifndef __linux__
+                    fprintf(stderr, "zerocopy_min is only available on Linux\n");
+                    return 1;
+#endif
+                    break;
+                case UDP_BATCH:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing udp_batch argument\n");
+                        return 1;
+                    }
+                    if (!safe_strtol(subopts_value, &settings.udp_batch) ||
+                            settings.udp_batch < 0 || settings.udp_batch > UDP_BATCH_MAX) {
+                        fprintf(stderr, "udp_batch must be between 0 and %d\n", UDP_BATCH_MAX);
+                        return 1;
+                    }
+#ifndef __linux__
+                    fprintf(stderr, "udp_batch is only available on Linux\n");
+                    return 1;
+#endif
+                    break;
+                case SCHED_BYTES:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing sched_bytes argument\n");
+                        return 1;
+                    }
+                    if (!safe_strtol(subopts_value, &settings.sched_bytes) ||
+                            settings.sched_bytes < 0) {
+                        fprintf(stderr, "could not parse argument to sched_bytes\n");
+                        return 1;
+                    }
+                    break;
+                case SCHED_USEC:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing sched_usec argument\n");
+                        return 1;
+                    }
+                    if (!safe_strtol(subopts_value, &settings.sched_usec) ||
+                            settings.sched_usec < 0) {
+                        fprintf(stderr, "could not parse argument to sched_usec\n");
+                        return 1;
+                    }
+                    break;
+                case SCHED_COALESCE:
+                    settings.sched_coalesce = true;
+                    break;
+                case WORKER_CPUS:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing worker_cpus argument\n");
+                        return 1;
+                    }
+                    settings.worker_cpus = strdup(subopts_value);
+                    break;
+                case WORKER_NODES:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing worker_nodes argument\n");
+                        return 1;
+                    }
+                    settings.worker_nodes = strdup(subopts_value);
+                    break;
+                case WORKER_RXQ:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing worker_rxq argument\n");
+                        return 1;
+                    }
+                    settings.worker_rxq = strdup(subopts_value);
+                    break;
+                case BG_CPUS:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing bg_cpus argument\n");
+                        return 1;
+                    }
+                    settings.bg_cpus = strdup(subopts_value);
+                    break;
                 
 #ifdef EXTSTORE
                 case EXT_PAGE_SIZE:
@@ -207,6 +429,20 @@ int main (int argc, char **argv) {
                         return 1;
                     }
                     break;
+                case EXT_IO_ENGINE:
+                    if (subopts_value == NULL) {
+                        fprintf(stderr, "Missing ext_io_engine argument\n");
+                        return 1;
+                    }
+                    if (strcmp(subopts_value, "threads") == 0) {
+                        ext_cf.io_engine = EXTSTORE_IO_THREADS;
+                    } else if (strcmp(subopts_value, "uring") == 0) {
+                        ext_cf.io_engine = EXTSTORE_IO_URING;
+                    } else {
+                        fprintf(stderr, "ext_io_engine must be one of: threads, uring\n");
+                        return 1;
+                    }
+                    break;
                 case EXT_ITEM_SIZE:
                     if (subopts_value == NULL) {
                         fprintf(stderr, "Missing ext_item_size argument\n");
@@ -329,6 +565,10 @@ int main (int argc, char **argv) {
 #endif
 
     // 其他代码
+    if (thread_affinity_init(settings.num_threads) != 0) {
+        exit(EX_USAGE);
+    }
+
 #ifdef EXTSTORE
     if (storage_file) {
         enum extstore_res eres;
@@ -342,6 +582,7 @@ int main (int argc, char **argv) {
         for (int x = 0; x < MAX_NUMBER_OF_SLAB_CLASSES; x++) {
             settings.ext_free_memchunks[x] = 0;
         }
+        ext_cf.thread_attr = thread_bg_attr();
         storage = extstore_init(storage_file, &ext_cf, &eres);
         if (storage == NULL) {
             fprintf(stderr, "Failed to initialize external storage: %s\n",
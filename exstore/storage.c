@@ -3,6 +3,7 @@
 #ifdef EXTSTORE
 
 #include "storage.h"
+#include "crc32c.h"
 #include <stdblib.h>
 #include <string.h>
 #include <limits.h>
@@ -14,99 +15,208 @@
 #define PAGE_BUCKET_LOWTTL  3
 
 /** WRITE FLUSH THREAD **/
-static int storage_write(void *storage, const int clsid, const int item_age) {
-    int did_moves = 0;
-    struct lru_pull_tail_return it_info;
 
-    it_info.it = NULL;
-    lru_pull_tail(clsid, COLD_LRU, 0, LRU_PULL_RETURN_ITEM, 0, &it_info);
-    /* Item is locked, and we have a reference to it. */
-    if (it_info.it == NULL) {
-        return did_moves;
+/* Items pulled per class per pass. lru_pull_tail() only walks a few items up
+ * the COLD tail and skips the ones whose lock we already hold, so a larger
+ * batch would rarely fill.
+ */
+#define STORAGE_WRITE_BATCH 4
+
+typedef struct {
+    item *it;           // locked, referenced COLD item
+    item *hdr_it;       // header that replaces it once written
+    uint32_t hv;
+    int bucket;
+    unsigned int len;   // ITEM_ntotal(it)
+    unsigned int boff;  // offset within its bucket's write request
+    bool written;
+} storage_write_entry;
+
+/* Copies an item into the write buffer as if it were one contiguous object.
+ * The start of the item (before STORE_OFFSET) is left dirty; it's filled
+ * from the header item on read.
+ */
+static void storage_write_copy(char *buf, item *it, unsigned int ntotal) {
+    // TODO: should be in items.c
+    if (it->it_flags & ITEM_CHUNKED) {
+        // Need to loop through the item and copy
+        item_chunk *sch = (item_chunk *) ITEM_schunk(it);
+        int remain = ntotal;
+        int copied = 0;
+        // copy original header
+        int hdrtotal = ITEM_ntotal(it) - it->nbytes;
+        memcpy(buf+STORE_OFFSET, (char *)it+STORE_OFFSET, hdrtotal - STORE_OFFSET);
+        copied = hdrtotal;
+        // copy data in like it were one large object.
+        while (sch && remain) {
+            assert(remain >= sch->used);
+            memcpy(buf+copied, sch->data, sch->used);
+            // FIXME: use one variabled?
+            remain -= sch->used;
+            copied += sch->used;
+            sch = sch->next;
+        }
+    } else {
+        memcpy(buf+STORE_OFFSET, (char *)it+STORE_OFFSET, ntotal-STORE_OFFSET);
     }
+}
 
+/* Pulls up to STORAGE_WRITE_BATCH items off the COLD tail. Each comes back
+ * locked and referenced, with a header item allocated for it.
+ */
+static int storage_write_collect(const int clsid, const int item_age,
+        storage_write_entry *batch) {
+    unsigned int total = 0;
+    int count = 0;
+
+    while (count < STORAGE_WRITE_BATCH) {
+        struct lru_pull_tail_return it_info;
+        storage_write_entry *ent = &batch[count];
+        uint32_t flags;
+
+        it_info.it = NULL;
+        lru_pull_tail(clsid, COLD_LRU, 0, LRU_PULL_RETURN_ITEM, 0, &it_info);
+        /* Item is locked, and we have a reference to it. */
+        if (it_info.it == NULL) {
+            break;
+        }
+
+        item *it = it_info.it;
+        /* First, storage for the header obejct */
+        size_t orig_ntotal = ITEM_ntotal(it);
+        item *hdr_it = NULL;
+        // the whole batch has to fit in one write buffer.
+        if ((it->it_flags & ITEM_HDR) == 0 &&
+                (item_age == 0 || current_time - it->time > item_age) &&
+                total + orig_ntotal <= settings.ext_wbuf_size) {
+            FLAGS_CONV(it, flags);
+            hdr_it = do_item_alloc(ITEM_key(it), it->nkey, flags, it->exptime, sizeof(item_hdr));
+        }
+        if (hdr_it == NULL) {
+            do_item_remove(it);
+            item_unlock(it_info.hv);
+            break;
+        }
+
+        ent->bucket = (it->it_flags & ITEM_CHUNKED) ?
+            PAGE_BUCKET_CHUNKED : PAGE_BUCKET_DEFAULT;
+        // Compress soon to expire items into similar pages
+        if (it->exptime - current_time < settings.ext_low_ttl) {
+            ent->bucket = PAGE_BUCKET_LOWTTL;
+        }
+        hdr_it->it_flags |= ITEM_HDR;
+        // NOTE: when the item is read back in, the slab mover
+        // may see it. Important to have refcount>=2 or ~ITEM_LINKED
+        assert(it->refcount >= 2);
+        ent->it = it;
+        ent->hdr_it = hdr_it;
+        ent->hv = it_info.hv;
+        ent->len = orig_ntotal;
+        ent->written = false;
+        total += orig_ntotal;
+        count++;
+    }
+
+    return count;
+}
+
+/* Writes every batch entry headed for one page bucket with a single write
+ * request: copy them back to back, then CRC the lot in one sequential pass
+ * while it's still hot in cache.
+ */
+static void storage_write_bucket(void *storage, storage_write_entry *batch,
+        const int count, const int bucket) {
+    unsigned int len = 0;
+    unsigned int n = 0;
     obj_io io;
-    item *it = it_info.it;
-    /* First, storage for the header obejct */
-    size_t orig_ntotal = ITEM_ntotal(it);
-    uint32_t flags;
-    if ((it->it_flags & ITEM_HDR) == 0 && 
-            (item_age == 0 || current_time - it->time > item_age)) {
-        FLAGS_CONV(it, flags);
-        item *hdr_it = do_item_alloc(ITEM_key(it), it->nkey, flags, it->exptime, sizeof(item_hdr));
-        /* Run the storage write understanding the start of the item is dirty.
-         * We will fill it (time/exptime/etc) from the header item on read.
-         */
-        if (hdr_it != NULL) {
-            int bucket = (it->it_flags & ITEM_CHUNKED) ? 
-                PAGE_BUCKET_CHUNKED : PAGE_BUCKET_DEFAULT;
-            // Compress soon to expire items into similar pages
-            if (it->exptime - current_time < settings.ext_low_ttl) {
-                bucket = PAGE_BUCKET_LOWTTL;
-            }
-            hdr_it->it_flags |= ITEM_HDR;
-            io.len = orig_ntotal;
-            io.mode = OBJ_IO_WRITE;
-            // NOTE: when the item is read back in, the slab mover
-            // may see it. Important to have refcount>=2 or ~ITEM_LINKED
-            assert(it->refcount >= 2);
-            // NOTE: write bucket vs free page bucket will disambiguate once
-            // lowttl feature is better understood.
-            if (extstore_write_request(storage, bucket, bucket, &io) == 0) {
-                // cuddle the hash value into the time field so we don't have
-                // to recalculate it.
-                item *buf_it = (item *)io.buf;
-                buf_it->time = it_info.hv;
-                // copy from past the headers + time headers
-                // TODO: should be in items.c
-                if (it->it_flags & ITEM_CHUNKED) {
-                    // Need to loop through the item and copy
-                    item_chunk *sch = (item_chunk *) ITEM_schunk(it);
-                    int remain = orig_ntotal;
-                    int copied = 0;
-                    // copy original header
-                    int hdrtotal = ITEM_ntotal(it) - it->nbytes;
-                    memcpy((char *)io.buf+STORE_OFFSET, (char *)it+STORE_OFFSET, hdrtotal - STORE_OFFSET);
-                    copied = hdrtotal;
-                    // copy data in like it were one large object.
-                    while (sch && remain) {
-                        assert(remain >= sch->used);
-                        memcpy((char *)io.buf+copied, sch->data, sch->used);
-                        // FIXME: use one variabled?
-                        remain -= sch->used;
-                        copied += sch->used;
-                        sch = sch->next;
-                    }
-                } else {
-                    memcpy((char *)io.buf+STORE_OFFSET, (char *)it+STORE_OFFSET, io.len-STORE_OFFSET);
-                }
-                // crc what we copied so we can do it sequentially
-                buf_it->it_flags &= ~ITEM_LINKED;
-                buf_it->exptime = crc32c(0, (char *)io.buf+STORE_OFFSET, orig_ntotal-STORE_OFFSET);
-                extstore_write(storage, &io);
-                item_hdr *hdr = (item_hdr *)ITEM_data(hdr_it);
-                hdr->page_version = io.page_version;
-                hdr->page_id = io.page_id;
-                hdr->offset = io.offset;
-                // overload nbytes for the header it
-                hdr_it->nbytes = it->nbytes;
-                /* success! Now we need to fill erlevant data into the new
-                 * header and replace. Most of this requires the item lock
-                 */
-                /* CAS gets set while linking. Copy post-value */
-                item_replace(it, hdr_it, it_info.hv);
-                ITEM_set_cas(hdr_it, ITEM_get_cas(it));
-                do_item_remove(hdr_it);
-                did_moves = 1;
-                LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EXTSTORE_WRITE, it, bucket);
-            } else {
-                /* Failed to write for some reason, can't continue. */
-                slabs_free(hdr_it, ITEM_ntotal(hdr_it), ITEM_clsid(hdr_it));
-            }
+    int x;
+
+    for (x = 0; x < count; x++) {
+        if (batch[x].bucket != bucket)
+            continue;
+        batch[x].boff = len;
+        len += batch[x].len;
+        n++;
+    }
+    if (n == 0)
+        return;
+
+    io.len = len;
+    io.mode = OBJ_IO_WRITE;
+    // NOTE: write bucket vs free page bucket will disambiguate once
+    // lowttl feature is better understood.
+    if (extstore_write_request(storage, bucket, bucket, &io) != 0)
+        return;
+
+    for (x = 0; x < count; x++) {
+        if (batch[x].bucket != bucket)
+            continue;
+        char *buf = (char *)io.buf + batch[x].boff;
+        storage_write_copy(buf, batch[x].it, batch[x].len);
+        // cuddle the hash value into the time field so we don't have
+        // to recalculate it.
+        ((item *)buf)->time = batch[x].hv;
+        ((item *)buf)->it_flags &= ~ITEM_LINKED;
+    }
+    for (x = 0; x < count; x++) {
+        if (batch[x].bucket != bucket)
+            continue;
+        item *buf_it = (item *)((char *)io.buf + batch[x].boff);
+        buf_it->exptime = crc32c(0, (char *)buf_it+STORE_OFFSET, batch[x].len-STORE_OFFSET);
+    }
+    extstore_write_batch(storage, &io, n);
+
+    for (x = 0; x < count; x++) {
+        if (batch[x].bucket != bucket)
+            continue;
+        item_hdr *hdr = (item_hdr *)ITEM_data(batch[x].hdr_it);
+        hdr->page_version = io.page_version;
+        hdr->page_id = io.page_id;
+        hdr->offset = io.offset + batch[x].boff;
+        // overload nbytes for the header it
+        batch[x].hdr_it->nbytes = batch[x].it->nbytes;
+        batch[x].written = true;
+    }
+}
+
+/* Flushes a batch of COLD items from one class to storage. Items are
+ * collected and held locked, written grouped by page bucket, then all of
+ * their headers are swapped in before any lock is dropped.
+ * Returns the number of items moved.
+ */
+static int storage_write(void *storage, const int clsid, const int item_age) {
+    storage_write_entry batch[STORAGE_WRITE_BATCH];
+    int did_moves = 0;
+    int count, x;
+
+    count = storage_write_collect(clsid, item_age, batch);
+    if (count == 0)
+        return 0;
+
+    storage_write_bucket(storage, batch, count, PAGE_BUCKET_DEFAULT);
+    storage_write_bucket(storage, batch, count, PAGE_BUCKET_CHUNKED);
+    storage_write_bucket(storage, batch, count, PAGE_BUCKET_LOWTTL);
+
+    for (x = 0; x < count; x++) {
+        item *it = batch[x].it;
+        item *hdr_it = batch[x].hdr_it;
+        if (batch[x].written) {
+            /* success! Now we need to fill erlevant data into the new
+             * header and replace. Most of this requires the item lock
+             */
+            /* CAS gets set while linking. Copy post-value */
+            item_replace(it, hdr_it, batch[x].hv);
+            ITEM_set_cas(hdr_it, ITEM_get_cas(it));
+            do_item_remove(hdr_it);
+            did_moves++;
+            LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EXTSTORE_WRITE, it, batch[x].bucket);
+        } else {
+            /* Failed to write for some reason, can't continue. */
+            slabs_free(hdr_it, ITEM_ntotal(hdr_it), ITEM_clsid(hdr_it));
         }
+        do_item_remove(it);
+        item_unlock(batch[x].hv);
     }
-    do_item_remove(it);
-    item_unlink(it_info.hv);
     return did_moves;
 }
 
@@ -164,8 +274,9 @@ static void *storage_write_thread(void *arg) {
                 } else {
                     item_age = settings.ext_item_age;
                 }
-                if (storage_write(storage, x, item_age)) {
-                    chunks_free++;  // Allow stopping if we've done enough this loop
+                int moved = storage_write(storage, x, item_age);
+                if (moved) {
+                    chunks_free += moved;  // Allow stopping if we've done enough this loop
                     did_move = true;
                     do_sleep = false;
                     if (to_sleep > WRITE_SLEEP_MIN) {
@@ -222,7 +333,7 @@ int start_storage_write_thread(void *arg) {
     int ret;
 
     pthread_mutex_init(&storage_write_plock, NULL);
-    if ((ret = pthread_create(&storage_write_tid, NULL,
+    if ((ret = pthread_create(&storage_write_tid, thread_bg_attr(),
                 storage_write_thread, arg)) != 0) {
         fprintf(stderr, "Can't create storage_write thread: %s\n", 
                 strerror(ret));
@@ -558,7 +669,7 @@ int start_storage_compact_thread(void *arg) {
     int ret;
 
     pthread_mutex_init(&storage_compact_plock, NULL);
-    if ((ret = pthread_create(&storage_compact_tid, NULL,
+    if ((ret = pthread_create(&storage_compact_tid, thread_bg_attr(),
             storage_compact_thread, arg)) != 0) {
         fprintf(stderr, "Can't create storage_compact thread: %s\n",
             strerror(ret));
@@ -614,11 +725,13 @@ struct extstore_conf_file *storage_conf_parse(char *arg, unsigned int page_size)
     cf->page_count = multiplier / page_size;
     assert(page_size * cf->page_count <= multiplier);
 
-    // final token would be a default free bucket
-    p = strtok_r(NULL, ",", &b);
+    // remaining tokens are an optional default free bucket and IO flags,
+    // ie: ext_path=/f/e:64g:direct:noreadahead
     // TODO: We reuse the original DEFINES for now.
     // but if lowttl gets split up this needs to be its own set.
-    if (p != NULL) {
+    cf->free_bucket = PAGE_BUCKET_DEFAULT;
+    cf->readahead = true;
+    while ((p = strtok_r(NULL, ":", &b)) != NULL) {
         if (strcmp(p, "compact") == 0) {
             cf->free_bucket = PAGE_BUCKET_COMPACT;
         } else if (strcmp(p, "lowttl") == 0) {
@@ -627,13 +740,14 @@ struct extstore_conf_file *storage_conf_parse(char *arg, unsigned int page_size)
             cf->free_bucket = PAGE_BUCKET_CHUNKED;
         } else if (strcmp(p, "default") == 0) {
             cf->free_bucket = PAGE_BUCKET_DEFAULT;
+        } else if (strcmp(p, "direct") == 0) {
+            cf->direct_io = true;
+        } else if (strcmp(p, "noreadahead") == 0) {
+            cf->readahead = false;
         } else {
-            fprintf(stderr, "Unknown extstore bucket: %s\n", p);
+            fprintf(stderr, "Unknown extstore bucket or flag: %s\n", p);
             goto error;
         }
-    } else {
-        // TODO: is this necessary?
-        cf->free_bucket = PAGE_BUCKET_DEFAULT;
     }
 
     // TODO: disabling until compact algorithm is improved.
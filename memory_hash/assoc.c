@@ -1,4 +1,5 @@
 #include "memcached.h"
+#include "assoc.h"
 
 typedef uint32_t (*hash_func)(const void *key, size_t length);
 extern hash_func hash;
@@ -9,6 +10,9 @@ extern hash_func hash;
 #include <cstring>
 #include <cassert>
 #include <pthread.h>
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+#endif
 
 static pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -22,48 +26,586 @@ unsigned int hashpower = HASHPOWER_DEFAULT;
 #define hashsize(n) ((ub4)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
-/* Main hash table. This is where we lock except during expansion */
-static item** primary_hashtable = 0;
+/*
+ * Bucketed index (settings.hash_index == HASH_INDEX_BUCKETED).
+ *
+ * Each bucket is one cache line holding six item pointers plus a one byte
+ * tag per slot taken from the top bits of the hash value. A lookup loads the
+ * tag bytes as a single word and compares all of them at once, so only slots
+ * whose tag matches ever touch an item header. A full bucket spills into the
+ * next bucket of its probe sequence; the overflow byte counts how many items
+ * probed past a bucket, so misses stop at the first bucket with no overflow
+ * instead of walking the table. Only when the whole probe sequence is full
+ * does an item fall back to an h_next chain hung off its home bucket.
+ *
+ * The probe sequence steps by the size of the item lock table, so every
+ * bucket an item can land in is covered by the same item_lock() stripe as its
+ * home bucket, and one lock covers a whole insert, delete or migration the
+ * same way it covers a chain. Slots are published pointer first and tag
+ * second and cleared tag first and pointer second, so workers can look keys
+ * up without the lock (see assoc_find_ref()); everyone else still looks up
+ * under item_lock(hv) with assoc_find().
+ */
+#define ASSOC_BUCKET_SLOTS 6
+#define ASSOC_OVERFLOW ASSOC_BUCKET_SLOTS   // index of the overflow byte
+#define ASSOC_MIGRATED (ASSOC_BUCKET_SLOTS + 1) // set once migrated to a new table
+#define ASSOC_OVERFLOW_MAX 255              // saturated counts never drop
+#define ASSOC_SLOT_MASK ((1U << ASSOC_BUCKET_SLOTS) - 1)
+#define ASSOC_TAG_EMPTY 0
+
+typedef union {
+    uint64_t word;      // loaded whole for the tag compare
+    uint8_t  tag[8];    // tag[0..5] per slot, tag[6] overflow count, tag[7] migrated
+} assoc_meta;
+
+typedef struct {
+    assoc_meta meta;
+    item *slot[ASSOC_BUCKET_SLOTS];
+    item *chain;        // h_next chain used once the probe sequence is full
+} __attribute__((aligned(64))) assoc_bucket;
+
+static inline uint8_t assoc_tag(const uint32_t hv) {
+    uint8_t tag = hv >> 24;
+    return tag == ASSOC_TAG_EMPTY ? 1 : tag;
+}
+
+/* Returns a bitmask of the slots whose tag equals the given one. */
+static inline uint32_t assoc_tag_match(const uint64_t word, const uint8_t tag) {
+#if defined(__SSE2__) && defined(__x86_64__)
+    __m128i tags = _mm_cvtsi64_si128((long long)word);
+    __m128i want = _mm_set1_epi8((char)tag);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(tags, want)) & ASSOC_SLOT_MASK;
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /*
+     * SWAR: zero out matching bytes, flag each zero byte in its high bit and
+     * gather the flags into the low byte. A byte just above a real match can
+     * be flagged too; the key compare weeds those out.
+     */
+    uint64_t x = word ^ (0x0101010101010101ULL * tag);
+    uint64_t z = (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+    return (uint32_t)(((z >> 7) * 0x0102040810204080ULL) >> 56) & ASSOC_SLOT_MASK;
+#else
+    assoc_meta m;
+    uint32_t mask = 0;
+    int i;
+    m.word = word;
+    for (i = 0; i < ASSOC_BUCKET_SLOTS; i++) {
+        if (m.tag[i] == tag)
+            mask |= 1U << i;
+    }
+    return mask;
+#endif
+}
+
+/*
+ * Probing stays within the item lock stripe of the home bucket, so the
+ * sequence is as long as the number of buckets sharing one stripe.
+ */
+static inline ub4 assoc_probe_stride(void) {
+    return hashsize(item_lock_hashpower);
+}
+
+static inline ub4 assoc_probe_limit(const unsigned int power) {
+    return hashsize(power - item_lock_hashpower);
+}
+
+static inline bool assoc_key_match(const item *it, const char *key, const size_t nkey) {
+    return it && (nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0);
+}
+
+/*
+ * One sequence count per item lock stripe, bumped to odd and back around
+ * every change to the stripe's buckets. Unlocked lookups only trust a miss
+ * if the count was even and unchanged throughout: an item can move between
+ * buckets of its probe sequence (a replace frees one slot and takes the
+ * first free one), and a scan racing that could otherwise miss a key that
+ * never went away. Allocated with the maintenance thread, once the item
+ * lock table is sized.
+ */
+static unsigned int *assoc_seq = NULL;
+
+/*
+ * Brackets a change to the buckets of hv's stripe. Caller holds
+ * item_lock(hv), so nobody else writes the count meanwhile. Brackets nest:
+ * an inner one finds the count already odd and leaves it alone, which lets
+ * do_item_replace() cover its delete and insert as one change.
+ */
+bool assoc_write_begin(const uint32_t hv) {
+    unsigned int *seq;
+
+    if (assoc_seq == NULL)
+        return false;
+    seq = &assoc_seq[hv & hashmask(item_lock_hashpower)];
+    if (*seq & 1)
+        return false;
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return true;
+}
+
+void assoc_write_end(const uint32_t hv, const bool opened) {
+    if (opened) {
+        unsigned int *seq = &assoc_seq[hv & hashmask(item_lock_hashpower)];
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static item *bucket_find(assoc_bucket *table, const unsigned int power,
+        const char *key, const size_t nkey, const uint32_t hv) {
+    const uint8_t tag = assoc_tag(hv);
+    const ub4 mask = hashmask(power);
+    const ub4 stride = assoc_probe_stride();
+    ub4 probes = assoc_probe_limit(power);
+    ub4 b = hv & mask;
+    item *it;
+
+    for (; probes > 0; probes--, b = (b + stride) & mask) {
+        assoc_bucket *bk = &table[b];
+        assoc_meta m;
+        uint32_t hits;
+
+        m.word = __atomic_load_n(&bk->meta.word, __ATOMIC_ACQUIRE);
+        hits = assoc_tag_match(m.word, tag);
+        while (hits) {
+            int i = __builtin_ctz(hits);
+            it = __atomic_load_n(&bk->slot[i], __ATOMIC_ACQUIRE);
+            hits &= hits - 1;
+            if (assoc_key_match(it, key, nkey)) {
+                return it;
+            }
+        }
+        if (m.tag[ASSOC_OVERFLOW] == 0)
+            break;
+    }
+
+    it = __atomic_load_n(&table[hv & mask].chain, __ATOMIC_ACQUIRE);
+    while (it) {
+        if (assoc_key_match(it, key, nkey)) {
+            return it;
+        }
+        it = __atomic_load_n(&it->h_next, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
 
 /*
- * Previous hash table. During expansion, we lock here for keys that haven't
- * been moved over to the primary yet
+ * bucket_find() without item_lock(hv). A candidate is referenced first and
+ * checked after: its slot must still hold it, it must still be linked, and
+ * its key must match. An item unlinked, freed and reused meanwhile is never
+ * returned that way. A slot that changes under the scan, an item being
+ * unlinked and an overflow chain all set *retry instead, and the caller
+ * asks again under the lock.
  */
-static item** old_hashtable = 0;
+static item *bucket_find_ref(assoc_bucket *table, const unsigned int power,
+        const char *key, const size_t nkey, const uint32_t hv, bool *retry) {
+    const uint8_t tag = assoc_tag(hv);
+    const ub4 mask = hashmask(power);
+    const ub4 stride = assoc_probe_stride();
+    ub4 probes = assoc_probe_limit(power);
+    ub4 b = hv & mask;
+    item *it;
+
+    for (; probes > 0; probes--, b = (b + stride) & mask) {
+        assoc_bucket *bk = &table[b];
+        assoc_meta m;
+        uint32_t hits;
+
+        m.word = __atomic_load_n(&bk->meta.word, __ATOMIC_ACQUIRE);
+        hits = assoc_tag_match(m.word, tag);
+        while (hits) {
+            int i = __builtin_ctz(hits);
+            hits &= hits - 1;
+            it = __atomic_load_n(&bk->slot[i], __ATOMIC_ACQUIRE);
+            if (it == NULL || !refcount_incr_live(it)) {
+                *retry = true;
+                return NULL;
+            }
+            if (__atomic_load_n(&bk->slot[i], __ATOMIC_ACQUIRE) != it ||
+                    (__atomic_load_n(&it->it_flags, __ATOMIC_ACQUIRE) & ITEM_LINKED) == 0) {
+                do_item_remove(it);
+                *retry = true;
+                return NULL;
+            }
+            if (assoc_key_match(it, key, nkey)) {
+                return it;
+            }
+            do_item_remove(it);
+        }
+        if (m.tag[ASSOC_OVERFLOW] == 0)
+            break;
+    }
+
+    if (__atomic_load_n(&table[hv & mask].chain, __ATOMIC_ACQUIRE) != NULL)
+        *retry = true;
+    return NULL;
+}
+
+/* Bumps the overflow count of the first `dist` buckets of a probe sequence. */
+static void bucket_overflow_adjust(assoc_bucket *table, const unsigned int power,
+        const uint32_t hv, ub4 dist, const int delta) {
+    const ub4 mask = hashmask(power);
+    const ub4 stride = assoc_probe_stride();
+    ub4 b = hv & mask;
+
+    for (; dist > 0; dist--, b = (b + stride) & mask) {
+        uint8_t *ov = &table[b].meta.tag[ASSOC_OVERFLOW];
+        uint8_t cur = *ov;
+        if (cur == ASSOC_OVERFLOW_MAX)
+            continue;
+        __atomic_store_n(ov, (uint8_t)(cur + delta), __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Places an item in the first free slot of its probe sequence. Returns 0 if
+ * the sequence is full. Caller holds item_lock(hv).
+ */
+static int bucket_insert_slot(assoc_bucket *table, const unsigned int power,
+        item *it, const uint32_t hv) {
+    const ub4 mask = hashmask(power);
+    const ub4 stride = assoc_probe_stride();
+    const ub4 limit = assoc_probe_limit(power);
+    ub4 b = hv & mask;
+    ub4 dist;
+
+    for (dist = 0; dist < limit; dist++, b = (b + stride) & mask) {
+        assoc_bucket *bk = &table[b];
+        uint32_t free_slots = assoc_tag_match(bk->meta.word, ASSOC_TAG_EMPTY);
+        if (free_slots) {
+            int i = __builtin_ctz(free_slots);
+            __atomic_store_n(&bk->slot[i], it, __ATOMIC_RELEASE);
+            __atomic_store_n(&bk->meta.tag[i], assoc_tag(hv), __ATOMIC_RELEASE);
+            bucket_overflow_adjust(table, power, hv, dist, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void bucket_insert_chain(assoc_bucket *table, const unsigned int power,
+        item *it, const uint32_t hv) {
+    assoc_bucket *home = &table[hv & hashmask(power)];
+    it->h_next = home->chain;
+    __atomic_store_n(&home->chain, it, __ATOMIC_RELEASE);
+}
+
+/* Caller holds item_lock(hv). */
+static void bucket_insert(assoc_bucket *table, const unsigned int power,
+        item *it, const uint32_t hv) {
+    if (!bucket_insert_slot(table, power, it, hv)) {
+        bucket_insert_chain(table, power, it, hv);
+    }
+}
+
+/* Caller holds item_lock(hv). Returns the unlinked item or NULL. */
+static item *bucket_remove(assoc_bucket *table, const unsigned int power,
+        const char *key, const size_t nkey, const uint32_t hv) {
+    const uint8_t tag = assoc_tag(hv);
+    const ub4 mask = hashmask(power);
+    const ub4 stride = assoc_probe_stride();
+    const ub4 limit = assoc_probe_limit(power);
+    ub4 b = hv & mask;
+    ub4 dist;
+    item **pos;
+
+    for (dist = 0; dist < limit; dist++, b = (b + stride) & mask) {
+        assoc_bucket *bk = &table[b];
+        uint32_t hits = assoc_tag_match(bk->meta.word, tag);
+        while (hits) {
+            int i = __builtin_ctz(hits);
+            item *it = bk->slot[i];
+            hits &= hits - 1;
+            if (assoc_key_match(it, key, nkey)) {
+                __atomic_store_n(&bk->meta.tag[i], ASSOC_TAG_EMPTY, __ATOMIC_RELEASE);
+                __atomic_store_n(&bk->slot[i], (item *)NULL, __ATOMIC_RELEASE);
+                bucket_overflow_adjust(table, power, hv, dist, -1);
+                return it;
+            }
+        }
+        if (bk->meta.tag[ASSOC_OVERFLOW] == 0)
+            break;
+    }
+
+    for (pos = &table[hv & mask].chain; *pos; pos = &(*pos)->h_next) {
+        item *it = *pos;
+        if (assoc_key_match(it, key, nkey)) {
+            __atomic_store_n(pos, it->h_next, __ATOMIC_RELEASE);
+            return it;
+        }
+    }
+    return NULL;
+}
+
+static assoc_bucket *bucket_table_alloc(const unsigned int power) {
+    void *table = NULL;
+    size_t len = hashsize(power) * sizeof(assoc_bucket);
+    if (posix_memalign(&table, sizeof(assoc_bucket), len) != 0) {
+        return NULL;
+    }
+    memset(table, 0, len);
+    return (assoc_bucket *)table;
+}
+
+/*
+ * The hash tables in use, published as one snapshot so that the power, the
+ * primary table and the table being drained always agree. Expansion swaps in
+ * a new snapshot instead of stopping the workers: every lookup loads the
+ * snapshot once, and retired snapshots are only freed after a grace period.
+ */
+struct assoc_table {
+    unsigned int hashpower;
+    /* Main hash table. This is where we lock except during expansion */
+    item **primary_hashtable;
+    /*
+     * Previous hash table. During expansion, keys that haven't been moved
+     * over to the primary yet live here. NULL when not expanding.
+     */
+    item **old_hashtable;
+    /* Same for the bucketed index */
+    assoc_bucket *primary_buckets;
+    assoc_bucket *old_buckets;
+};
+
+static struct assoc_table *assoc_current = 0;
+/* snapshot replaced by the expansion in progress, freed when it finishes */
+static struct assoc_table *assoc_retired = 0;
 
-/* flag: Are we in the middle of expanding now? */
-static bool expanding = false;
 static bool started_expanding = false;
 
 /*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ * The background migration cursor. Lookups and inserts migrate the bucket
+ * they touch themselves, so the cursor only bounds how long an expansion can
+ * take; buckets it reaches may already be done.
+ * Ranges from 0 .. hashsize(hashpower - 1) - 1.
  */
 static unsigned int expand_bucket = 0;
 
+/* Marks an old chained bucket whose items have been moved to the primary */
+#define ASSOC_CHAIN_MIGRATED ((item *)1)
+
+static inline struct assoc_table *assoc_table_get(void) {
+    return __atomic_load_n(&assoc_current, __ATOMIC_ACQUIRE);
+}
+
+static inline bool assoc_expanding(const struct assoc_table *t) {
+    return t->old_hashtable != NULL || t->old_buckets != NULL;
+}
+
+static struct assoc_table *assoc_table_new(const unsigned int power) {
+    struct assoc_table *t = (struct assoc_table *)calloc(1, sizeof(struct assoc_table));
+    if (t) {
+        t->hashpower = power;
+    }
+    return t;
+}
+
+/*
+ * Moves the items of old bucket `ob` into the primary table, unless someone
+ * got there first. Caller holds the item lock covering `ob`.
+ */
+static void chain_migrate(struct assoc_table *t, const unsigned int ob) {
+    item *it, *next;
+    unsigned int bucket;
+
+    if (t->old_hashtable[ob] == ASSOC_CHAIN_MIGRATED)
+        return;
+
+    for (it = t->old_hashtable[ob]; NULL != it; it = next) {
+        next = it->h_next;
+        bucket = hash(ITEM_key(it), it->nkey) & hashmask(t->hashpower);
+        it->h_next = t->primary_hashtable[bucket];
+        t->primary_hashtable[bucket] = it;
+    }
+    t->old_hashtable[ob] = ASSOC_CHAIN_MIGRATED;
+}
+
+/*
+ * Returns the head of the chain `hv` belongs to, pulling its old bucket
+ * across first while expanding. Caller holds item_lock(hv).
+ */
+static item **chain_head(struct assoc_table *t, const uint32_t hv) {
+    if (t->old_hashtable) {
+        chain_migrate(t, hv & hashmask(t->hashpower - 1));
+    }
+    return &t->primary_hashtable[hv & hashmask(t->hashpower)];
+}
+
+static inline bool bucket_migrated(const assoc_bucket *bk) {
+    return __atomic_load_n(&bk->meta.tag[ASSOC_MIGRATED], __ATOMIC_ACQUIRE) != 0;
+}
+
+/*
+ * Copies every item whose home is old bucket `ob` into the primary table and
+ * then flags the bucket as migrated. Nothing is written to the old table
+ * after expansion starts, so the copies stay readable there until the table
+ * is retired; readers that lose the race with the flag just retry on the
+ * primary. Caller holds the item lock covering `ob`.
+ */
+static void bucket_migrate(struct assoc_table *t, const unsigned int ob) {
+    const unsigned int oldpower = t->hashpower - 1;
+    const ub4 mask = hashmask(oldpower);
+    const ub4 stride = assoc_probe_stride();
+    const ub4 limit = assoc_probe_limit(oldpower);
+    assoc_bucket *home = &t->old_buckets[ob];
+    item *it, *next, *chain;
+    ub4 b = ob;
+    ub4 dist;
+
+    if (bucket_migrated(home))
+        return;
+
+    for (dist = 0; dist < limit; dist++, b = (b + stride) & mask) {
+        assoc_bucket *bk = &t->old_buckets[b];
+        uint32_t used = ~assoc_tag_match(bk->meta.word, ASSOC_TAG_EMPTY) & ASSOC_SLOT_MASK;
+        while (used) {
+            int i = __builtin_ctz(used);
+            uint32_t hv;
+            it = bk->slot[i];
+            hv = hash(ITEM_key(it), it->nkey);
+            used &= used - 1;
+            if ((hv & mask) == ob) {
+                bucket_insert(t->primary_buckets, t->hashpower, it, hv);
+            }
+        }
+        if (bk->meta.tag[ASSOC_OVERFLOW] == 0)
+            break;
+    }
+
+    /*
+     * Chained items keep their h_next valid for readers of the old table
+     * until the bucket is flagged; only the ones that don't fit a free slot
+     * get relinked into a primary chain, and only afterwards.
+     */
+    chain = home->chain;
+    for (it = chain; it != NULL; it = it->h_next) {
+        bucket_insert_slot(t->primary_buckets, t->hashpower, it,
+                hash(ITEM_key(it), it->nkey));
+    }
+
+    __atomic_store_n(&home->meta.tag[ASSOC_MIGRATED], (uint8_t)1, __ATOMIC_RELEASE);
+
+    for (it = chain; it != NULL; it = next) {
+        uint32_t hv = hash(ITEM_key(it), it->nkey);
+        next = it->h_next;
+        if (bucket_find(t->primary_buckets, t->hashpower, ITEM_key(it), it->nkey, hv) != it) {
+            bucket_insert_chain(t->primary_buckets, t->hashpower, it, hv);
+        }
+    }
+}
+
+/*
+ * Returns the table writes for `hv` go to, pulling its old bucket across
+ * first while expanding. Caller holds item_lock(hv).
+ */
+static assoc_bucket *bucket_table_for_write(struct assoc_table *t, const uint32_t hv) {
+    if (t->old_buckets) {
+        bucket_migrate(t, hv & hashmask(t->hashpower - 1));
+    }
+    return t->primary_buckets;
+}
+
 void assoc_init(const int hashtable_init) {
+    struct assoc_table *t;
+
     if (hashtable_init) {
         hashpower = hashtable_init;
     }
-    primary_hashtable = (item**)calloc(hashsize(hashpower), sizeof(void *));
-    if (! primary_hashtable) {
+    t = assoc_table_new(hashpower);
+    if (t && settings.hash_index == HASH_INDEX_BUCKETED) {
+        t->primary_buckets = bucket_table_alloc(hashpower);
+    } else if (t) {
+        t->primary_hashtable = (item**)calloc(hashsize(hashpower), sizeof(void *));
+    }
+    if (! t || (! t->primary_hashtable && ! t->primary_buckets)) {
         fprintf(stderr, "Failed to init hashtable.\n");
         exit(EXIT_FAILURE);
     }
+    assoc_current = t;
+}
+
+/*
+ * Lookup in the bucketed index. Caller holds item_lock(hv). Buckets that
+ * haven't been flagged as migrated are looked up in the old table; a miss
+ * on a bucket flagged meanwhile is retried on the primary.
+ */
+static item *bucket_assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
+    struct assoc_table *t = assoc_table_get();
+
+    if (t->old_buckets) {
+        assoc_bucket *home = &t->old_buckets[hv & hashmask(t->hashpower - 1)];
+        if (!bucket_migrated(home)) {
+            item *it = bucket_find(t->old_buckets, t->hashpower - 1, key, nkey, hv);
+            if (it != NULL || !bucket_migrated(home))
+                return it;
+        }
+    }
+    return bucket_find(t->primary_buckets, t->hashpower, key, nkey, hv);
+}
+
+/*
+ * Lookup for workers in bucketed mode, without item_lock(hv). Returns the
+ * item with a reference taken, or NULL for a miss. Sets *retry when it can't
+ * tell without the lock; the caller then uses assoc_find() under it.
+ *
+ * The tables read here are kept alive by the worker epochs: a retired
+ * snapshot is only freed after assoc_grace_period(). Items are slab memory
+ * and never unmapped, so a stale pointer can be dereferenced safely and is
+ * caught by the checks in bucket_find_ref().
+ */
+item *assoc_find_ref(const char *key, const size_t nkey, const uint32_t hv, bool *retry) {
+    struct assoc_table *t = assoc_table_get();
+    unsigned int *seq;
+    unsigned int start;
+    item *it = NULL;
+
+    *retry = false;
+    if (assoc_seq == NULL) {
+        *retry = true;
+        return NULL;
+    }
+    seq = &assoc_seq[hv & hashmask(item_lock_hashpower)];
+    start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    if (start & 1) {
+        *retry = true;
+        return NULL;
+    }
+
+    if (t->old_buckets) {
+        assoc_bucket *home = &t->old_buckets[hv & hashmask(t->hashpower - 1)];
+        if (!bucket_migrated(home)) {
+            it = bucket_find_ref(t->old_buckets, t->hashpower - 1, key, nkey, hv, retry);
+            /* Deletes migrate the bucket first, so until it is flagged the
+             * old table is still exact. */
+            if (it != NULL && bucket_migrated(home)) {
+                do_item_remove(it);
+                it = NULL;
+                *retry = true;
+            }
+            if (it != NULL || *retry || !bucket_migrated(home))
+                goto done;
+        }
+    }
+    it = bucket_find_ref(t->primary_buckets, t->hashpower, key, nkey, hv, retry);
+
+done:
+    if (it == NULL && !*retry) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) != start)
+            *retry = true;
+    }
+    return it;
 }
 
 // hv是key所在的bucket的编号
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     item *it;
-    unsigned int oldbucket;
 
-    if (expanding && 
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket) {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        return bucket_assoc_find(key, nkey, hv);
     }
 
+    it = *chain_head(assoc_table_get(), hv);
+
     item *ret = NULL;
     int depth = 0;
     while (it) {
@@ -78,19 +620,30 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
 }
 
 /*
- *  return the address of the item pointer before the key. if *item == 0,
- *  the item wasn't found
+ * Starts loading the cache line a lookup for hv begins with, so multi-key
+ * lookups can overlap the misses of all their keys. Runs on a worker before
+ * any item lock is taken, so the snapshot it reads is only kept alive by the
+ * epoch wait in assoc_grace_period().
  */
-static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
-    unsigned int oldbucket;
+void assoc_prefetch(const uint32_t hv) {
+    struct assoc_table *t = assoc_table_get();
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >=  expand_bucket) {
-        pos = &old_hashtable[oldbucket];
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        if (t->old_buckets) {
+            __builtin_prefetch(&t->old_buckets[hv & hashmask(t->hashpower - 1)]);
+        }
+        __builtin_prefetch(&t->primary_buckets[hv & hashmask(t->hashpower)]);
     } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
+        __builtin_prefetch(&t->primary_hashtable[hv & hashmask(t->hashpower)]);
     }
+}
+
+/*
+ *  return the address of the item pointer before the key. if *item == 0,
+ *  the item wasn't found
+ */
+static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
+    item **pos = chain_head(assoc_table_get(), hv);
 
     while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
         pos = &(*pos)->h_next;
@@ -98,29 +651,95 @@ static item** _hashitem_before (const char *key, const size_t nkey, const uint32
     return pos;
 }
 
-/* grows the hashtable to the next power of 2 */
+/*
+ * grows the hashtable to the next power of 2. The new snapshot is published
+ * while workers keep running: anyone still holding the previous one is
+ * inside an item lock and sees the old table as it was, since it is only
+ * drained bucket by bucket under the item locks from here on.
+ */
 static void assoc_expand(void) {
-    old_hashtable = primary_hashtable;
+    struct assoc_table *cur = assoc_current;
+    struct assoc_table *t = assoc_table_new(cur->hashpower + 1);
+
+    if (! t)
+        return;
+
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        t->primary_buckets = bucket_table_alloc(t->hashpower);
+        t->old_buckets = cur->primary_buckets;
+    } else {
+        t->primary_hashtable = (item **)calloc(hashsize(t->hashpower), sizeof(void *));
+        t->old_hashtable = cur->primary_hashtable;
+    }
 
-    primary_hashtable = (item **)calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {
+    if (t->primary_hashtable || t->primary_buckets) {
         if (settings.verbose > 1)
             fprintf(stderr, "Hash table expansion starting\n");
-        hashpower++;
-        expanding = true;
         expand_bucket = 0;
+        assoc_retired = cur;
+        hashpower = t->hashpower;
+        __atomic_store_n(&assoc_current, t, __ATOMIC_RELEASE);
     } else {
-        primary_hashtable = old_hashtable;
+        free(t);
         /* Bad news, but we can keep running. */
     }
 }
 
+/*
+ * Waits until nobody can still be using a snapshot replaced before this
+ * call. Locked lookups are flushed out by taking each item lock once; that
+ * stalls one stripe at a time, never all workers. assoc_prefetch() and
+ * assoc_find_ref() read the snapshot without a lock, but only from workers
+ * within a drive_machine() pass, which one grace period of the worker epochs
+ * covers.
+ */
+static void assoc_grace_period(void) {
+    ub4 i;
+
+    for (i = 0; i < hashsize(item_lock_hashpower); i++) {
+        item_lock(i);
+        item_unlock(i);
+    }
+    epoch_synchronize();
+}
+
+/* Publishes the fully migrated table and frees the old one. */
+static void assoc_expand_finish(void) {
+    struct assoc_table *expanding = assoc_current;
+    struct assoc_table *t = assoc_table_new(expanding->hashpower);
+
+    if (! t)
+        return; /* try again on the next pass */
+
+    t->primary_hashtable = expanding->primary_hashtable;
+    t->primary_buckets = expanding->primary_buckets;
+    __atomic_store_n(&assoc_current, t, __ATOMIC_RELEASE);
+
+    assoc_grace_period();
+
+    free(expanding->old_hashtable);
+    free(expanding->old_buckets);
+    free(expanding);
+    free(assoc_retired);
+    assoc_retired = NULL;
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, "Hash table expansion done\n");
+    }
+}
+
 void assoc_start_expand(uint64_t curr_items) {
     if (started_expanding) {
         return;
     }
 
-    if (curr_items > (hashsize(hashpower) * 3) / 2 &&
+    uint64_t limit = (hashsize(hashpower) * 3) / 2;
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        /* keep buckets half full so spills past the home bucket stay rare */
+        limit = (hashsize(hashpower) * ASSOC_BUCKET_SLOTS) / 2;
+    }
+
+    if (curr_items > limit &&
             hashpower < HASHPOWER_MAX) {
         started_expanding = true;
         pthread_cond_signal(&maintenance_cond);
@@ -129,23 +748,35 @@ void assoc_start_expand(uint64_t curr_items) {
 
 /* Note: this isn't an assoc_update. The key must not already exist to call this */
 int assoc_insert(item *it, const uint32_t hv) {
-    unsigned int oldbucket;
+    struct assoc_table *t = assoc_table_get();
 
 // assert(assoc_find(ITEM_key(it), it->nkey) == 0); 
 // shouldn't have duplicately named things defined
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket) {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        bool opened = assoc_write_begin(hv);
+        bucket_insert(bucket_table_for_write(t, hv), t->hashpower, it, hv);
+        assoc_write_end(hv, opened);
+        return 1;
     }
 
+    item **head = chain_head(t, hv);
+    it->h_next = *head;
+    *head = it;
+
     return 1;
 }
 
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        struct assoc_table *t = assoc_table_get();
+        bool opened = assoc_write_begin(hv);
+        item *it = bucket_remove(bucket_table_for_write(t, hv), t->hashpower,
+                key, nkey, hv);
+        assoc_write_end(hv, opened);
+        assert(it != NULL);
+        return;
+    }
+
     item **before = _hashitem_before(key, nkey, hv);
 
     if (*before) {
@@ -166,7 +797,7 @@ void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
     assert(*before != 0);
 }
 
-static volatile int do_run_maintenance_thread = 0;
+static volatile int do_run_maintenance_thread = 1;
 
 #define DEFAULT_HASH_BULK_MOVE 1
 int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
@@ -176,63 +807,47 @@ static void *assoc_maintenance_thread(void *arg) {
 
     mutex_lock(&maintenance_lock);
     while (do_run_maintenance_thread) {
+        struct assoc_table *t = assoc_current;
         int ii = 0;
 
         /* There is only one expansion thread, so no need to global lock */
-        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            unsigned int bucket;
-            void *item_lock = NULL;
-
+        for (ii = 0; ii < hash_bulk_move && assoc_expanding(t); ++ii) {
             /*
              * bucket = hv & hashmask(hashpower) =>the bucket of hash table
              * is the lowest N bits of the hv, and the bucket of item_locks is 
              * also the lowest M bits of hv, and N is greater than M.
              * So we can process expanding with only one item_lock. cool!
+             *
+             * Workers migrate the buckets they touch under the same lock, so
+             * waiting for it here never takes longer than one request.
              */
-            if ((item_lock = item_trylock(expand_bucket))) {
-                for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                    next = it->h_next;
-                    bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                    it->h_next = primary_hashtable[bucket];
-                    primary_hashtable[bucket] = it;
-                }
-
-                old_hashtable[expand_bucket] = NULL;
-
-                expand_bucket++;
-                if (expand_bucket == hashsize(hashpower - 1)) {
-                    expanding = false;
-                    free(old_hashtable);
-                    if (settings.verbose > 1) {
-                        fprintf(stderr, "Hash table expansion done\n");
-                    }
-                }
+            item_lock(expand_bucket);
+            if (settings.hash_index == HASH_INDEX_BUCKETED) {
+                bool opened = assoc_write_begin(expand_bucket);
+                bucket_migrate(t, expand_bucket);
+                assoc_write_end(expand_bucket, opened);
             } else {
-                usleep(10 * 1000);
+                chain_migrate(t, expand_bucket);
             }
+            item_unlock(expand_bucket);
 
-            if (item_lock) {
-                item_trylock_unlock(item_lock);
-                item_lock = NULL;
+            expand_bucket++;
+            if (expand_bucket == hashsize(t->hashpower - 1)) {
+                assoc_expand_finish();
+                break;
             }
         }
 
-        if (!expanding) {
+        if (!assoc_expanding(assoc_current)) {
             /* We are done expanding.. just wait for next invocation */
             started_expanding = false;
             pthread_cond_wait(&maintenance_cond, &maintenance_lock);
             /*
-             * assoc_expand() swaps out the hash table entirely, so we need
-             * all threads to not hold only references related to the hash
-             * table while this happends.
-             * This is instead of a more complex, possibly slower algorithm to
-             * allow dynamic hash table expansion without causing significant
-             * wait times;
+             * assoc_expand() publishes the bigger table without pausing any
+             * thread; buckets are then pulled across by whoever touches them
+             * first, or by the loop above.
              */
-            pause_threads(PAUSE_ALL_THREADS);
             assoc_expand();
-            pause_threads(RESUME_ALL_THREADS);
         }
     }
     return NULL;
@@ -250,7 +865,14 @@ int start_assoc_maintenance_thread() {
         }
     }
     pthread_mutex_init(&maintenance_lock, NULL);
-    if ((ret = pthread_create(&maintenance_tid, NULL,
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        assoc_seq = (unsigned int *)calloc(hashsize(item_lock_hashpower), sizeof(unsigned int));
+        if (assoc_seq == NULL) {
+            fprintf(stderr, "Can't allocate hash table sequence counts\n");
+            return -1;
+        }
+    }
+    if ((ret = pthread_create(&maintenance_tid, thread_bg_attr(),
                               assoc_maintenance_thread, NULL)) != 0) {
         fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
         return -1;
@@ -4,6 +4,10 @@
 
 void assoc_init(const int hashpower_init);
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
+item *assoc_find_ref(const char *key, const size_t nkey, const uint32_t hv, bool *retry);
+bool assoc_write_begin(const uint32_t hv);
+void assoc_write_end(const uint32_t hv, const bool opened);
+void assoc_prefetch(const uint32_t hv);
 int assoc_insert(item *item, const uint32_t hv);
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
 void do_assoc_maintenance_thread(void);
@@ -3,14 +3,21 @@
 #include "jenkins_hash.h"
 #include "murmur3_hash.h"
 
+typedef void (*hash_x4_func)(const void * const *key, const size_t *length, uint32_t *out);
+
+/* four-keys-at-once kernel for the selected hash, if it has one */
+static hash_x4_func hash_x4 = NULL;
+
 int hash_init(enum hashfunc_type type) {
     switch (type) {
         case JENKINS_HASH:
             hash = jenkins_hash;
+            hash_x4 = NULL;
             settings.hash_algorithm = "jenkins";
             break;
         case MURMUR3_HASH:
             hash = MurmurHash3_x86_32;
+            hash_x4 = MurmurHash3_x86_32_x4;
             settings.hash_algorithm = "murmur3";
             break;
         default:
@@ -19,3 +26,20 @@ int hash_init(enum hashfunc_type type) {
     return 0;
 }
 
+
+/*
+ * Hashes `count` keys into out[]. Multi-key lookups use this so the
+ * selected hash can work on several keys at a time.
+ */
+void hash_batch(const void * const *keys, const size_t *lengths, const int count, uint32_t *out) {
+    int i = 0;
+
+    if (hash_x4 != NULL) {
+        for (; i + 4 <= count; i += 4) {
+            hash_x4(keys + i, lengths + i, out + i);
+        }
+    }
+    for (; i < count; i++) {
+        out[i] = hash(keys[i], lengths[i]);
+    }
+}
@@ -10,5 +10,6 @@ enum hashfunc_type {
 };
 
 int hash_init(enum hashfunc_type type);
+void hash_batch(const void * const *keys, const size_t *lengths, const int count, uint32_t *out);
 
 #endif
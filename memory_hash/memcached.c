@@ -20,6 +20,7 @@ static void settings_init(void) {
     settings.slab_chunk_size_max = settings.slab_page_size / 2;
     settings.slab_reassign = true;
     settings.hashpower_init = 0;
+    settings.hash_index = HASH_INDEX_CHAINED;
     settings.num_threads = 4; // N workers
 }
 
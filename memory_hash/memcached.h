@@ -41,6 +41,12 @@
 #define HASHPOWER_DEFAULT 16
 #define HASHPOWER_MAX 32
 
+/* Layout of the main hash table */
+enum hash_index_type {
+    HASH_INDEX_CHAINED = 0,     // bucket heads chained through item->h_next
+    HASH_INDEX_BUCKETED         // open-addressed cache-line buckets with hash tags
+};
+
 extern struct settings settings;
 /*
  * When adding a setting, be sure to update process_stat_settings
@@ -60,6 +66,7 @@ struct settings {
 
     char *hash_algorithm;   // Hash algorithm in use(Hash表使用的Hash算法)
     int hashpower_init;     // Starting hash power level(Hash表的大小)
+    enum hash_index_type hash_index; // Hash table layout(Hash表的组织方式)
 
     int num_threads;        // number of worker (without dispatcher libevent threads to run(工作线程数，由这个数字来决定hash锁表的大小)
 };
@@ -97,6 +104,29 @@ typedef struct _stritem {
      */
 } item;
 
+/*
+ * Item references. In bucketed mode workers take them without the item lock
+ * (see do_item_get_lockless()), so every change is atomic.
+ */
+#define refcount_incr(it) __atomic_add_fetch(&(it)->refcount, 1, __ATOMIC_ACQ_REL)
+#define refcount_decr(it) __atomic_sub_fetch(&(it)->refcount, 1, __ATOMIC_ACQ_REL)
+
+/*
+ * Takes a reference unless the item is already free. Unlocked readers use
+ * this instead of refcount_incr(): a free item has nobody to drop it to zero
+ * again, so it must never be brought back to one.
+ */
+static inline bool refcount_incr_live(item *it) {
+    unsigned short cur = __atomic_load_n(&it->refcount, __ATOMIC_ACQUIRE);
+
+    while (cur != 0) {
+        if (__atomic_compare_exchange_n(&it->refcount, &cur, cur + 1, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return true;
+    }
+    return false;
+}
+
 // Header when an item is octually a chunk of another item
 typedef struct _strchunk {
     struct _strchunk *next;         // points within its own chain
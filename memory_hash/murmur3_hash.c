@@ -66,15 +66,13 @@ static FORCE_INLINE uint32_t fmix32 ( uint32_t h )
 
 //-----------------------------------------------------------------------------
 
-/* Definition modified slightly from the public domain interface (no seed +
- * return value */
-uint32_t MurmurHash3_x86_32 ( const void * key, size_t length)
+/* Continues hashing at block `start` with running state h1, so the batched
+ * kernel below can hand lanes back to the scalar code. */
+static uint32_t murmur3_32_from ( const uint8_t * data, size_t length,
+                                  uint32_t h1, int start )
 {
-  const uint8_t * data = (const uint8_t*)key;
   const int nblocks = length / 4;
 
-  uint32_t h1 = 0;
-
   uint32_t c1 = 0xcc9e2d51;
   uint32_t c2 = 0x1b873593;
 
@@ -83,7 +81,7 @@ uint32_t MurmurHash3_x86_32 ( const void * key, size_t length)
 
   const uint32_t * blocks = (const uint32_t *)(data + nblocks*4);
 
-  for(int i = -nblocks; i; i++)
+  for(int i = start - nblocks; i < 0; i++)
   {
     uint32_t k1 = getblock32(blocks,i);
 
@@ -122,3 +120,89 @@ uint32_t MurmurHash3_x86_32 ( const void * key, size_t length)
   return h1;
 }
 
+/* Definition modified slightly from the public domain interface (no seed +
+ * return value */
+uint32_t MurmurHash3_x86_32 ( const void * key, size_t length)
+{
+  return murmur3_32_from((const uint8_t*)key, length, 0, 0);
+}
+
+//-----------------------------------------------------------------------------
+// Four keys at once: one SSE lane per key for the blocks all four keys have,
+// then each lane finishes on its own. Gives the same results as
+// MurmurHash3_x86_32.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#include <string.h>
+
+static FORCE_INLINE uint32_t loadblock32 ( const uint8_t * p )
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static FORCE_INLINE __m128i rotl32x4 ( __m128i x, int r )
+{
+  return _mm_or_si128(_mm_slli_epi32(x, r), _mm_srli_epi32(x, 32 - r));
+}
+
+__attribute__((target("sse4.1")))
+static void murmur3_x4_sse41 ( const void * const * key, const size_t * length,
+                               uint32_t * out )
+{
+  const uint8_t * d0 = (const uint8_t*)key[0];
+  const uint8_t * d1 = (const uint8_t*)key[1];
+  const uint8_t * d2 = (const uint8_t*)key[2];
+  const uint8_t * d3 = (const uint8_t*)key[3];
+  const __m128i c1 = _mm_set1_epi32(0xcc9e2d51);
+  const __m128i c2 = _mm_set1_epi32(0x1b873593);
+  const __m128i n1 = _mm_set1_epi32(0xe6546b64);
+  __m128i h1 = _mm_setzero_si128();
+  uint32_t h[4];
+  int common = length[0] / 4;
+
+  for (int l = 1; l < 4; l++)
+  {
+    if ((int)(length[l] / 4) < common)
+      common = length[l] / 4;
+  }
+
+  for (int i = 0; i < common; i++)
+  {
+    __m128i k1 = _mm_set_epi32(loadblock32(d3 + i*4), loadblock32(d2 + i*4),
+                               loadblock32(d1 + i*4), loadblock32(d0 + i*4));
+
+    k1 = _mm_mullo_epi32(k1, c1);
+    k1 = rotl32x4(k1, 15);
+    k1 = _mm_mullo_epi32(k1, c2);
+
+    h1 = _mm_xor_si128(h1, k1);
+    h1 = rotl32x4(h1, 13);
+    h1 = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(h1, 2), h1), n1);
+  }
+
+  _mm_storeu_si128((__m128i*)h, h1);
+  for (int l = 0; l < 4; l++)
+  {
+    out[l] = murmur3_32_from((const uint8_t*)key[l], length[l], h[l], common);
+  }
+}
+#endif
+
+void MurmurHash3_x86_32_x4 ( const void * const * key, const size_t * length,
+                             uint32_t * out )
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.1"))
+  {
+    murmur3_x4_sse41(key, length, out);
+    return;
+  }
+#endif
+  for (int l = 0; l < 4; l++)
+  {
+    out[l] = MurmurHash3_x86_32(key[l], length[l]);
+  }
+}
@@ -13,6 +13,7 @@
 //-----------------------------------------------------------------------------
 
 uint32_t MurmurHash3_x86_32(const void *key, size_t length);
+void MurmurHash3_x86_32_x4(const void * const *key, const size_t *length, uint32_t *out);
 
 //-----------------------------------------------------------------------------
 
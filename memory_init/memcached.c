@@ -12,6 +12,8 @@ static void settings_init(void) {
     settings.slab_page_size = 1024 * 1024; // chunks are split from 1MB pages
     settings.slab_chunk_size_max = settings.slab_page_size / 2;
     settings.slab_reassign = true;
+    settings.slab_hugepages = SLAB_HUGEPAGES_NONE;
+    settings.slab_numa = false;
 }
 
 int main(int argc, char **argv) {
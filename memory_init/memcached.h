@@ -26,6 +26,14 @@
 #define ITEM_HDR 128
 #endif
 
+/* What backs the preallocated slab memory */
+enum slab_hugepages_type {
+    SLAB_HUGEPAGES_NONE = 0,
+    SLAB_HUGEPAGES_THP,     // madvise(MADV_HUGEPAGE)
+    SLAB_HUGEPAGES_2M,      // MAP_HUGETLB, 2MB pages
+    SLAB_HUGEPAGES_1G       // MAP_HUGETLB, 1GB pages
+};
+
 extern struct settings settings;
 /*
  * When adding a setting, be sure to update process_stat_settings
@@ -42,6 +50,8 @@ struct settings {
     int slab_chunk_size_max; // Upper end for chunks within slab pages.(最大chunk的大小,默认为slab_page_size的一半)
     int slab_page_size;     // Slab's page units.(划分内存空间的单位大小，默认为1M)
     bool slab_reassign;     // Whether or not slab reassignment is allowed(是否对内存进行紧缩，减少浪费的空间)
+    enum slab_hugepages_type slab_hugepages; // page size backing preallocated slab memory(预分配内存所用的页类型)
+    bool slab_numa;         // split preallocated slab memory into per-NUMA-node arenas(按NUMA节点划分预分配内存)
 };
 
 /*
@@ -556,8 +556,14 @@ int do_item_replace(item *it, item *new_it, const uint32_t hv) {
                             ITEM_key(new_it), new_it->nkey, new_it->nbytes);
     assert((it->it_flags & ITEM_SLABBED) == 0);
 
+    /* Unlocked gets must not see the key missing in between */
+    bool opened = assoc_write_begin(hv);
+    int ret;
+
     do_item_unlink(it, hv);
-    return do_item_link(new_it, hv);
+    ret = do_item_link(new_it, hv);
+    assoc_write_end(hv, opened);
+    return ret;
 }
 
 /*@null@*/
@@ -973,9 +979,7 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c
             STORAGE_delete(c->thread->storage, it);
             do_item_remove(it);
             it = NULL;
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.get_flushed++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, get_flushed);
             if (settings.verbose > 2) {
                 fprintf(stderr, " -nuked by flush ");
             }
@@ -985,9 +989,7 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c
             STORAGE_delete(c->thread->storage, it);
             do_item_remove(it);
             it = NULL;
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.get_expired++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, get_expired);
             if (settings.verbose > 2) {
                 fprintf(stderr, " -nuked by expire");
             }
@@ -1041,6 +1043,62 @@ item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
     return it;
 }
 
+/*
+ * The common case of do_item_get(..., DO_UPDATE) without item_lock(hv), for
+ * workers in bucketed mode: a miss, or a live hit that needs no flag change
+ * and no LRU bump. Anything else sets *retry and returns NULL, and the
+ * caller asks do_item_get() under the lock instead. it_flags are only read
+ * here: item_lock(hv) is what serializes writes to them.
+ *
+ * While the slab mover runs, or with tail repair on, references are still
+ * overwritten under the item lock, so everyone takes the locked path then.
+ * The mover waits out a grace period after it starts, see
+ * slab_rebalance_thread().
+ */
+item *do_item_get_lockless(const char *key, const size_t nkey, const uint32_t hv,
+                           conn *c, bool *retry) {
+    item *it;
+    uint8_t flags;
+
+    if (__atomic_load_n(&slab_rebalance_signal, __ATOMIC_ACQUIRE) != 0 ||
+            settings.tail_repair_time || settings.verbose > 2) {
+        *retry = true;
+        return NULL;
+    }
+
+    it = assoc_find_ref(key, nkey, hv, retry);
+    if (it == NULL) {
+        if (!*retry) {
+            LOGGER_LOG(c->thread->l, LOG_FETCHERS, LOGGER_ITEM_GET, NULL, 0, key, nkey, 0);
+        }
+        return NULL;
+    }
+
+    flags = __atomic_load_n(&it->it_flags, __ATOMIC_ACQUIRE);
+#ifdef EXTSTORE
+    /* compaction rewrites headers in place under the item lock */
+    if (flags & ITEM_HDR) {
+        do_item_remove(it);
+        *retry = true;
+        return NULL;
+    }
+#endif
+    if (item_is_flushed(it) ||
+            (it->exptime != 0 && it->exptime <= current_time) ||
+            (settings.lru_segmented ? (flags & ITEM_ACTIVE) == 0 :
+             (flags & ITEM_FETCHED) == 0 ||
+             it->time < current_time - ITEM_UPDATE_INTERVAL)) {
+        do_item_remove(it);
+        *retry = true;
+        return NULL;
+    }
+
+    DEBUG_REFCNT(it, '+');
+    LOGGER_LOG(c->thread->l, LOG_FETCHERS, LOGGER_ITEM_GET, NULL, 1, key, nkey,
+               ITEM_clsid(it));
+    return it;
+}
+
 /*** LRU MAINTENANACE THREAD ***/
 
 /* Returns number of items remove, expired, or evicted.
@@ -1671,7 +1729,7 @@ int start_lru_maintainer_thread(void *arg) {
     pthread_mutex_lock(&lru_maintainer_lock);
     do_run_lru_maintainer_thread = 1;
     settings.lru_maintainer_thread = true;
-    if ((ret = pthread_create(&lru_maintainer_tid, NULL,
+    if ((ret = pthread_create(&lru_maintainer_tid, thread_bg_attr(),
                     lru_maintainer_thread, arg)) != 0) {
         fprintf(stderr, "Can't create LRU maintainer thread: %s\n",
                 strerror(ret));
@@ -75,6 +75,7 @@ vodi fill_item_stats_automove(item_stats_automove *am);
 
 item *do_item_get(const char *key, const size_t neky, const uint32_t hv, conn *c, const bool do_update);
 item *do_item_touch(const char *key, const size_t neky, uint32_t exptime, const uint32_t hv, conn *c);
+item *do_item_get_lockless(const char *key, const size_t nkey, const uint32_t hv, conn *c, bool *retry);
 void item_stats_reset(void);
 extern pthread_mutex_t lru_locks[POWER_LARGEST];
 
@@ -7,6 +7,12 @@
  * memcached protocol.
  */
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 /* powers-of-N allocation structures */
 
 typedef struct {
@@ -22,6 +28,8 @@ typedef struct {
     unsigned int list_size; // size of prev array
 
     size_t requested;       // The number of prev bytes
+
+    unsigned int mag_batch; // chunks per magazine refill/drain, 0 if unused
 } slabclass_t;
 
 static slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
@@ -35,8 +43,20 @@ static bool mem_limit_reached = false;
 static int power_largest;
 
 static void *mem_base = NULL;
-static void *mem_current = NULL;
-static size_t mem_avail = 0;
+
+/**
+ * Preallocated memory is carved into one arena per NUMA node (just one
+ * without slab_numa). New pages come from the arena of the node the
+ * allocating thread runs on, and spill over to the others once it's dry.
+ */
+#define SLAB_MAX_NUMA_NODES 8
+typedef struct {
+    char *current;
+    size_t avail;
+} slab_arena_t;
+
+static slab_arena_t slab_arenas[SLAB_MAX_NUMA_NODES];
+static int slab_arena_count = 0;
 #ifdef EXTSTORE
 static void *storage = NULL;
 #endif
@@ -46,12 +66,44 @@ static void *storage = NULL;
 static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t slabs_rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+ * Per-worker magazines of free chunks. Workers allocate from and free into
+ * their own magazine without taking slabs_lock, and only go to the global
+ * freelist to refill or drain a batch at a time. Chunks in a magazine keep
+ * ITEM_SLABBED but are not on slabclass[].slots, so the slab mover must not
+ * see them: slab_rebalance_start() turns magazines off for the source class
+ * and hands their chunks back to the freelist before the page is walked.
+ *
+ * Lock order: slab_mags_lock -> magazine lock -> slabs_lock
+ */
+#define SLAB_MAG_BATCH 32
+#define SLAB_MAG_BYTES (64 * 1024)
+
+typedef struct {
+    item *head;             // singly linked through it->next
+    unsigned int count;
+    int64_t requested;      // bytes not yet folded into slabclass.requested
+} slab_mag_class_t;
+
+typedef struct slab_magazine {
+    pthread_mutex_t lock;   // only contended by the slab mover
+    struct slab_magazine *next;
+    slab_mag_class_t cls[MAX_NUMBER_OF_SLAB_CLASSES];
+} slab_magazine_t;
+
+static pthread_key_t slab_mag_key;
+static slab_magazine_t *slab_mags = NULL;
+static pthread_mutex_t slab_mags_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Classes being rebalanced; magazines are bypassed for them */
+static volatile bool slab_mag_skip[MAX_NUMBER_OF_SLAB_CLASSES];
+
 /**
  * Forward Declarations
  */
 static int grow_slab_list(const unsigned int id);
 static int do_slabs_newslab(const unsigned int id);
 static void *memory_allocate(size_t size);
+static void *memory_reserve(size_t limit);
 static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
 
 /**
@@ -99,12 +151,9 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
     mem_limit = limit;
 
     if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        mem_base = malloc(mem_limit);
-        if (mem_base != NULL) {
-            mem_current = mem_base;
-            mem_avail = mem_limit;
-        } else {
+        /* Allocate everything in a big chunk */
+        mem_base = memory_reserve(mem_limit);
+        if (mem_base == NULL) {
             fprintf(stderr, "Warning: Failed to allocate requested memory in"
                         " on large chunk.\nWill allocate in smaller chunks\n");
         }
@@ -141,6 +190,15 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
                 i, slabclass[i].size, slabclass[i].perslab);
     }
 
+    /* Bound what a magazine can hold so big chunks don't sit idle in it */
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        unsigned int batch = SLAB_MAG_BYTES / slabclass[i].size;
+        if (batch > SLAB_MAG_BATCH)
+            batch = SLAB_MAG_BATCH;
+        slabclass[i].mag_batch = batch < 2 ? 0 : batch;
+    }
+    pthread_key_create(&slab_mag_key, NULL);
+
     /* for the test suite: faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -520,6 +578,122 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
     add_stats(NULL, 0, NULL, 0, c);
 }
 
+#ifdef __linux__
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* Number of NUMA nodes, from the highest node listed as online. */
+static int memory_numa_nodes(void) {
+    char buf[128];
+    int nodes = 1;
+    FILE *fp = fopen("/sys/devices/system/node/online", "r");
+    if (fp == NULL)
+        return 1;
+    if (fgets(buf, sizeof(buf), fp) != NULL) {
+        char *p = buf;
+        while (*p) {
+            if (*p >= '0' && *p <= '9') {
+                int n = (int)strtol(p, &p, 10);
+                if (n + 1 > nodes)
+                    nodes = n + 1;
+            } else {
+                p++;
+            }
+        }
+    }
+    fclose(fp);
+    return nodes < SLAB_MAX_NUMA_NODES ? nodes : SLAB_MAX_NUMA_NODES;
+}
+
+/* Node of the CPU the calling thread is running on. */
+static int memory_current_node(void) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return node;
+}
+#endif
+
+/**
+ * Reserves the preallocated slab region and sets up its arenas. Depending on
+ * settings.slab_hugepages the region is backed by transparent huge pages or
+ * by explicit 2MB/1GB hugetlb pages; with settings.slab_numa it is split into
+ * per-node arenas, each bound to its node before anything touches it.
+ * Returns NULL if the memory couldn't be had.
+ */
+static void *memory_reserve(size_t limit) {
+    size_t align = settings.slab_page_size;
+    char *base = NULL;
+    int nodes = 1;
+    int x;
+
+#ifdef __linux__
+    if (settings.slab_hugepages == SLAB_HUGEPAGES_2M ||
+            settings.slab_hugepages == SLAB_HUGEPAGES_1G) {
+        int shift = settings.slab_hugepages == SLAB_HUGEPAGES_2M ? 21 : 30;
+        align = (size_t)1 << shift;
+        limit = (limit + align - 1) & ~(align - 1);
+        base = mmap(NULL, limit, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+                -1, 0);
+        if (base == MAP_FAILED) {
+            perror("mmap(MAP_HUGETLB) for slab memory");
+            return NULL;
+        }
+    } else {
+        if (settings.slab_hugepages == SLAB_HUGEPAGES_THP)
+            align = 2 * 1024 * 1024;
+        if (posix_memalign((void **)&base, align, limit) != 0)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (settings.slab_hugepages == SLAB_HUGEPAGES_THP &&
+                madvise(base, limit, MADV_HUGEPAGE) != 0) {
+            perror("madvise(MADV_HUGEPAGE) for slab memory");
+        }
+#endif
+    }
+
+    if (settings.slab_numa)
+        nodes = memory_numa_nodes();
+#else
+    base = malloc(limit);
+    if (base == NULL)
+        return NULL;
+#endif
+
+    /* Arenas are cut on huge page boundaries so none straddles two nodes */
+    size_t slice = (limit / nodes) & ~(align - 1);
+    if (slice < (size_t)settings.slab_page_size) {
+        nodes = 1;
+        slice = limit;
+    }
+    for (x = 0; x < nodes; x++) {
+        slab_arena_t *a = &slab_arenas[x];
+        a->current = base + slice * x;
+        a->avail = (x == nodes - 1) ? limit - slice * x : slice;
+#ifdef __linux__
+        if (nodes > 1) {
+            unsigned long mask = 1UL << x;
+            if (syscall(SYS_mbind, a->current, a->avail, MPOL_PREFERRED,
+                        &mask, sizeof(mask) * 8, 0) != 0) {
+                perror("mbind for slab memory");
+            }
+        }
+#endif
+    }
+    slab_arena_count = nodes;
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, "slab memory: %zu bytes reserved in %d arena(s)\n",
+                limit, nodes);
+    }
+    return base;
+}
+
 static void *memory_allocate(size_t size) {
     void *ret;
 
@@ -527,22 +701,30 @@ static void *memory_allocate(size_t size) {
         /* We are not using a preallocated large memory chunk */
         ret = malloc(size);
     } else {
-        ret = mem_current;
+        int home = 0;
+        int x;
 
-        if (size > mem_avail) {
-            return NULL;
-        }
-
-        /* mem_current pinter _must_ be aligned!! */
+        /* arena pointers _must_ stay aligned!! */
         if (size % CHUNK_ALIGN_BYTES) {
             size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
         }
 
-        mem_current = ((char*)mem_current) + size;
-        if (size < mem_avail) {
-            mem_avail -= size;
-        } else {
-            mem_avail = 0;
+#ifdef __linux__
+        if (slab_arena_count > 1)
+            home = memory_current_node() % slab_arena_count;
+#endif
+        ret = NULL;
+        for (x = 0; x < slab_arena_count; x++) {
+            slab_arena_t *a = &slab_arenas[(home + x) % slab_arena_count];
+            if (size <= a->avail) {
+                ret = a->current;
+                a->current += size;
+                a->avail -= size;
+                break;
+            }
+        }
+        if (ret == NULL) {
+            return NULL;
         }
     }
     mem_malloced += size;
@@ -566,10 +748,178 @@ static void memory_release() {
     }
 }
 
+/* Called by each worker thread before it starts serving requests */
+void slabs_thread_init(void) {
+    slab_magazine_t *mag = calloc(1, sizeof(slab_magazine_t));
+    if (mag == NULL) {
+        /* Not fatal, this thread just always uses the global freelist */
+        return;
+    }
+    pthread_mutex_init(&mag->lock, NULL);
+
+    pthread_mutex_lock(&slab_mags_lock);
+    mag->next = slab_mags;
+    slab_mags = mag;
+    pthread_mutex_unlock(&slab_mags_lock);
+
+    pthread_setspecific(slab_mag_key, mag);
+}
+
+/* Returns the calling thread's magazine, locked, if it can serve class id */
+static slab_magazine_t *slab_mag_lock(const unsigned int id) {
+    slab_magazine_t *mag;
+
+    if (id < POWER_SMALLEST || id > power_largest || slabclass[id].mag_batch == 0)
+        return NULL;
+    mag = pthread_getspecific(slab_mag_key);
+    if (mag == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&mag->lock);
+    if (slab_mag_skip[id]) {
+        pthread_mutex_unlock(&mag->lock);
+        return NULL;
+    }
+    return mag;
+}
+
+/* CALLED WITH the magazine locked */
+static unsigned int slab_mag_refill(slab_mag_class_t *mc, const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+    item *it;
+
+    pthread_mutex_lock(&slabs_lock);
+    p->requested += mc->requested;
+    mc->requested = 0;
+    if (p->sl_curr == 0) {
+        do_slabs_newslab(id);
+    }
+    /* Chunks stay ITEM_SLABBED until they're handed out */
+    while (p->sl_curr != 0 && mc->count < p->mag_batch) {
+        it = (item *)p->slots;
+        p->slots = it->next;
+        if (it->next) it->next->prev = 0;
+        p->sl_curr--;
+        it->next = mc->head;
+        mc->head = it;
+        mc->count++;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return mc->count;
+}
+
+/* CALLED WITH the magazine locked */
+static void slab_mag_drain(slab_mag_class_t *mc, const unsigned int id,
+        unsigned int n) {
+    slabclass_t *p = &slabclass[id];
+    item *it;
+
+    pthread_mutex_lock(&slabs_lock);
+    p->requested += mc->requested;
+    mc->requested = 0;
+    while (n > 0 && mc->head != NULL) {
+        it = mc->head;
+        mc->head = it->next;
+        mc->count--;
+        it->prev = 0;
+        it->next = p->slots;
+        if (it->next) it->next->prev = it;
+        p->slots = it;
+        p->sl_curr++;
+        n--;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+/* CALLED WITH the magazine locked */
+static void *slab_mag_alloc(slab_magazine_t *mag, const size_t size,
+        const unsigned int id, uint64_t *total_bytes) {
+    slab_mag_class_t *mc = &mag->cls[id];
+    item *it;
+
+    assert(size <= slabclass[id].size);
+    if (total_bytes != NULL) {
+        *total_bytes = __atomic_load_n(&slabclass[id].requested, __ATOMIC_RELAXED)
+            + mc->requested;
+    }
+    if (mc->count == 0 && slab_mag_refill(mc, id) == 0) {
+        MEMCACHED_SLABS_ALLOCATE_FAILED(size, id);
+        return NULL;
+    }
+
+    it = mc->head;
+    mc->head = it->next;
+    mc->count--;
+    /* The mover isn't walking this class while we hold the magazine, so
+     * unlike do_slabs_alloc() this needn't happen under slabs_lock.
+     */
+    it->it_flags &= ~ITEM_SLABBED;
+    it->refcount = 1;
+    mc->requested += size;
+    MEMCACHED_SLABS_ALLOCATE(size, id, slabclass[id].size, it);
+    return it;
+}
+
+/* CALLED WITH the magazine locked */
+static void slab_mag_free(slab_magazine_t *mag, item *it, const size_t size,
+        const unsigned int id) {
+    slab_mag_class_t *mc = &mag->cls[id];
+
+    MEMCACHED_SLABS_FREE(size, id, it);
+#ifdef EXTSTORE
+    if (it->it_flags & ITEM_HDR) {
+        mc->requested -= (size - it->nbytes) + sizeof(item_hdr);
+    } else {
+        mc->requested -= size;
+    }
+#else
+    mc->requested -= size;
+#endif
+    it->it_flags = ITEM_SLABBED;
+    it->slabs_clsid = 0;
+    it->prev = 0;
+    it->next = mc->head;
+    mc->head = it;
+    if (++mc->count > slabclass[id].mag_batch * 2) {
+        slab_mag_drain(mc, id, slabclass[id].mag_batch);
+    }
+}
+
+/* Turn magazines off for a class and return all of its chunks to the global
+ * freelist, so slab_rebalance_move() sees every free chunk there.
+ */
+static void slab_mag_flush(const int id) {
+    slab_magazine_t *mag;
+
+    if (id < POWER_SMALLEST || id > power_largest)
+        return;
+    slab_mag_skip[id] = true;
+
+    pthread_mutex_lock(&slab_mags_lock);
+    for (mag = slab_mags; mag != NULL; mag = mag->next) {
+        pthread_mutex_lock(&mag->lock);
+        slab_mag_drain(&mag->cls[id], id, mag->cls[id].count);
+        pthread_mutex_unlock(&mag->lock);
+    }
+    pthread_mutex_unlock(&slab_mags_lock);
+}
+
+static void slab_mag_resume(const int id) {
+    if (id >= POWER_SMALLEST && id <= power_largest)
+        slab_mag_skip[id] = false;
+}
+
 void *slabs_alloc(size_t size, unsigned int id, uint64_t *total_bytes,
         unsigned int flags) {
+    slab_magazine_t *mag;
     void *ret;
 
+    if (flags == 0 && (mag = slab_mag_lock(id)) != NULL) {
+        ret = slab_mag_alloc(mag, size, id, total_bytes);
+        pthread_mutex_unlock(&mag->lock);
+        return ret;
+    }
+
     pthread_mutex_lock(&slabs_lock);
     ret = do_slabs_alloc(size, id, total_bytes, flags);
     pthread_mutex_unlock(&slabs_lock);
@@ -577,6 +927,16 @@ void *slabs_alloc(size_t size, unsigned int id, uint64_t *total_bytes,
 }
 
 void slabs_free(void *ptr, size_t size, unsigned int id) {
+    slab_magazine_t *mag;
+
+    /* Chunked items free into several classes, leave them to the slow path */
+    if ((((item *)ptr)->it_flags & ITEM_CHUNKED) == 0
+            && (mag = slab_mag_lock(id)) != NULL) {
+        slab_mag_free(mag, ptr, size, id);
+        pthread_mutex_unlock(&mag->lock);
+        return;
+    }
+
     pthread_mutex_lock(&slabs_lock);
     do_slabs_free(ptr, size, id);
     pthread_mutex_unlock(&slabs_lock);
@@ -663,6 +1023,9 @@ static int slab_rebalance_start(void) {
     slabclass_t *s_cls;
     int no_go = 0;
 
+    /* Has to happen before slabs_lock is taken, see the lock order */
+    slab_mag_flush(slab_rebal.s_clsid);
+
     pthread_mutex_lock(&slabs_lock);
 
     if (slab_rebal.s_clsid < SLAB_GLOBAL_PAGE_POOL ||
@@ -683,6 +1046,7 @@ static int slab_rebalance_start(void) {
 
     if (no_go != 0) {
         pthread_mutex_unlock(&slabs_lock);
+        slab_mag_resume(slab_rebal.s_clsid);
         return no_go;   // Should use a wrapper function....
     }
 
@@ -1076,6 +1440,8 @@ static void slab_rebalance_finish(void) {
         memory_release();
     }
 
+    slab_mag_resume(slab_rebal.s_clsid);
+
     slab_rebal.busy_loops   = 0;
     slab_rebal.done         = 0;
     slab_rebal.s_clsid      = 0;
@@ -1126,6 +1492,10 @@ static void *slab_rebalance_thread(void *arg) {
             if (slab_rebalance_start() < 0) {
                 /* Handle errors with more specificity as required */
                 slab_rebalance_signal = 0;
+            } else {
+                /* Unlocked gets that missed the signal hold references
+                 * the move below could overwrite; let them finish. */
+                epoch_synchronize();
             }
 
             was_busy = 0;
@@ -1242,7 +1612,7 @@ int start_slab_maintenance_thread(void) {
     }
     pthread_mutex_init(&slabs_rebalance_lock, NULL);
 
-    if ((ret = pthread_create(&rebalance_tid, NULL,
+    if ((ret = pthread_create(&rebalance_tid, thread_bg_attr(),
                                 slab_rebalance_thread, NULL)) != 0) {
         fprintf(stderr, "Can't create rebal thread: %s\n", strerror(ret));
         return -1;
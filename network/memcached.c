@@ -1,5 +1,10 @@
 
 #include "memcached.h"
+#ifdef __linux__
+#include <linux/filter.h>
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#endif
 
 /* exported globals */
 struct settings settings;
@@ -32,6 +37,21 @@ static void settings_init(void) {
     settings.detail_enabled = 0;
     settings.reqs_per_event = 20;
     settings.backlog = 1024;
+    settings.reuseport = false;
+    settings.reuseport_cpu = false;
+    settings.conn_dispatch_load = false;
+    settings.conn_migrate = false;
+    settings.event_epoll = false;
+    settings.busy_poll_us = 0;
+    settings.zerocopy_min = 0;
+    settings.udp_batch = 0;
+    settings.sched_bytes = 0;
+    settings.sched_usec = 0;
+    settings.sched_coalesce = false;
+    settings.worker_cpus = NULL;
+    settings.worker_nodes = NULL;
+    settings.worker_rxq = NULL;
+    settings.bg_cpus = NULL;
     settings.binding_protocol = negotiating_prot;
     settings.item_size_max = 1024 * 1024;   // The famous 1MB upper limit
     settings.slab_page_size = 1024 * 1024;  // chunks are split from 1MB pages
@@ -69,95 +89,133 @@ static void settings_init(void) {
 #endif
 }
 
-// Connection timeout thread bits
-static pthread_t conn_timeout_tid;
+/*
+ * Idle connection timeouts (-o idle_timeout).
+ *
+ * Each worker keeps its own connections on a hierarchical timer wheel and
+ * ticks it from a one second timer in its own event loop, so nothing ever
+ * scans the conns array. A connection is armed for last_cmd_time +
+ * idle_timeout when it arrives at a worker. Commands don't touch the wheel:
+ * when the slot comes up the deadline is checked against the current
+ * last_cmd_time and simply moved if the connection was used since.
+ *
+ * Level n has IDLE_WHEEL_SLOTS slots of 64^n seconds; entries in a level n
+ * slot move down a level when the wheel's clock reaches their stretch.
+ */
 
-// 处理链接空闲的connection
-#define CONNS_PER_SLICE 100
-#define TIMEOUT_MSG_SIZE (1 + sizeof(int))
-static void *conn_timeout_thread(void *arg) {
-    int i;
-    conn *c;
-    char buf[TIMEOUT_MSG_SIZE];
-    rel_time_t oldest_last_cmd;
-    int sleep_time;
-    useconds_t timeslice = 1000000 / (max_fds / CONNS_PER_SLICE);
-
-    while(1) {
-        if (settings.verbose > 2)
-            fprintf(stderr, "idle timeout thread at top of connection list\n");
-
-        oldest_last_cmd = current_time;
-
-        // 依次循环处理每一个connection
-        for (i = 0; i < max_fds; i++) {
-            // 每处理一定量的connection后休息一段时间
-            if ((i % CONNS_PER_SLICE) == 0) {
-                if (settings.verbose > 2)
-                    fprintf(stderr, "idle timeout thread sleeping for %ulus\n",
-                            (unsigned int)timeslice);
-                usleep(timeslice);
-            }
-            
-            // 判断此connection是否被使用
-            if (!conns[i])
-                continue;
+/* Links c into the slot for expires, clamped to what the wheel can hold */
+static void conn_idle_insert(LIBEVENT_THREAD *me, conn *c, rel_time_t expires) {
+    const rel_time_t span = 1U << (IDLE_WHEEL_BITS * IDLE_WHEEL_LEVELS);
+    rel_time_t delta;
+    conn **slot;
+    int level;
+
+    if ((int)(expires - me->idle_wheel_time) < 0)
+        expires = me->idle_wheel_time;
+    delta = expires - me->idle_wheel_time;
+    if (delta >= span)
+        expires = me->idle_wheel_time + span - 1;
+
+    for (level = 0; level < IDLE_WHEEL_LEVELS - 1; level++) {
+        if (delta < 1U << (IDLE_WHEEL_BITS * (level + 1)))
+            break;
+    }
+    slot = &me->idle_wheel[level]
+            [(expires >> (IDLE_WHEEL_BITS * level)) & (IDLE_WHEEL_SLOTS - 1)];
+
+    c->idle_expires = expires;
+    c->idle_next = *slot;
+    if (c->idle_next)
+        c->idle_next->idle_pprev = &c->idle_next;
+    c->idle_pprev = slot;
+    *slot = c;
+}
 
-            c = conns[i];   // 获取connection
-            
-            // 判断是否是TCP网络协议
-            if (!IS_TCP(c->transport))
-                continue;
-            // 判断connection的状态
-            if (c->state != conn_new_cmd && c->state != conn_read)
-                continue;
-            // 判断是否超时
-            if ((current_time - c->last_cmd_time) > settings.idle_timeout) {
-                buf[0] = 't';
-                memcpy(&buf[1], &i, sizeof(int));
-                // 向该线程发送connection超时的信息
-                if (write(c->thread->notify_send_fd, buf, TIMEOUT_MSG_SIZE) != 
-                        TIMEOUT_MSG_SIZE)
-                    perror("Failed to write timeout to notify pipe");
-            } else {
-                if (c->last_cmd_time < oldest_last_cmd)
-                    oldest_last_cmd = c->last_cmd_time;
-            }
-        }
+/* Takes c off its worker's wheel, if it's on it */
+void conn_idle_disarm(conn *c) {
+    if (c->idle_pprev == NULL)
+        return;
+    *c->idle_pprev = c->idle_next;
+    if (c->idle_next)
+        c->idle_next->idle_pprev = c->idle_pprev;
+    c->idle_next = NULL;
+    c->idle_pprev = NULL;
+}
 
-        // This is soonest we could have another connection time out
-        // 判断最近的过期时间
-        sleep_time = settings.idle_timeout - (current_time - oldest_last_cmd) + 1;
-        if (sleep_time <= 0)
-            sleep_time = 1;
+/*
+ * Puts a client connection on its worker's wheel. Only called from the
+ * owning worker, once c->thread is set.
+ */
+void conn_idle_arm(conn *c) {
+    if (settings.idle_timeout == 0 || !IS_TCP(c->transport))
+        return;
+    conn_idle_disarm(c);
+    conn_idle_insert(c->thread, c,
+            c->last_cmd_time + settings.idle_timeout + 1);
+}
 
-        if (settings.verbose > 2)
-            fprintf(stderr, 
-                    "idle timeout thread finished pass, sleeping for %ds\n",
-                    sleep_time);
-        usleep((useconds_t) sleep_time * 1000000);
+/* A connection's deadline came up; close it if it really is idle. */
+static void conn_close_idle(conn *c) {
+    if ((current_time - c->last_cmd_time) <= settings.idle_timeout) {
+        // used since it was armed
+        conn_idle_insert(c->thread, c,
+                c->last_cmd_time + settings.idle_timeout + 1);
+        return;
     }
 
-    return NULL;
-}
+    if (c->state != conn_new_cmd && c->state != conn_read) {
+        if (settings.verbose > 1)
+            fprintf(stderr, "fd %d wants to timeout, but isn't in read state",
+                c->sfd);
+        conn_idle_insert(c->thread, c, current_time + settings.idle_timeout);
+        return;
+    }
 
-void conn_close_idle(conn *c) {
-    if (setting.idle_timeout > 0 &&
-            (current_time - c->last_cmd_time) > settings.idle_timeout) {
-        if (c->state != conn_new_cmd && c->state != conn_read) {
-            if (settings.verbose > 1)
-                fprintf(stderr, "fd %d wants to timeout, but isn't in read state",
-                    c->sfd);
-            return;
-        }
+    if (settings.verbose > 1)
+        fprintf(stderr, "Closing idle fd %d\n", c->sfd);
 
-        if (settings.verbose > 1)
-            fprintf(stderr, "Closing idle fd %d\n", c->sfd);
+    c->thread->stats.idle_kicks++;
 
-        c->thread->stats.idle_kicks++;
+    conn_set_state(c, conn_closing);
+    drive_machine(c);
+}
 
-        conn_set_state(c, conn_closing);
-        drive_machine(c);
+/*
+ * Advances a worker's wheel up to current_time, closing the connections
+ * whose deadlines have passed. Runs once a second on the worker.
+ */
+void conn_idle_tick(LIBEVENT_THREAD *me) {
+    unsigned int idx;
+    rel_time_t t;
+    conn *c, *next;
+    int level;
+
+    while ((int)(current_time - me->idle_wheel_time) >= 0) {
+        t = me->idle_wheel_time;
+
+        // 上层槽位轮到时, 把其中的connection重新分配到下层
+        for (level = 1; level < IDLE_WHEEL_LEVELS; level++) {
+            if ((t & ((1U << (IDLE_WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            idx = (t >> (IDLE_WHEEL_BITS * level)) & (IDLE_WHEEL_SLOTS - 1);
+            c = me->idle_wheel[level][idx];
+            me->idle_wheel[level][idx] = NULL;
+            for (; c != NULL; c = next) {
+                next = c->idle_next;
+                conn_idle_insert(me, c, c->idle_expires);
+            }
+        }
+
+        idx = t & (IDLE_WHEEL_SLOTS - 1);
+        c = me->idle_wheel[0][idx];
+        me->idle_wheel[0][idx] = NULL;
+        me->idle_wheel_time = t + 1;
+        for (; c != NULL; c = next) {
+            next = c->idle_next;
+            c->idle_next = NULL;
+            c->idle_pprev = NULL;
+            conn_close_idle(c);
+        }
     }
 }
 
@@ -169,9 +227,12 @@ void conn_worker_readd(conn *c) {
     c->state = conn_new_cmd;
 
     // TODO: call conn_cleanup/fiail/etc
-    if (event_add(&c->event, 0) == -1) {
-        perror("event_add");
+    if (!settings.event_epoll || !conn_epoll_attach(c)) {
+        if (event_add(&c->event, 0) == -1) {
+            perror("event_add");
+        }
     }
+    conn_idle_arm(c);
 #ifdef EXTSTORE
     // If we had IO objects, process
     if (c->io_wraplist) {
@@ -182,6 +243,198 @@ void conn_worker_readd(conn *c) {
 #endif
 }
 
+/*
+ * Read buffers. A TCP connection only holds one while it has unparsed
+ * input: it borrows a READ_BUFFER_SIZE buffer from its worker's rbuf_cache
+ * on the first read and gives it back once everything is parsed, so idle
+ * connections cost no buffer at all. A single command that does not fit
+ * moves to a private malloc'd buffer, which goes away again when drained.
+ * UDP connections keep the buffer they were created with.
+ */
+bool rbuf_alloc(conn *c) {
+    if (c->rbuf == NULL) {
+        c->rbuf = do_cache_alloc(c->thread->rbuf_cache);
+        if (c->rbuf == NULL) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return false;
+        }
+        c->rsize = READ_BUFFER_SIZE;
+        c->rbuf_malloced = false;
+        c->rcurr = c->rbuf;
+        c->rbytes = 0;
+    }
+    return true;
+}
+
+/* Gives the read buffer back if it holds nothing unparsed. */
+void rbuf_release(conn *c) {
+    if (c->rbuf == NULL || c->rbytes != 0 || IS_UDP(c->transport))
+        return;
+    if (c->rbuf_malloced) {
+        free(c->rbuf);
+        c->rbuf_malloced = false;
+    } else {
+        do_cache_free(c->thread->rbuf_cache, c->rbuf);
+    }
+    c->rbuf = c->rcurr = NULL;
+    c->rsize = 0;
+}
+
+/*
+ * Moves the input to a private buffer of nsize bytes, keeping everything up
+ * to rcurr + rbytes at the same offsets.
+ */
+bool rbuf_resize(conn *c, size_t nsize) {
+    size_t used = c->rcurr - c->rbuf + c->rbytes;
+    char *nbuf;
+
+    assert(used <= nsize);
+    if (c->rbuf_malloced) {
+        nbuf = realloc(c->rbuf, nsize);
+    } else {
+        nbuf = malloc(nsize);
+        if (nbuf != NULL && c->rbuf != NULL) {
+            memcpy(nbuf, c->rbuf, used);
+            do_cache_free(c->thread->rbuf_cache, c->rbuf);
+        }
+    }
+    if (nbuf == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return false;
+    }
+    c->rcurr = nbuf + (c->rcurr - c->rbuf);
+    c->rbuf = nbuf;
+    c->rsize = nsize;
+    c->rbuf_malloced = true;
+    return true;
+}
+
+/*
+ * Response descriptors. The iov and msglist arrays a response is built in
+ * are borrowed from the worker on the first add_msghdr() and handed back by
+ * conn_shrink() between requests, so an idle connection holds none. The
+ * pooled arrays are sized for large multigets; a response that outgrows
+ * them moves to private arrays for as long as it lasts.
+ */
+bool resp_alloc(conn *c) {
+    if (c->iov == NULL) {
+        c->iov = do_cache_alloc(c->thread->iov_cache);
+        if (c->iov == NULL)
+            goto fail;
+        c->iovsize = RESP_IOV_POOLED;
+        c->iov_malloced = false;
+    }
+    if (c->msglist == NULL) {
+        c->msglist = do_cache_alloc(c->thread->msg_cache);
+        if (c->msglist == NULL)
+            goto fail;
+        c->msgsize = RESP_MSG_POOLED;
+        c->msg_malloced = false;
+    }
+    return true;
+
+fail:
+    STATS_LOCK();
+    stats.malloc_fails++;
+    STATS_UNLOCK();
+    return false;
+}
+
+/* Only call with no response left to write. */
+void resp_release(conn *c) {
+    if (c->iov != NULL) {
+        if (c->iov_malloced)
+            free(c->iov);
+        else
+            do_cache_free(c->thread->iov_cache, c->iov);
+        c->iov = NULL;
+        c->iovsize = 0;
+        c->iov_malloced = false;
+    }
+    if (c->msglist != NULL) {
+        if (c->msg_malloced)
+            free(c->msglist);
+        else
+            do_cache_free(c->thread->msg_cache, c->msglist);
+        c->msglist = NULL;
+        c->msgsize = 0;
+        c->msg_malloced = false;
+    }
+    c->iovused = 0;
+    c->msgused = 0;
+    c->msgcurr = 0;
+}
+
+/*
+ * Doubles one of the descriptor arrays, size bytes long now, taking it off
+ * the pool if it came from there. Returns NULL if out of memory, in which
+ * case the old array is left as it was.
+ */
+void *resp_grow(conn *c, void *old, size_t size, bool *malloced, cache_t *cache) {
+    void *p;
+
+    if (*malloced) {
+        p = realloc(old, size * 2);
+    } else {
+        p = malloc(size * 2);
+        if (p != NULL) {
+            memcpy(p, old, size);
+            do_cache_free(cache, old);
+        }
+    }
+    if (p == NULL) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return NULL;
+    }
+    *malloced = true;
+    return p;
+}
+
+/* Only connections open at least this long (seconds) get migrated */
+#define CONN_MIGRATE_MIN_AGE 10
+
+/*
+ * Moves a long-lived connection to another worker. Only called by the
+ * owning worker right after an event, and only acts if the connection is
+ * between requests. The new owner picks it up in conn_worker_readd().
+ */
+bool conn_migrate(conn *c, LIBEVENT_THREAD *to) {
+    if (!IS_TCP(c->transport) || c->state != conn_read || c->rbytes != 0 ||
+            c->thread == to ||
+            current_time - c->conn_start < CONN_MIGRATE_MIN_AGE) {
+        return false;
+    }
+#ifdef EXTSTORE
+    if (c->io_wraplist) {
+        return false;
+    }
+#endif
+    // pinned suffixes belong to this worker's cache
+    if (c->zc_holds) {
+        return false;
+    }
+
+    event_del(&c->event);
+    conn_epoll_detach(c);
+    // the buffers belong to this worker's caches
+    rbuf_release(c);
+    resp_release(c);
+    // the new owner arms it on its own wheel
+    conn_idle_disarm(c);
+    conn_set_state(c, conn_waiting);
+    __atomic_fetch_sub(&c->thread->conns, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->conns, 1, __ATOMIC_RELAXED);
+    c->thread = to;
+    redispath_conn(c);
+    return true;
+}
+
 conn *conn_new(const int sfd, enum conn_states init_state,
                 const int event_flags,
                 const int read_buffer_size, enum network_transport transport,
@@ -210,23 +463,27 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         c->msglist = 0;
         c->hdrbuf = 0;
 
-        c->rsize = read_buffer_size;
+        c->rsize = 0;
         c->wsize = DATA_BUFFER_SIZE;
         c->isize = ITEM_LIST_INITIAL;
         c->suffixsize = SUFFIX_LIST_INITIAL;
-        c->iovsize = IOV_LIST_INITIAL;
-        c->msgsize = MSG_LIST_INITIAL;
+        c->iovsize = 0;
+        c->msgsize = 0;
         c->hdrsize = 0;
 
-        c->rbuf = (char *)malloc((size_t)c->rsize);
+        // TCP连接的读缓冲在读数据时才从线程借, 见rbuf_alloc()
+        if (IS_UDP(transport)) {
+            c->rsize = read_buffer_size;
+            c->rbuf = (char *)malloc((size_t)c->rsize);
+            c->rbuf_malloced = true;
+        }
         c->wbuf = (char *)malloc((size_t)c->wsize);
         c->ilist = (item **)malloc(sizeof(item *) * c->isize);
         c->suffixlist = (char **)malloc(sizeof(char *) * c->suffixsize);
-        c->iov = (struct iovec *)malloc(sizeof(struct iovec) * c->iovsize);
-        c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * c->msgsize);
+        // iov和msglist在写响应时才从线程借, 见resp_alloc()
 
-        if (c->rbuf == 0 || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
-                c->msglist == 0 || c->suffixlist == 0) {
+        if ((IS_UDP(transport) && c->rbuf == 0) || c->wbuf == 0 ||
+                c->ilist == 0 || c->suffixlist == 0) {
             conn_free(c);
             STATS_LOCK();
             stats.malloc_fails++;
@@ -302,6 +559,7 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->msgused = 0;
     c->authenticated = false;
     c->last_cmd_time = current_time;    // initialize for idle kicker
+    c->conn_start = current_time;
 #ifdef EXTSTORE
     c->io_wraplist = NULL;
     c->io_wraplist = 0;
@@ -312,6 +570,23 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->item = 0;
 
     c->noreply = false;
+
+    // 大value的响应直接从item内存发送, 不再拷贝进内核
+    c->zerocopy = false;
+    c->zc_used = false;
+    c->zc_seq = c->zc_done = 0;
+    c->zc_pend = 0;
+    c->zc_hold = NULL;
+    c->zc_holds = NULL;
+    c->zc_tail = &c->zc_holds;
+#ifdef SO_ZEROCOPY
+    if (settings.zerocopy_min > 0 && transport == tcp_transport &&
+            init_state == conn_new_cmd) {
+        int on = 1;
+        if (setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+            c->zerocopy = true;
+    }
+#endif
     
     // 设置connection的处理函数
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
@@ -333,6 +608,172 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     return c;
 }
 
+/*
+ * MSG_ZEROCOPY completion tracking.
+ *
+ * The kernel numbers zerocopy sends on a socket from 0 and reports finished
+ * ranges [lo, hi] on the socket's error queue. A response is only ever
+ * released once every send up to and including its last one is done, so
+ * c->zc_done is the first send not yet known complete. No more than
+ * ZC_PEND_MAX sends are ever in flight (see conn_zerocopy_reserve()), so
+ * whatever completes ahead of zc_done fits in the c->zc_pend bitmap.
+ */
+static void conn_zerocopy_free(LIBEVENT_THREAD *me, struct zc_hold *h) {
+    int i;
+
+    for (i = 0; i < h->nitems; i++)
+        item_remove((item *)h->ptrs[i]);
+    for (; i < h->nitems + h->nsuffix; i++)
+        do_cache_free(me->suffix_cache, h->ptrs[i]);
+    free(h);
+}
+
+static void conn_zerocopy_complete(conn *c, uint32_t lo, uint32_t hi) {
+    uint32_t first, last;
+    int n;
+
+    if ((int32_t)(hi - c->zc_done) < 0)
+        return;
+    first = (int32_t)(lo - c->zc_done) > 0 ? lo - c->zc_done : 0;
+    last = hi - c->zc_done;
+    if (last >= ZC_PEND_MAX)
+        last = ZC_PEND_MAX - 1;     // can't happen; see conn_zerocopy_reserve()
+    if (last - first == ZC_PEND_MAX - 1) {
+        c->zc_pend = ~(uint64_t)0;
+    } else {
+        c->zc_pend |= (((uint64_t)1 << (last - first + 1)) - 1) << first;
+    }
+
+    // move zc_done past everything now known complete
+    if (c->zc_pend == ~(uint64_t)0) {
+        c->zc_done += ZC_PEND_MAX;
+        c->zc_pend = 0;
+    } else {
+        n = __builtin_ctzll(~c->zc_pend);
+        c->zc_done += n;
+        c->zc_pend >>= n;
+    }
+}
+
+/*
+ * Drains the socket's error queue of zerocopy notifications and releases
+ * the holds they complete. Called whenever a connection with holds gets an
+ * event: a pending notification wakes the socket with POLLERR.
+ */
+static void conn_zerocopy_reap(conn *c) {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 4];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    struct zc_hold *h;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->sfd, &msg, MSG_ERRQUEUE) == -1)
+            break;      // EAGAIN once drained
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* The device couldn't do it and the kernel copied anyway; stop
+             * paying for the notifications on this connection. */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                c->zerocopy = false;
+            conn_zerocopy_complete(c, serr->ee_info, serr->ee_data);
+        }
+    }
+
+    while ((h = c->zc_holds) != NULL && (int32_t)(h->seq - c->zc_done) < 0) {
+        c->zc_holds = h->next;
+        conn_zerocopy_free(c->thread, h);
+    }
+    if (c->zc_holds == NULL)
+        c->zc_tail = &c->zc_holds;
+#endif
+}
+
+/*
+ * Called before every zerocopy send. Makes sure there is room to hold the
+ * response once it is written, and that the send won't put more than
+ * ZC_PEND_MAX in flight. If not, the send copies like any other.
+ */
+bool conn_zerocopy_reserve(conn *c) {
+    if (c->zc_seq - c->zc_done >= ZC_PEND_MAX) {
+        conn_zerocopy_reap(c);
+        if (c->zc_seq - c->zc_done >= ZC_PEND_MAX)
+            return false;
+    }
+    if (c->zc_hold == NULL) {
+        c->zc_hold = malloc(sizeof(struct zc_hold) +
+                sizeof(void *) * (c->ileft + c->suffixleft));
+        if (c->zc_hold == NULL)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Keeps whatever is left of the response's items and suffixes alive until
+ * the kernel is done with the last zerocopy send that used them. The hold
+ * was set aside by conn_zerocopy_reserve() before that send.
+ */
+static void conn_zerocopy_hold(conn *c) {
+    int n = c->ileft + c->suffixleft;
+    struct zc_hold *h = c->zc_hold;
+    int i;
+
+    assert(h != NULL);
+    c->zc_hold = NULL;
+    if (n == 0) {
+        free(h);
+        return;
+    }
+
+    h->next = NULL;
+    h->seq = c->zc_seq - 1;
+    h->orphaned = 0;
+    h->nitems = c->ileft;
+    h->nsuffix = c->suffixleft;
+    for (i = 0; i < c->ileft; i++)
+        h->ptrs[i] = c->icurr[i];
+    for (i = 0; i < c->suffixleft; i++)
+        h->ptrs[h->nitems + i] = c->suffixcurr[i];
+    c->ileft = 0;
+    c->suffixleft = 0;
+
+    *c->zc_tail = h;
+    c->zc_tail = &h->next;
+}
+
+/* Holds outliving their connection are freed after this many seconds */
+#define ZC_ORPHAN_TIMEOUT 60
+
+/*
+ * Called once a second by each worker using zerocopy. Once the socket is
+ * closed its notifications are lost, so orphaned holds are released after
+ * a delay long enough for anything still queued in the stack to drain.
+ */
+void conn_zerocopy_orphans(LIBEVENT_THREAD *me) {
+    struct zc_hold **hp = &me->zc_orphans;
+    struct zc_hold *h;
+
+    while ((h = *hp) != NULL) {
+        if (current_time - h->orphaned >= ZC_ORPHAN_TIMEOUT) {
+            *hp = h->next;
+            conn_zerocopy_free(me, h);
+        } else {
+            hp = &h->next;
+        }
+    }
+}
+
 static void conn_release_items(conn *c) {
     assert(c != NULL);
 
@@ -341,6 +782,16 @@ static void conn_release_items(conn *c) {
         c->item = 0;
     }
 
+    if (c->zc_used) {
+        c->zc_used = false;
+        conn_zerocopy_hold(c);
+    }
+    if (c->zc_hold) {
+        // reserved for a send that ended up copying
+        free(c->zc_hold);
+        c->zc_hold = NULL;
+    }
+
     while (c->ileft > 0) {
         item *it = *(c->icurr);
         assert((it->it_flags & ITEM_SLABBED) == 0);
@@ -354,6 +805,11 @@ static void conn_release_items(conn *c) {
             do_cache_free(c->thread->suffix_cache, *(c->suffixcurr));
         }
     }
+
+    if (c->bin_batch_buf) {
+        do_cache_free(c->thread->bin_batch_cache, c->bin_batch_buf);
+        c->bin_batch_buf = NULL;
+    }
 #ifdef EXTSTORE
     if (c->io_wraplist) {
         io_wrap *tmp = c->io_wraplist;
@@ -403,18 +859,32 @@ void conn_free(conn *c) {
         conns[c->sfd] = NULL;
         if (c->hdrbuf)
             free(c->hdrbuf);
-        if (c->msglist)
-            free(c->msglist);
-        if (c->rbuf)
-            free(c->rbuf);
+        if (c->msglist) {
+            if (c->msg_malloced)
+                free(c->msglist);
+            else
+                do_cache_free(c->thread->msg_cache, c->msglist);
+        }
+        if (c->rbuf) {
+            if (c->rbuf_malloced)
+                free(c->rbuf);
+            else
+                do_cache_free(c->thread->rbuf_cache, c->rbuf);
+        }
         if (c->wbuf)
             free(c->wbuf);
         if (c->ilist)
             free(c->ilist);
         if (c->suffixlist)
             free(c->suffixlist);
-        if (c->iov)
-            free(c->iov);
+        if (c->iov) {
+            if (c->iov_malloced)
+                free(c->iov);
+            else
+                do_cache_free(c->thread->iov_cache, c->iov);
+        }
+        if (c->udp)
+            conn_udp_free(c);
         free(c);
     }
 }
@@ -424,6 +894,10 @@ static void conn_close(conn *c) {
 
     // delete the event, the socket and the conn
     event_del(&c->event);
+    if (c->epoll)
+        conn_epoll_forget(c);
+    conn_idle_disarm(c);
+    conn_sched_forget(c);
 
     if (settings.verbose > 1)
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
@@ -432,12 +906,34 @@ static void conn_close(conn *c) {
 
     MEMCACHED_CONN_RELEASE(c->sfd);
     conn_set_state(c, conn_closed);
+    // whatever is left unparsed or unsent is dropped with the connection
+    c->rbytes = 0;
+    c->resp_batched = false;
+    rbuf_release(c);
+    resp_release(c);
+    if (c->zc_holds) {
+        struct zc_hold *h;
+        conn_zerocopy_reap(c);
+        // the kernel may still be sending from these after close()
+        for (h = c->zc_holds; h != NULL; h = h->next)
+            h->orphaned = current_time;
+        if (c->zc_holds) {
+            *c->zc_tail = c->thread->zc_orphans;
+            c->thread->zc_orphans = c->zc_holds;
+            c->zc_holds = NULL;
+            c->zc_tail = &c->zc_holds;
+        }
+    }
     close(c->sfd);
 
     pthread_mutex_lock(&conn_lock);
     allow_new_conns = true;
     pthread_mutex_unlock(&conn_lock);
 
+    if (c->thread != NULL) {
+        __atomic_fetch_sub(&c->thread->conns, 1, __ATOMIC_RELAXED);
+    }
+
     STATS_LOCK();
     stats_state.curr_conns--;
     STATS_UNLOCK();
@@ -459,20 +955,19 @@ static void conn_shrink(conn *c) {
     if (IS_UDP(c->transport))
         return;
 
-    if (c->rsize > READ_BUFFER_HIGHWAT && c->rbytes < DATA_BUFFER_SIZE) {
-        char *newbuf;
-
-        if (c->rcurr != c->rbuf)
-            memmove(c->rbuf, c->rcurr, (size_t)c->rbytes);
-
-        newbuf = (char *)realloc((void *)c->rbuf, DATA_BUFFER_SIZE);
+    if (c->rbytes == 0) {
+        rbuf_release(c);
+    } else if (c->rbuf_malloced && c->rbytes < READ_BUFFER_SIZE) {
+        /* A big command is done; move the rest back to a pooled buffer */
+        char *newbuf = do_cache_alloc(c->thread->rbuf_cache);
 
         if (newbuf) {
-            c->rbuf = newbuf;
-            c->rsize = DATA_BUFFER_SIZE;
+            memcpy(newbuf, c->rcurr, (size_t)c->rbytes);
+            free(c->rbuf);
+            c->rbuf = c->rcurr = newbuf;
+            c->rsize = READ_BUFFER_SIZE;
+            c->rbuf_malloced = false;
         }
-        // TODO check other branch...
-        c->rcurr = c->rbuf;
     }
 
     if (c->isize > ITEM_LIST_HIGHWAT) {
@@ -485,24 +980,8 @@ static void conn_shrink(conn *c) {
         // TODO check error condition?
     }
 
-    if (c->msgsize > MSG_LIST_HIGHWAT) {
-        struct msghdr *newbuf = (struct msghdr *) realloc((void *)c->msglist, 
-                MSG_LIST_INITIAL * sizeof(c->msglist[0]));
-        if (newbuf) {
-            c->msglist = newbuf;
-            c->msgsize = MSG_LIST_INITIAL;
-        }
-        // TODO check error condition?
-    }
-    if (c->iovsize > IOV_LIST_HIGHWAT) {
-        struct iovec *newbuf = (struct iovec *) realloc((void *)c->iov, 
-                IOV_LIST_INITIAL * sizeof(c->iov[0]));
-        if (newbuf) {
-            c->iov = newbuf;
-            c->iovsize = IOV_LIST_INITIAL;
-        }
-        // TODO check return value
-    }
+    /* The response is out; its descriptors go back to the worker */
+    resp_release(c);
 }
 
 /**
@@ -547,22 +1026,6 @@ static void conn_set_state(conn *c, enum conn_states state) {
     }
 }
 
-static int start_conn_timeout_thread() {
-    int ret;
-
-    if (settings.idle_timeout == 0)
-        return -1;
-
-    if ((ret = pthread_create(&conn_timeout_tid, NULL, 
-                    conn_timeout_thread, NULL)) != 0) {
-        fprintf(stderr, "Can't create idle connection timeout thread: %s\n",
-            strerror(ret));
-        return -1;
-    }
-
-    return 0;
-}
-
 /**
  * Initialize the connections array. We don't actually allocate connection
  * structures until they're needed, so as to avoid wasting memory when the 
@@ -644,6 +1107,10 @@ static void clock_handler(const int fd, const short which, void *arg) {
     // This function should be quick to avoid delaying the timer.
     // 判断是否需要扩展hash表
     assoc_start_expand(stats_state.curr_items);
+
+    if (settings.conn_dispatch_load) {
+        threads_load_sample();
+    }
     
     // 继续添加定时器
     evtimer_set(&clockevent, clock_handler, 0);
@@ -667,6 +1134,16 @@ static void clock_handler(const int fd, const short which, void *arg) {
     }
 }
 
+/* Unmutes a worker's own listener, see the EMFILE case in drive_machine() */
+static void listen_resume(const int fd, const short which, void *arg) {
+    conn *c = (conn *)arg;
+
+    if (!update_event(c, EV_READ | EV_PERSIST)) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't update event\n");
+    }
+}
+
 // 状态机处理connection的事件
 static void drive_machine(conn *c) {
     bool stop = false;
@@ -713,7 +1190,19 @@ static void drive_machine(conn *c) {
                 } else if (errno == EMFILE) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Too many open connections\n");
-                    accept_new_conns(false);
+                    if (c->thread != NULL) {
+                        /* A worker's SO_REUSEPORT listener. Only its own
+                         * thread may touch it, so mute it for a moment
+                         * instead of spinning; connections hashed to it wait
+                         * in its backlog.
+                         */
+                        struct timeval t = {.tv_sec = 0, .tv_usec = 10000};
+                        update_event(c, 0);
+                        event_base_once(c->thread->base, -1, EV_TIMEOUT,
+                                        listen_resume, c, &t);
+                    } else {
+                        accept_new_conns(false);
+                    }
                     stop = true;
                 } else {
                     perror("accept()");
@@ -738,6 +1227,24 @@ static void drive_machine(conn *c) {
                 STATS_LOCK();
                 stats.rejected_conns++;
                 STATS_UNLOCK();
+            } else if (c->thread != NULL) {
+                /* Accepted on the worker's own socket, keep it here */
+                conn *nc = conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                                        DATA_BUFFER_SIZE, c->transport,
+                                        c->thread->base);
+                if (nc == NULL) {
+                    if (settings.verbose > 0) {
+                        fprintf(stderr, "Can't listen for events on fd %d\n",
+                                sfd);
+                    }
+                    close(sfd);
+                } else {
+                    nc->thread = c->thread;
+                    __atomic_fetch_add(&c->thread->conns, 1, __ATOMIC_RELAXED);
+                    if (settings.event_epoll)
+                        conn_epoll_attach(nc);
+                    conn_idle_arm(nc);
+                }
             } else {
                 dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
                                         DATA_BUFFER_SIZE, c->transport);
@@ -815,6 +1322,8 @@ static void drive_machine(conn *c) {
 // 主connection以及链接的connection的处理函数
 static void event_handler(const int fd, const short which, void *arg) {
     conn *c;
+    LIBEVENT_THREAD *me;
+    struct timespec start;
 
     c = (conn *)arg;
     assert(c != NULL);
@@ -828,13 +1337,447 @@ static void event_handler(const int fd, const short which, void *arg) {
         conn_close(c);
         return;
     }
+    /* The main thread's listeners have no worker to charge */
+    me = settings.conn_dispatch_load ? c->thread : NULL;
+    if (me != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    // 被事件直接驱动时, 不必再在就绪队列中排队
+    conn_sched_forget(c);
+
+    // 先回收内核已经发送完成的zerocopy响应
+    if (c->zc_holds)
+        conn_zerocopy_reap(c);
+
     // 状态机来处理connection的事件
     dirver_machine(c);
 
+    if (me != NULL) {
+        thread_event_done(me, c, &start);
+    }
+
     // wait for next event
     return;
 }
 
+/*
+ * Edge-triggered epoll engine (-o event_engine=epoll).
+ *
+ * A client connection is added once to its worker's epoll instance with
+ * EPOLLIN | EPOLLOUT | EPOLLET and is never re-armed: update_event() only
+ * records which direction drive_machine() wants next. Each edge sets a bit
+ * in c->ep_ready that stays set until a read or write runs into EAGAIN, so
+ * readiness seen while the connection wanted the other direction is not
+ * lost. A connection that stops with wanted readiness left over (it wants to
+ * write while the socket is still writable) goes on the worker's epoll_ready
+ * list and is run again on the next pass instead of waiting for an edge that
+ * will never come. One that used up its turn waits on the scheduler's queue
+ * instead, see conn_sched_defer().
+ *
+ * Listeners, the notify eventfd and timers stay on libevent; the epoll fd
+ * itself is watched by the worker's event base.
+ */
+#ifdef __linux__
+/* Most edges taken from the kernel per epoll_wait() */
+#define CONN_EPOLL_EVENTS 64
+/* Initial size of a worker's epoll_ready list */
+#define CONN_EPOLL_READY_INITIAL 64
+
+static bool conn_epoll_queue(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (c->ep_queued)
+        return true;
+    if (me->epoll_ready_count == me->epoll_ready_size) {
+        int size = me->epoll_ready_size ? me->epoll_ready_size * 2
+                                        : CONN_EPOLL_READY_INITIAL;
+        conn **ready = realloc(me->epoll_ready, size * sizeof(conn *));
+        if (ready == NULL) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return false;
+        }
+        me->epoll_ready = ready;
+        me->epoll_ready_size = size;
+    }
+    me->epoll_ready[me->epoll_ready_count++] = c;
+    c->ep_queued = true;
+    return true;
+}
+
+/*
+ * Puts a connection that was just driven back on the ready list if it
+ * stopped with readiness it wants left over.
+ */
+static void conn_epoll_requeue(conn *c, LIBEVENT_THREAD *me) {
+    /* Hands off (migration, extstore, watchers) detach it first; don't
+     * touch it again once another thread may own it. Connections on the
+     * scheduler's queue wait for their turn there. */
+    if (c->thread == me && c->epoll && c->sched_pprev == NULL &&
+            (c->ep_ready & c->ev_flags)) {
+        if (!conn_epoll_queue(c)) {
+            fprintf(stderr, "Couldn't queue fd %d for events\n", c->sfd);
+            conn_set_state(c, conn_closing);
+            drive_machine(c);
+        }
+    }
+}
+
+/* Run a connection for whatever readiness it has and wants. */
+static void conn_epoll_run(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    short which = c->ep_ready & c->ev_flags;
+
+    if (which == 0)
+        return;
+    event_handler(c->sfd, which, c);
+    conn_epoll_requeue(c, me);
+}
+
+/*
+ * Registers a client connection with its worker's epoll instance, taking it
+ * off the libevent base. Returns false if the engine is off or the
+ * registration failed, in which case the caller keeps the libevent event.
+ */
+bool conn_epoll_attach(conn *c) {
+    struct epoll_event ev;
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (me == NULL || me->epoll_fd == -1 || IS_UDP(c->transport))
+        return false;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    c->ep_ready = 0;
+    c->ep_queued = false;
+    if (epoll_ctl(me->epoll_fd, EPOLL_CTL_ADD, c->sfd, &ev) == -1) {
+        perror("epoll_ctl");
+        return false;
+    }
+    event_del(&c->event);
+    c->epoll = true;
+
+#ifdef SO_BUSY_POLL
+    if (settings.busy_poll_us > 0) {
+        int usec = settings.busy_poll_us;
+        /* Raising it past net.core.busy_read needs CAP_NET_ADMIN; the
+         * worker still spins in user space without it. */
+        setsockopt(c->sfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+    }
+#endif
+    return true;
+}
+
+/*
+ * Forgets a connection's epoll state without a syscall. Used on close,
+ * where close() itself drops the registration.
+ */
+void conn_epoll_forget(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    int i;
+
+    if (c->ep_queued) {
+        for (i = 0; i < me->epoll_ready_count; i++) {
+            if (me->epoll_ready[i] == c) {
+                me->epoll_ready[i] = NULL;
+                break;
+            }
+        }
+        c->ep_queued = false;
+    }
+    c->epoll = false;
+    c->ep_ready = 0;
+}
+
+/*
+ * Stops epoll delivery for a connection that's being handed to another
+ * thread. The new owner attaches it again in conn_worker_readd().
+ */
+void conn_epoll_detach(conn *c) {
+    if (!c->epoll)
+        return;
+    if (epoll_ctl(c->thread->epoll_fd, EPOLL_CTL_DEL, c->sfd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+    conn_epoll_forget(c);
+}
+
+/*
+ * Takes whatever edges are pending without blocking, runs the connections
+ * they belong to, then the connections left on the ready list by the last
+ * pass. Returns how many connections were run.
+ */
+int conn_epoll_poll(LIBEVENT_THREAD *me) {
+    struct epoll_event evs[CONN_EPOLL_EVENTS];
+    int n, i, count;
+    int done = 0;
+    conn *c;
+
+    n = epoll_wait(me->epoll_fd, evs, CONN_EPOLL_EVENTS, 0);
+    for (i = 0; i < n; i++) {
+        c = evs[i].data.ptr;
+        if (!c->epoll)
+            continue;
+        if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            c->ep_ready |= EV_READ;
+        if (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            c->ep_ready |= EV_WRITE;
+        if (c->ep_ready & c->ev_flags) {
+            conn_epoll_run(c);
+            done++;
+        }
+    }
+
+    /* Connections queued while this runs wait for the next pass */
+    count = me->epoll_ready_count;
+    for (i = 0; i < count; i++) {
+        c = me->epoll_ready[i];
+        if (c == NULL)
+            continue;
+        c->ep_queued = false;
+        conn_epoll_run(c);
+        done++;
+    }
+    if (count > 0) {
+        me->epoll_ready_count -= count;
+        memmove(me->epoll_ready, me->epoll_ready + count,
+                me->epoll_ready_count * sizeof(conn *));
+    }
+    if (me->epoll_ready_count > 0) {
+        event_active(&me->epoll_event, EV_READ, 0);
+    }
+
+    return done;
+}
+#else
+static void conn_epoll_requeue(conn *c, LIBEVENT_THREAD *me) {
+}
+
+bool conn_epoll_attach(conn *c) {
+    return false;
+}
+
+void conn_epoll_forget(conn *c) {
+}
+
+void conn_epoll_detach(conn *c) {
+}
+
+int conn_epoll_poll(LIBEVENT_THREAD *me) {
+    return 0;
+}
+#endif
+
+/*
+ * Per-worker ready queue. A connection whose turn ran out (see
+ * sched_turn_over()) with commands still buffered is put at the back of
+ * the queue instead of being driven on. The queue runs from a zero timeout
+ * timer, so the worker polls for I/O first and connections that became
+ * ready meanwhile get their turn before a pipelining client gets another.
+ * A connection driven by an event in the meantime leaves the queue.
+ */
+
+/* Queues c for another turn. Returns false if the timer couldn't be armed. */
+bool conn_sched_defer(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    struct timeval t = {.tv_sec = 0, .tv_usec = 0};
+
+    if (c->sched_pprev != NULL)
+        return true;
+    c->sched_next = NULL;
+    c->sched_pprev = me->sched_tail;
+    *me->sched_tail = c;
+    me->sched_tail = &c->sched_next;
+    if (me->sched_count++ == 0 && event_add(&me->sched_event, &t) == -1) {
+        conn_sched_forget(c);
+        return false;
+    }
+    return true;
+}
+
+/* Takes c off its worker's ready queue, if it's on it */
+void conn_sched_forget(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (c->sched_pprev == NULL)
+        return;
+    *c->sched_pprev = c->sched_next;
+    if (c->sched_next)
+        c->sched_next->sched_pprev = c->sched_pprev;
+    else
+        me->sched_tail = c->sched_pprev;
+    c->sched_next = NULL;
+    c->sched_pprev = NULL;
+    me->sched_count--;
+}
+
+/*
+ * Gives every connection queued before this pass another turn. Those that
+ * use it up again go to the back and wait for the next pass.
+ */
+void conn_sched_run(LIBEVENT_THREAD *me) {
+    struct timeval t = {.tv_sec = 0, .tv_usec = 0};
+    int n = me->sched_count;
+    conn *c;
+
+    while (n-- > 0 && (c = me->sched_head) != NULL) {
+        // event_handler() takes it off the queue
+        event_handler(c->sfd, EV_READ, c);
+        conn_epoll_requeue(c, me);
+    }
+
+    if (me->sched_head != NULL && event_add(&me->sched_event, &t) == -1) {
+        perror("event_add");
+    }
+}
+
+/* Options shared by every TCP listening socket */
+static void server_socket_tcp_options(int sfd) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int error;
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    if (error != 0)
+        perror("setsockopt");
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    if (error != 0)
+        perror("setsockopt");
+
+    error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    if (error != 0)
+        perror("setsockopt");
+}
+
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+/*
+ * Picks the listener for a new connection by the CPU that took its SYN:
+ * socket index cpu % count. With workers pinned in listener order the
+ * connection lands on the worker whose CPU is already handling the flow.
+ */
+static int server_socket_steer_cpu(int sfd, unsigned int count) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, count },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    return setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                      (void *)&prog, sizeof(prog));
+}
+#endif
+
+/*
+ * Gives every worker its own listening socket on the address sfd is bound
+ * to, all in one SO_REUSEPORT group, so the kernel spreads connections over
+ * them and workers accept without going through the main thread. sfd
+ * itself becomes worker 0's socket.
+ */
+static int server_socket_reuseport(int sfd, struct addrinfo *ai,
+                                   enum network_transport transport) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int flags = 1;
+    int *fds;
+    int i;
+
+    /* The port may have been picked by the kernel */
+    if (getsockname(sfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+        perror("getsockname()");
+        return 1;
+    }
+
+    fds = calloc(settings.num_threads, sizeof(int));
+    if (fds == NULL) {
+        perror("Failed to allocate listener list");
+        return 1;
+    }
+    fds[0] = sfd;
+
+    for (i = 1; i < settings.num_threads; i++) {
+        if ((fds[i] = new_socket(ai)) == -1) {
+            perror("server_socket");
+            goto fail;
+        }
+        setsockopt(fds[i], SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+        if (setsockopt(fds[i], SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) != 0) {
+            perror("setsockopt(SO_REUSEPORT)");
+            close(fds[i]);
+            goto fail;
+        }
+        server_socket_tcp_options(fds[i]);
+        if (bind(fds[i], (struct sockaddr *)&addr, addrlen) == -1 ||
+            listen(fds[i], settings.backlog) == -1) {
+            perror("bind()/listen()");
+            close(fds[i]);
+            goto fail;
+        }
+    }
+
+    if (settings.reuseport_cpu) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+        /* The program applies to the whole group */
+        if (server_socket_steer_cpu(sfd, settings.num_threads) != 0) {
+            perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        }
+#else
+        fprintf(stderr, "reuseport_cpu is not supported on this platform\n");
+#endif
+    }
+
+    /* Socket i is index i in the reuseport group, and goes to worker i */
+    for (i = 0; i < settings.num_threads; i++) {
+        dispatch_listen_conn(fds[i], i, transport);
+    }
+    free(fds);
+    return 0;
+
+fail:
+    while (--i > 0) {
+        close(fds[i]);
+    }
+    free(fds);
+    return 1;
+}
+
+/*
+ * With -o udp_batch each worker reads its own UDP socket in one
+ * SO_REUSEPORT group instead of sharing a dup() of the same one. The kernel
+ * hashes a client's address and port to a fixed member, so every datagram
+ * of a multi-packet request reaches the worker reassembling it.
+ */
+static int server_socket_udp_peer(int sfd, struct addrinfo *ai) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int flags = 1;
+    int fd;
+
+    if (getsockname(sfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+        perror("getsockname()");
+        return -1;
+    }
+    if ((fd = new_socket(ai)) == -1) {
+        perror("server_socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags)) != 0 ||
+        bind(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+        perror("bind()");
+        close(fd);
+        return -1;
+    }
+    maximize_sndbuf(fd);
+    return fd;
+}
+
 /*
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -849,7 +1792,6 @@ static int server_socket(const char *interface,
                             enum network_transport transport,
                             FILE *portnumber_file) {
     int sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints = { .ai_flags = AI_PASSIVE,
@@ -902,18 +1844,26 @@ static int server_socket(const char *interface,
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
         if (IS_UDP(transport)) {
             maximize_sndbuf(sfd);
+            if (settings.udp_batch > 0) {
+                error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+                if (error != 0) {
+                    perror("setsockopt(SO_REUSEPORT)");
+                    close(sfd);
+                    freeaddrinfo(ai);
+                    return 1;
+                }
+            }
         } else {
-            error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
-
-            error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-            if (error != 0)
-                perror("setsockopt");
-
-            error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
+            if (settings.reuseport) {
+                error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+                if (error != 0) {
+                    perror("setsockopt(SO_REUSEPORT)");
+                    close(sfd);
+                    freeaddrinfo(ai);
+                    return 1;
+                }
+            }
+            server_socket_tcp_options(sfd);
         }
 
         if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
@@ -967,11 +1917,24 @@ static int server_socket(const char *interface,
                  * among threads, so this is guaranteed to assign one 
                  * FD to each thread.
                  */
-                int per_thread_fd = c ? dup(sfd) : sfd;
+                int per_thread_fd = sfd;
+                if (c > 0) {
+                    per_thread_fd = settings.udp_batch > 0 ?
+                        server_socket_udp_peer(sfd, next) : dup(sfd);
+                    if (per_thread_fd == -1) {
+                        fprintf(stderr, "failed to create per-worker UDP socket\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
                 dispatch_conn_new(per_thread_fd, conn_read,
                                     EV_READ | EV_PERSIST,
                                     UDP_READ_BUFFER_SIZE, transport)；
             }
+        } else if (settings.reuseport) {
+            if (server_socket_reuseport(sfd, next, transport) != 0) {
+                fprintf(stderr, "failed to create per-worker listeners\n");
+                exit(EXIT_FAILURE);
+            }
         } else {
             if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                                 EV_READ | EV_PERSIST, 1,
@@ -1246,10 +2209,6 @@ int main (int argc, char **argv) {
     memcached_thread_init(settings.num_threads, NULL);
 #endif
 
-    if (settings.idle_timeout && start_conn_timeout_thread() == -1) {
-        exit(EXIT_FAILURE);
-    }
-
     /* initialise clock event */
     clock_handler(0, 0, 0);
 
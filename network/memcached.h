@@ -104,6 +104,21 @@ struct settings {
     bool use_cas;
     enum protocol binding_protocol;
     int backlog;
+    bool reuseport;         // each worker accepts on its own SO_REUSEPORT socket
+    bool reuseport_cpu;     // steer new connections by the CPU they arrive on
+    bool conn_dispatch_load;// dispatch new connections by worker load
+    bool conn_migrate;      // move long-lived connections off busy workers
+    bool event_epoll;       // drive client connections from per-worker edge-triggered epoll
+    int busy_poll_us;       // spin this long on an idle worker before sleeping, 0 = off
+    int zerocopy_min;       // send responses at least this big with MSG_ZEROCOPY, 0 = off
+    int udp_batch;          // datagrams per recvmmsg/sendmmsg on UDP, 0 = one at a time
+    int sched_bytes;        // bytes a connection may move per turn on its worker, 0 = no limit
+    int sched_usec;         // time a connection may run per turn on its worker, 0 = no limit
+    bool sched_coalesce;    // answer a pipelined run of gets with one sendmsg
+    char *worker_cpus;      // CPUs to pin workers to, one each in order
+    char *worker_nodes;     // NUMA nodes to pin workers to, one each in order
+    char *worker_rxq;       // pin workers to the CPUs of this NIC's RX queues
+    char *bg_cpus;          // CPUs for the background threads
     int item_size_max;      // Maximum item size
     int slab_chunk_size_max;// Upper end for chunks within slab pages
     int slab_page_size;     // Slab's page units.
@@ -234,21 +249,105 @@ enum network_transport {
     udp_transport       // udp通信
 };
 
+// pause_threads()的操作类型
+enum pause_thread_types {
+    PAUSE_WORKER_THREADS = 0,
+    PAUSE_ALL_THREADS,
+    RESUME_ALL_THREADS,
+    RESUME_WORKER_THREADS
+};
+
+/* Idle timeout wheel: four levels of 64 one-second slots, ~194 days */
+#define IDLE_WHEEL_BITS 6
+#define IDLE_WHEEL_SLOTS (1 << IDLE_WHEEL_BITS)
+#define IDLE_WHEEL_LEVELS 4
+
+/* Most datagrams moved by one recvmmsg/sendmmsg */
+#define UDP_BATCH_MAX 64
+
+/* Size of the read buffers workers lend to TCP connections */
+#define READ_BUFFER_SIZE 16384
+
+/* Response descriptors workers lend to connections; enough for a few
+ * hundred keys of a multiget before a connection needs its own */
+#define RESP_IOV_POOLED 1024
+#define RESP_MSG_POOLED 16
+
+/* Response headers of one batch of quiet binary gets, see process_bin_getq_batch() */
+#define BIN_BATCH_HDR_SIZE 8192
+
+/* Zerocopy sends a connection keeps in flight, one bit each in zc_pend */
+#define ZC_PEND_MAX 64
+
+/*
+ * Items and suffix buffers referenced by a MSG_ZEROCOPY send. They stay
+ * pinned until the kernel reports the send complete, see
+ * conn_zerocopy_reap().
+ */
+struct zc_hold {
+    struct zc_hold *next;
+    uint32_t seq;           // last zerocopy send that references them
+    rel_time_t orphaned;    // when the connection closed under it
+    int nitems;
+    int nsuffix;
+    void *ptrs[];           // nitems items, then nsuffix suffixes
+};
+
 typedef struct {
     pthread_t thread_id;                // unique ID of this thread
     struct event_base *base;            // libevent handle this thread uses
     struct event notify_event;          // listen event for notify pipe
+#ifdef HAVE_EVENTFD
+    int notify_event_fd;                // eventfd to wake this thread
+#else
     int notify_receive_fd;              // receiving end of notify pipe
     int notify_send_fd;                 // sending end of notify pipe
+#endif
     struct thread_stats stats;          // Stats generated by this thread
     struct conn_queue *new_conn_queue;  // queue of new connections to handle
     cache_t *suffix_cache;              // suffix cache
+    cache_t *rbuf_cache;                // read buffers lent to connections
+    cache_t *iov_cache;                 // response iovecs lent to connections
+    cache_t *msg_cache;                 // response msghdrs lent to connections
+    cache_t *bin_batch_cache;           // headers of batched quiet binary gets
 #ifdef EXTSTORE
     cache_t *io_cache;                  // IO objects
     void *storage;                      // data object for storage system
 #endif
     logger *l;                          // logger buffer
     void *lru_bump_buf;                 // async LRU bump buffer
+    /* Published by the worker for load-aware dispatch */
+    uint64_t busy_ns;                   // time spent handling events
+    int conns;                          // client connections owned
+    int migrate_to;                     // worker to hand a connection to, or -1
+    /* Main thread only, refreshed by threads_load_sample() */
+    unsigned int load_busy;             // permille of the last sample spent busy
+    uint64_t load_bytes;                // bytes read and written last sample
+    uint64_t load_busy_ns;              // busy_ns at the last sample
+    uint64_t load_bytes_total;          // bytes at the last sample
+    /* Edge-triggered epoll engine, see conn_epoll_poll() */
+    int epoll_fd;                       // per-worker epoll instance, or -1
+    struct event epoll_event;           // libevent watch on epoll_fd
+    struct conn **epoll_ready;          // conns to drive again without a new edge
+    int epoll_ready_count;
+    int epoll_ready_size;
+    /* Idle connection timeouts, see conn_idle_tick() */
+    struct event idle_event;            // ticks the wheel once a second
+    rel_time_t idle_wheel_time;         // next second the wheel will process
+    struct conn *idle_wheel[IDLE_WHEEL_LEVELS][IDLE_WHEEL_SLOTS];
+    /* Zerocopy holds whose connection closed before the kernel finished */
+    struct event zc_event;              // sweeps zc_orphans
+    struct zc_hold *zc_orphans;
+    /* Connections that used up their turn with input left, see conn_sched_run() */
+    struct event sched_event;           // zero timeout, runs the queue after the next poll
+    struct conn *sched_head;
+    struct conn **sched_tail;
+    int sched_count;
+    /* The turn of the connection being driven */
+    int sched_reqs;                     // commands left
+    uint64_t sched_bytes;               // bytes_read + bytes_written when it began
+    struct timespec sched_start;        // when it began, with sched_usec
+    uint64_t epoch_seen;                // global epoch at the last quiescent state, see epoch_quiescent()
 } LIBEVENT_THREAD;
 typedef struct conn conn;
 #ifdef EXTSTORE
@@ -276,14 +375,32 @@ struct conn {
     enum conn_states state;     // 网络接口状态
     enum bin_substates substate;
     rel_time_t last_cmd_time;   // 最后处理cmd的时间
+    rel_time_t conn_start;      // connection建立的时间
+    rel_time_t idle_expires;    // 在空闲时间轮上的到期时间
+    conn    *idle_next;         // 时间轮槽位链表
+    conn    **idle_pprev;       // 指向前一个节点的idle_next, 不在时间轮上时为NULL
+    conn    *sched_next;        // 线程就绪队列链表
+    conn    **sched_pprev;      // 指向前一个节点的sched_next, 不在队列上时为NULL
     struct event event;
     short ev_flags;
     short which;    /* which events were just triggered */
+    bool epoll;     /* registered with the worker's epoll instance */
+    bool ep_queued; /* on the worker's epoll_ready list */
+    short ep_ready; /* EV_READ/EV_WRITE seen and not yet run into EAGAIN */
+    bool zerocopy;  /* SO_ZEROCOPY is on for this socket */
+    bool zc_used;   /* the response being written went out with MSG_ZEROCOPY */
+    uint32_t zc_seq;    /* zerocopy sends issued on this socket so far */
+    uint32_t zc_done;   /* every send before this one has completed */
+    uint64_t zc_pend;   /* sends zc_done + n already complete, bit n */
+    struct zc_hold *zc_hold;    /* reserved for the response being written */
+    struct zc_hold *zc_holds;   /* oldest first */
+    struct zc_hold **zc_tail;
 
     char *rbuf;     /* buffer to read commands into, 读取的buffer */
     char *rcurr;    /* but if we parsed some already, this is where we stopped，当前读取到的位置*/
     int  rsize;     /* total allocated size of rbuf, rbuf的长度 */
     int  rbytes;    /* how much data, starting from rcur, do we have unpares. 还有多少数据未读取 */
+    bool rbuf_malloced; /* rbuf是私有的malloc内存, 而不是从线程的rbuf_cache借来的 */
 
     char *wbuf;     // 写入buffer的位置
     char *wcurr;    // 当前写入位置
@@ -314,12 +431,18 @@ struct conn {
     struct iovec *iov;
     int    iovsize;     // number of elements allocated in iov[]
     int    iovused;     // number of elements used in iiov[]
+    bool   iov_malloced;    // iov是私有的, 而不是从线程的iov_cache借来的
 
     struct msghdr *msglist;
     int     msgsize;    // number of elements allocated in msglist[]
+    bool    msg_malloced;   // msglist是私有的, 而不是从线程的msg_cache借来的
     int     msgused;    // number of elements used in msglist[]
     int     msgcurr;    // element in msglist[] being transmitted now
     int     msgbytes;   // number of bytes in current msg
+    bool    resp_batched;   // 响应暂不发送, 与后续流水线中的get合并成一次sendmsg
+    int     resp_msgmark;   // 当前命令开始时的msgused
+    int     resp_iovmark;   // 当前命令开始时的iovused
+    int     resp_iovlenmark;// 当前命令开始时最后一个msghdr的msg_iovlen
 
     // 用于记录往外写的item
     item    **ilist;    // list of items to write out
@@ -331,6 +454,7 @@ struct conn {
     int     suffixsize;
     char    **suffixcurr;
     int     suffixleft;
+    char    *bin_batch_buf; // 批量GETQ/GETKQ响应的header, 从线程的bin_batch_cache借来
 #ifdef EXTSTORE
     int     io_wrapleft;
     unsigned int recache_counter;
@@ -344,6 +468,7 @@ struct conn {
     int     request_id; // Incoming UDP request ID, if this is a UDP "connection"
     struct sockaddr_in6 request_addr;   // udp: Who sent the most recent request
     socklen_t request_addr_size;
+    struct udp_batch *udp;  // udp: recvmmsg ring and reassembly, freed by conn_udp_free()
     unsigned char *hdrbuf;  // udp packet headers
     int     hdrsize;    // number of headers' worth of space is allocated
 
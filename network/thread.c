@@ -1,8 +1,18 @@
 
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sched.h>
+#endif
+
 /* An item in the connection queue */
 enum conn_queue_item_modes {
     queue_new_conn,     // brand new connection
-    queue_redispatch    // redispatching from side thread
+    queue_redispatch,   // redispatching from side thread
+    queue_pause,        // stop at register_thread_initialized()
+    queue_quiesce       // report a quiescent state, see epoch_synchronize()
 };
 typedef struct conn_queue_item CQ_ITEM;
 struct conn_queue_item {
@@ -16,12 +26,12 @@ struct conn_queue_item {
     CQ_ITEM         *next;
 };
 
-/* A connection queue */
+/* A connection queue. Any thread may push; only the owning worker pops,
+ * and it takes everything queued at once. Lock free.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    pthread_mutex_t lock;
+    CQ_ITEM *head;      // newest first
 };
 
 /* Lock to cause worker threads to hong up after being woken */
@@ -66,44 +76,39 @@ static void register_thread_initialized(void) {
  * Initializes a connection queue
  */
 static void cq_init(CQ *cq) {
-    pthread_mutex_init(&cq->lock, NULL);
     cq->head = NULL;
-    cq->tail = NULL;
 }
 
 /*
- * Looks for an item on connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
+ * Takes every item off a connection queue, oldest first. Doesn't block;
+ * returns NULL if nothing was queued.
  */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
+static CQ_ITEM *cq_pop_all(CQ *cq) {
+    CQ_ITEM *item = __atomic_exchange_n(&cq->head, NULL, __ATOMIC_ACQUIRE);
+    CQ_ITEM *fifo = NULL;
+    CQ_ITEM *next;
 
-    pthread_mutex_lock(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
+    while (item != NULL) {
+        next = item->next;
+        item->next = fifo;
+        fifo = item;
+        item = next;
     }
-    pthread_mutex_unlock(&cq->lock);
-
-    return item;
+    return fifo;
 }
 
 /**
- * Adds an item to a connection queue.
+ * Adds an item to a connection queue. Returns true if the queue was empty,
+ * in which case the caller has to wake the worker up.
  */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
+static bool cq_push(CQ *cq, CQ_ITEM *item) {
+    CQ_ITEM *head = __atomic_load_n(&cq->head, __ATOMIC_RELAXED);
 
-    pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    pthread_mutex_unlock(&cq->lock);
+    do {
+        item->next = head;
+    } while (!__atomic_compare_exchange_n(&cq->head, &head, item, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return head == NULL;
 }
 
 /*
@@ -148,23 +153,274 @@ static CQ_ITEM *cqi_new(void) {
 }
 
 /*
- * Frees a connection queue item (adds it to the freelist.)
+ * Frees a list of connection queue items, first to last, (adds them to the
+ * freelist.)
  */
-static void cqi_free(CQ_ITEM *item) {
+static void cqi_free_list(CQ_ITEM *first, CQ_ITEM *last) {
     pthread_mutex_lock(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
+    last->next = cqi_freelist;
+    cqi_freelist = first;
     pthread_mutex_unlock(&cqi_freelist_lock);
 }
 
 /*
- * Creates a worker thread.
+ * Queues an item for a worker, waking it up if its queue was empty. Wakeups
+ * for a busy worker coalesce: it picks up everything queued when it runs.
+ */
+static void cq_notify(LIBEVENT_THREAD *thread, CQ_ITEM *item) {
+    if (!cq_push(thread->new_conn_queue, item))
+        return;
+#ifdef HAVE_EVENTFD
+    uint64_t u = 1;
+    if (write(thread->notify_event_fd, &u, sizeof(u)) != sizeof(u)) {
+        perror("Writing to thread notify eventfd");
+    }
+#else
+    char buf[1];
+    buf[0] = 'c';
+    if (write(thread->notify_send_fd, buf, 1) != 1) {
+        perror("Writing to thread notify pipe");
+    }
+#endif
+}
+
+/*
+ * CPU placement. With -o worker_cpus, worker_nodes or worker_rxq every
+ * worker is created on a CPU set of its own, and the main thread runs on
+ * that set while it sets the worker up, so the pages it first touches for
+ * the worker (event base, bump buffer, logger) come from the worker's node.
+ * Pooled buffers are allocated later by the pinned worker itself. With
+ * -o bg_cpus the background threads (LRU maintainer and crawler, slab
+ * rebalancer, hash expansion, extstore) are kept to a set of their own.
+ *
+ * Lists are in the kernel's cpulist format, with ':' also separating
+ * entries since ',' separates -o options: "0-3:8-11".
+ */
+#ifdef __linux__
+static cpu_set_t *worker_cpusets;   // one per worker, NULL if not pinned
+static cpu_set_t main_cpuset;       // the main thread's, put back after setup
+static pthread_attr_t bg_attr;
+static bool bg_pinned = false;
+
+/* Parses a cpulist into ids[], in order. Returns the count, or -1. */
+static int cpulist_parse(const char *s, int *ids, const int max) {
+    char *end;
+    long lo, hi;
+    int n = 0;
+
+    while (*s != '\0' && *s != '\n') {
+        lo = strtol(s, &end, 10);
+        if (end == s || lo < 0)
+            return -1;
+        hi = lo;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo)
+                return -1;
+        }
+        for (; lo <= hi; lo++) {
+            if (n == max || lo >= CPU_SETSIZE)
+                return -1;
+            ids[n++] = lo;
+        }
+        s = end;
+        if (*s == ',' || *s == ':') {
+            s++;
+        } else if (*s != '\0' && *s != '\n') {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* Same, for a list the kernel keeps in a file */
+static int cpulist_read(const char *path, int *ids, const int max) {
+    char buf[1024];
+    int n = -1;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return -1;
+    if (fgets(buf, sizeof(buf), fp) != NULL)
+        n = cpulist_parse(buf, ids, max);
+    fclose(fp);
+    return n;
+}
+
+/*
+ * The first CPU each receive queue interrupt of interface ifname is routed
+ * to, in interrupt order. Queues are found by their /proc/interrupts name,
+ * which multiqueue drivers derive from the interface ("eth0-TxRx-3",
+ * "eth0-rx-3"); transmit-only vectors are skipped.
+ */
+static int rxq_cpus(const char *ifname, int *ids, const int max) {
+    char line[4096];
+    char path[64];
+    int cpus[CPU_SETSIZE];
+    const size_t len = strlen(ifname);
+    char *name, *end;
+    int irq;
+    int n = 0;
+    FILE *fp = fopen("/proc/interrupts", "r");
+
+    if (fp == NULL)
+        return -1;
+    while (n < max && fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, " %d:", &irq) != 1)
+            continue;
+        end = line + strlen(line);
+        while (end > line && (end[-1] == '\n' || end[-1] == ' '))
+            *--end = '\0';
+        for (name = end; name > line && name[-1] != ' '; name--)
+            ;
+        if (strncmp(name, ifname, len) != 0 || name[len] != '-' ||
+                strcasestr(name + len, "rx") == NULL) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+        if (cpulist_read(path, cpus, CPU_SETSIZE) > 0)
+            ids[n++] = cpus[0];
+    }
+    fclose(fp);
+    return n;
+}
+
+/*
+ * Works out where every thread goes from the settings. Called once by the
+ * main thread before any thread is started. Returns -1 on a bad setting.
+ */
+int thread_affinity_init(int nthreads) {
+    int ids[CPU_SETSIZE];
+    int cpus[CPU_SETSIZE];
+    char path[64];
+    cpu_set_t set;
+    int n, m, i, j;
+
+    if ((settings.worker_cpus != NULL) + (settings.worker_nodes != NULL) +
+            (settings.worker_rxq != NULL) > 1) {
+        fprintf(stderr, "Only one of worker_cpus, worker_nodes and worker_rxq can be set\n");
+        return -1;
+    }
+
+    if (settings.worker_rxq != NULL) {
+        n = rxq_cpus(settings.worker_rxq, ids, CPU_SETSIZE);
+        if (n <= 0) {
+            fprintf(stderr, "No receive queue interrupts found for %s\n",
+                    settings.worker_rxq);
+            return -1;
+        }
+    } else if (settings.worker_cpus != NULL || settings.worker_nodes != NULL) {
+        n = cpulist_parse(settings.worker_cpus ? settings.worker_cpus : settings.worker_nodes,
+                          ids, CPU_SETSIZE);
+        if (n <= 0) {
+            fprintf(stderr, "could not parse argument to %s\n",
+                    settings.worker_cpus ? "worker_cpus" : "worker_nodes");
+            return -1;
+        }
+    } else {
+        n = 0;
+    }
+
+    if (n > 0) {
+        if (sched_getaffinity(0, sizeof(main_cpuset), &main_cpuset) != 0) {
+            perror("sched_getaffinity");
+            return -1;
+        }
+        worker_cpusets = calloc(nthreads, sizeof(cpu_set_t));
+        if (worker_cpusets == NULL) {
+            perror("Can't allocate worker CPU sets");
+            return -1;
+        }
+        // 线程数多于列表时循环使用
+        for (i = 0; i < nthreads; i++) {
+            if (settings.worker_nodes == NULL) {
+                CPU_SET(ids[i % n], &worker_cpusets[i]);
+                continue;
+            }
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                     ids[i % n]);
+            m = cpulist_read(path, cpus, CPU_SETSIZE);
+            if (m <= 0) {
+                fprintf(stderr, "Can't read the CPUs of NUMA node %d\n", ids[i % n]);
+                return -1;
+            }
+            for (j = 0; j < m; j++)
+                CPU_SET(cpus[j], &worker_cpusets[i]);
+        }
+    }
+
+    if (settings.bg_cpus != NULL) {
+        n = cpulist_parse(settings.bg_cpus, ids, CPU_SETSIZE);
+        if (n <= 0) {
+            fprintf(stderr, "could not parse argument to bg_cpus\n");
+            return -1;
+        }
+        CPU_ZERO(&set);
+        for (i = 0; i < n; i++)
+            CPU_SET(ids[i], &set);
+        pthread_attr_init(&bg_attr);
+        if (pthread_attr_setaffinity_np(&bg_attr, sizeof(set), &set) != 0) {
+            fprintf(stderr, "Can't set background thread CPUs\n");
+            return -1;
+        }
+        bg_pinned = true;
+    }
+    return 0;
+}
+
+/*
+ * Moves the calling main thread onto worker id's CPUs while it sets that
+ * worker up, or back onto its own with id -1.
+ */
+static void thread_affinity_bind(int id) {
+    cpu_set_t *set = id < 0 ? &main_cpuset : &worker_cpusets[id];
+
+    if (worker_cpusets == NULL)
+        return;
+    if (sched_setaffinity(0, sizeof(*set), set) != 0)
+        perror("sched_setaffinity");
+}
+
+/* Attributes for background threads; NULL leaves them unpinned. */
+pthread_attr_t *thread_bg_attr(void) {
+    return bg_pinned ? &bg_attr : NULL;
+}
+#else
+int thread_affinity_init(int nthreads) {
+    if (settings.worker_cpus != NULL || settings.worker_nodes != NULL ||
+            settings.worker_rxq != NULL || settings.bg_cpus != NULL) {
+        fprintf(stderr, "CPU pinning is not supported on this platform\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void thread_affinity_bind(int id) {
+}
+
+pthread_attr_t *thread_bg_attr(void) {
+    return NULL;
+}
+#endif
+
+/*
+ * Creates a worker thread, on its CPUs if it has any.
  */
 static void create_worker(void *(*func)(void *), void *arg) {
     pthread_attr_t  attr;
     int             ret;
 
     pthread_attr_init(&attr);
+#ifdef __linux__
+    if (worker_cpusets != NULL) {
+        cpu_set_t *set = &worker_cpusets[(LIBEVENT_THREAD *)arg - threads];
+        if ((ret = pthread_attr_setaffinity_np(&attr, sizeof(*set), set)) != 0) {
+            fprintf(stderr, "Can't set worker CPUs: %s\n", strerror(ret));
+            exit(1);
+        }
+    }
+#endif
 
     if ((ret = pthread_create(&((LIBEVENT_THREAD*)arg)->thread_id, &attr, func, arg)) != 0) {
         fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
@@ -174,6 +430,55 @@ static void create_worker(void *(*func)(void *), void *arg) {
 
 /*************************************LIBEVENT THREADS**************/
 
+/* Once a second while idle_timeout is set */
+static void thread_idle_tick(int fd, short which, void *arg) {
+    conn_idle_tick(arg);
+}
+
+/* Once a second, free zerocopy holds left behind by closed connections. */
+static void thread_zerocopy_tick(int fd, short which, void *arg) {
+    conn_zerocopy_orphans(arg);
+}
+
+/* Runs connections that used up their turn, after the worker polled. */
+static void thread_sched_process(int fd, short which, void *arg) {
+    conn_sched_run(arg);
+}
+
+/*
+ * Fires when the worker's epoll instance has edges pending, or when the last
+ * pass left connections on its ready list.
+ */
+static void thread_epoll_process(int fd, short which, void *arg) {
+    conn_epoll_poll(arg);
+}
+
+/*
+ * Worker loop for -o busy_poll: keep taking edges without sleeping until
+ * busy_poll_us have passed with nothing to do, then block in libevent as
+ * usual. Trades a spinning core per worker for wakeup latency.
+ */
+static void worker_busy_poll(LIBEVENT_THREAD *me) {
+    const int64_t limit = (int64_t)settings.busy_poll_us * 1000;
+    struct timespec idle, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &idle);
+    while (1) {
+        if (conn_epoll_poll(me) > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &idle);
+        }
+        // notify eventfd, timers and the worker's own listener
+        event_base_loop(me->base, EVLOOP_NONBLOCK);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((int64_t)(now.tv_sec - idle.tv_sec) * 1000000000 +
+                (now.tv_nsec - idle.tv_nsec) >= limit) {
+            event_base_loop(me->base, EVLOOP_ONCE);
+            clock_gettime(CLOCK_MONOTONIC, &idle);
+        }
+    }
+}
+
 /**
  * set up a thread's information
  */
@@ -195,8 +500,13 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     }
 
     // 设置监听的文件描述符以及其对应的监听事件和处理函数
+#ifdef HAVE_EVENTFD
+    event_set(&me->notify_event, me->notify_event_fd,
+                EV_READ | EV_PERSIST, thread_libevent_process, me);
+#else
     event_set(&me->notify_event, me->notify_receive_fd,
                 EV_READ | EV_PERSIST, thread_libevent_process, me);
+#endif
     event_base_set(me->base, &me->notify_event);
 
     if (event_add(&me->notify_event, 0) == -1) {
@@ -204,12 +514,64 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(1);
     }
 
+    // 连接由本线程自己的epoll实例驱动, 该实例本身挂在libevent上
+    me->epoll_fd = -1;
+#ifdef __linux__
+    if (settings.event_epoll) {
+        me->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (me->epoll_fd == -1) {
+            perror("Can't create epoll instance");
+            exit(1);
+        }
+        event_set(&me->epoll_event, me->epoll_fd, EV_READ | EV_PERSIST,
+                    thread_epoll_process, me);
+        event_base_set(me->base, &me->epoll_event);
+
+        if (event_add(&me->epoll_event, 0) == -1) {
+            fprintf(stderr, "Can't monitor epoll instance\n");
+            exit(1);
+        }
+    }
+#endif
+
+    // 每个线程用自己的时间轮处理空闲连接的超时
+    if (settings.idle_timeout) {
+        struct timeval t = {.tv_sec = 1, .tv_usec = 0};
+        me->idle_wheel_time = current_time;
+        event_set(&me->idle_event, -1, EV_PERSIST, thread_idle_tick, me);
+        event_base_set(me->base, &me->idle_event);
+
+        if (event_add(&me->idle_event, &t) == -1) {
+            fprintf(stderr, "Can't add idle timeout event\n");
+            exit(1);
+        }
+    }
+
+    // zerocopy发送的item在连接关闭后延迟释放
+    if (settings.zerocopy_min > 0) {
+        struct timeval t = {.tv_sec = 1, .tv_usec = 0};
+        event_set(&me->zc_event, -1, EV_PERSIST, thread_zerocopy_tick, me);
+        event_base_set(me->base, &me->zc_event);
+
+        if (event_add(&me->zc_event, &t) == -1) {
+            fprintf(stderr, "Can't add zerocopy sweep event\n");
+            exit(1);
+        }
+    }
+
+    // 用完本轮配额的连接在就绪队列中等待下一轮
+    event_set(&me->sched_event, -1, 0, thread_sched_process, me);
+    event_base_set(me->base, &me->sched_event);
+    me->sched_head = NULL;
+    me->sched_tail = &me->sched_head;
+
     me->new_conn_queue = malloc(sizeof(struct conn_queue));
     if (me->new_conn_queue == NULL) {
         perror("Failed to allocate memory for connection conn_queue");
         exit(EXIT_FAILURE);
     }
     cq_init(me->new_conn_queue);
+    me->migrate_to = -1;
 
     if (pthread_mutex_init(&me->stats.mutex, NULL) != 0) {
         perror("Failed to initialize mutex");
@@ -222,6 +584,30 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         fprintf(stderr, "Failed to create suffix cache\n");
         exit(EXIT_FAILURE);
     }
+
+    // 连接只在有未处理数据时才占用读缓冲, 空闲时归还给本线程
+    me->rbuf_cache = cache_create("rbuf", READ_BUFFER_SIZE, sizeof(char*), NULL, NULL);
+    if (me->rbuf_cache == NULL) {
+        fprintf(stderr, "Failed to create read buffer cache\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 响应用的iovec/msghdr也只在写响应时借用
+    me->iov_cache = cache_create("iov", sizeof(struct iovec) * RESP_IOV_POOLED,
+                                 sizeof(char*), NULL, NULL);
+    me->msg_cache = cache_create("msghdr", sizeof(struct msghdr) * RESP_MSG_POOLED,
+                                 sizeof(char*), NULL, NULL);
+    if (me->iov_cache == NULL || me->msg_cache == NULL) {
+        fprintf(stderr, "Failed to create response descriptor caches\n");
+        exit(EXIT_FAILURE);
+    }
+
+    me->bin_batch_cache = cache_create("binbatch", BIN_BATCH_HDR_SIZE,
+                                       sizeof(char*), NULL, NULL);
+    if (me->bin_batch_cache == NULL) {
+        fprintf(stderr, "Failed to create binary batch header cache\n");
+        exit(EXIT_FAILURE);
+    }
 #ifdef EXTSTORE
     me->io_cache = cache_create("io", sizeof(io_wrap), sizeof(char*), NULL, NULL);
     if (me->io_cache == NULL) {
@@ -243,6 +629,7 @@ static void *worker_libevent(void *arg) {
     // 本次不介绍,故隐去
     //me->l = logger_create();
     me->lru_bump_buf = item_lru_bump_buf_create();
+    slabs_thread_init();
     if (me->l == NULL || me->lru_bump_buf == NULL) {
         abort();
     }
@@ -254,37 +641,54 @@ static void *worker_libevent(void *arg) {
 
     register_thread_initialized();
 
-    event_base_loop(me->base, 0);
+    if (me->epoll_fd != -1 && settings.busy_poll_us > 0) {
+        worker_busy_poll(me);
+    } else {
+        event_base_loop(me->base, 0);
+    }
 
     event_base_free(me->base);
     return NULL;
 }
 
 /*
- * Processes on incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Processes incoming "handle a new connection" items. This is called when
+ * input arrives on the libevent wakeup eventfd (or pipe), and works through
+ * everything queued since the last wakeup.
  */
 static void thread_libevent_process(int fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
     CQ_ITEM *item;
-    char buf[1];
+    CQ_ITEM *next;
+    CQ_ITEM *last = NULL;
+    CQ_ITEM *first;
     conn *c;
-    unsigned int timeout_fd;
 
-    if (read(fd, buf, 1) != 1) {
+    /* Clear the wakeup before taking the queue, so a push landing after we
+     * emptied it always wakes us again.
+     */
+#ifdef HAVE_EVENTFD
+    uint64_t u;
+    if (read(fd, &u, sizeof(u)) != sizeof(u) && errno != EAGAIN) {
         if (settings.verbose > 0)
-            fpritnf(stderr, "Can't read from libevent pipe\n");
+            fprintf(stderr, "Can't read from libevent eventfd\n");
         return;
     }
+#else
+    char buf[64];
+    if (read(fd, buf, sizeof(buf)) <= 0) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Can't read from libevent pipe\n");
+        return;
+    }
+#endif
 
-    // 处理发送过来的信息,发送的信息中第一个字符代表需要什么样的处理
-    switch (buf[0]) {
-    case 'c':
-        item = cq_pop(me->new_conn_queue);
+    first = item = cq_pop_all(me->new_conn_queue);
+    for (; item != NULL; item = next) {
+        next = item->next;
+        last = item;
 
-        if (NULL == item) {
-            break;
-        }
+        // 根据CQ_ITEM的mode来判断需要什么样的处理
         switch (item->mode) {
             case queue_new_conn:
                 c = conn_new(item->sfd, item->init_state, item->event_flags,
@@ -294,38 +698,44 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                     if (IS_UDP(item->transport)) {
                         fprintf(stderr, "Can't listen for events on UDP socket\n");
                         exit(1);
+                    } else if (item->init_state == conn_listening) {
+                        fprintf(stderr, "Can't listen for events on TCP socket\n");
+                        exit(1);
                     } else {
                         if (settings.verbose > 0) {
                             fprintf(stderr, "Can't listen for events on fd %d\n",
                                     item->sfd);
                         }
                         close(item->sfd);
+                        __atomic_fetch_sub(&me->conns, 1, __ATOMIC_RELAXED);
                     }
                 } else {
                     c->thread = me;
+                    if (item->init_state == conn_new_cmd) {
+                        if (settings.event_epoll)
+                            conn_epoll_attach(c);
+                        conn_idle_arm(c);
+                    }
                 }
                 break;
 
             case queue_redispatch:
                 conn_worker_readd(item->c);
                 break;
+
+            // we were told to pause and report in
+            case queue_pause:
+                register_thread_initialized();
+                break;
+
+            case queue_quiesce:
+                epoch_quiescent(me);
+                break;
         }
-        cqi_free(item);
-        break;
-    // we were told to pause and report in
-    case 'p':
-        register_thread_initialized();
-        break;
-    // a client socket timed out
-    case 't':
-        if (read(fd, &timeout_fd, sizeof(timeout_fd)) != sizeof(timeout_fd)) {
-            if (settings.verbose > 0) {
-                fprintf(stderr, "Can't read timeout fd from libevent pipe\n");
-            }
-            return;
-        }
-        conn_close_idle(conns[timeout_fd]);
-        break;
+    }
+
+    if (first != NULL) {
+        cqi_free_list(first, last);
     }
 }
 
@@ -335,15 +745,54 @@ static void thread_libevent_process(int fd, short which, void *arg) {
 static int last_thread = -1;
 
 /*
- * Dispatches a new connection to another thread. This is only ever called
- * from the main thread, either during initialization (for UDP) or because
- * of an incoming connection.
+ * True if worker a carries clearly less load than worker b. Busy time over
+ * the last sample decides when the gap is wide enough to be more than
+ * noise; otherwise fewer connections, then less traffic, wins.
  */
-// 用于分配新accept的connection
-void dispatch_conn_new(int sfd, enum conn_stats init_state, int event_flags,
+#define DISPATCH_BUSY_SLACK 100 // permille
+static bool thread_lighter(LIBEVENT_THREAD *a, LIBEVENT_THREAD *b) {
+    int conns_a = __atomic_load_n(&a->conns, __ATOMIC_RELAXED);
+    int conns_b = __atomic_load_n(&b->conns, __ATOMIC_RELAXED);
+
+    if (a->load_busy + DISPATCH_BUSY_SLACK < b->load_busy)
+        return true;
+    if (b->load_busy + DISPATCH_BUSY_SLACK < a->load_busy)
+        return false;
+    if (conns_a != conns_b)
+        return conns_a < conns_b;
+    return a->load_bytes < b->load_bytes;
+}
+
+/*
+ * Picks a worker for a new connection: the lighter of the round robin
+ * choice and one other at random. Load is only sampled once a second, so
+ * always sending to the single lightest worker would herd a reconnect storm
+ * onto it; two choices spread that out while still steering around hot
+ * workers. Main thread only.
+ */
+static LIBEVENT_THREAD *dispatch_pick_thread(LIBEVENT_THREAD *rr) {
+    static uint32_t seed = 2463534242;
+    LIBEVENT_THREAD *other;
+
+    if (settings.num_threads < 2)
+        return rr;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    other = threads + seed % settings.num_threads;
+
+    return thread_lighter(other, rr) ? other : rr;
+}
+
+/*
+ * Queues a socket for a worker and wakes it up. The worker creates the
+ * connection on its own event base.
+ */
+static void dispatch_conn_thread(LIBEVENT_THREAD *thread, int sfd,
+                        enum conn_states init_state, int event_flags,
                         int read_buffer_size, enum network_transport transport) {
     CQ_ITEM *item = cqi_new();
-    char buf[1];
     if (item == NULL) {
         close(sfd);
         // given that malloc failed this may also fail, but let's try
@@ -351,14 +800,6 @@ void dispatch_conn_new(int sfd, enum conn_stats init_state, int event_flags,
         return ;
     }
 
-    // 计算要将connection分配给哪个通信thread
-    int tid = (last_thread + 1) % settings.num_threads;
-    
-    // 查找对应thread的LIBEVENT_THREAD结构体
-    LIBEVENT_THREAD *thread = threads + tid;
-
-    last_thread = tid;
-
     // 初始化CQ_ITEM结构
     item->sfd = sfd;
     item->init_state = init_state;
@@ -366,16 +807,48 @@ void dispatch_conn_new(int sfd, enum conn_stats init_state, int event_flags,
     item->read_buffer_size = read_buffer_size;
     item->transport = transport;
     item->mode = queue_new_conn;
-    
-    // 将CQ_ITEM加入到thread对应的链表中
-    cq_push(thread->new_conn_queue, item);
 
+    if (!IS_UDP(transport) && init_state != conn_listening) {
+        __atomic_fetch_add(&thread->conns, 1, __ATOMIC_RELAXED);
+    }
+    
     MEMCACHED_CONN_DISPATCH(sfd, thread->thread_id);
-    // 向thread监听的文件描述符传递新connection的消息
-    buf[0] = 'c';
-    if (write(thread->notify_send_fd, buf, 1) != 1) {
-        perror("Writing to thread notify pipe");
+    // 将CQ_ITEM加入到thread对应的链表中,必要时唤醒thread
+    cq_notify(thread, item);
+}
+
+/*
+ * Dispatches a new connection to another thread. This is only ever called
+ * from the main thread, either during initialization (for UDP) or because
+ * of an incoming connection.
+ */
+// 用于分配新accept的connection
+void dispatch_conn_new(int sfd, enum conn_stats init_state, int event_flags,
+                        int read_buffer_size, enum network_transport transport) {
+    // 计算要将connection分配给哪个通信thread
+    int tid = (last_thread + 1) % settings.num_threads;
+    
+    // 查找对应thread的LIBEVENT_THREAD结构体
+    LIBEVENT_THREAD *thread = threads + tid;
+
+    last_thread = tid;
+
+    /* UDP sockets rely on plain round robin to land one per worker */
+    if (settings.conn_dispatch_load && !IS_UDP(transport)) {
+        thread = dispatch_pick_thread(thread);
     }
+
+    dispatch_conn_thread(thread, sfd, init_state, event_flags,
+                         read_buffer_size, transport);
+}
+
+/*
+ * Hands a SO_REUSEPORT listening socket to worker tid, which accepts on it
+ * from then on. Only called from the main thread while binding ports.
+ */
+void dispatch_listen_conn(int sfd, int tid, enum network_transport transport) {
+    dispatch_conn_thread(threads + tid, sfd, conn_listening,
+                         EV_READ | EV_PERSIST, 1, transport);
 }
 
 /*
@@ -385,7 +858,6 @@ void dispatch_conn_new(int sfd, enum conn_stats init_state, int event_flags,
 // 将connection重新分配到thread上
 void redispath_conn(conn *c) {
     CQ_ITEM *item = cqi_new();
-    char buf[1];
     if (item == NULL) {
         // Can't cleanly redispatch connection. close it forcefully
         c->state = conn_closed;
@@ -398,11 +870,219 @@ void redispath_conn(conn *c) {
     item->c = c;
     item->mode = queue_redispatch;
 
-    cq_push(thread->new_conn_queue, item);
+    cq_notify(thread, item);
+}
 
-    buf[0] = 'c';
-    if (write(thread->notify_send_fd, buf, 1) != 1) {
-        perror("Writing to thread notify pipe");
+/*
+ * Accounts for an event a worker just handled: charges the time to its busy
+ * counter, and if the main thread asked this worker to shed a connection,
+ * tries to migrate c.
+ */
+void thread_event_done(LIBEVENT_THREAD *me, conn *c, const struct timespec *start) {
+    struct timespec now;
+    int64_t ns;
+    int to;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (int64_t)(now.tv_sec - start->tv_sec) * 1000000000 +
+        (now.tv_nsec - start->tv_nsec);
+    // only this thread writes it
+    __atomic_store_n(&me->busy_ns, me->busy_ns + ns, __ATOMIC_RELAXED);
+
+    to = __atomic_load_n(&me->migrate_to, __ATOMIC_RELAXED);
+    if (to < 0 || !settings.conn_migrate)
+        return;
+    if (conn_migrate(c, threads + to)) {
+        // one connection per request; leave it if the target changed
+        __atomic_compare_exchange_n(&me->migrate_to, &to, -1, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+/* Only ask for a migration when the busiest worker is at least this busy,
+ * and this much busier than the idlest (permille).
+ */
+#define MIGRATE_BUSY_MIN 700
+#define MIGRATE_BUSY_GAP 300
+
+/*
+ * Refreshes each worker's load from the counters it publishes. Called by
+ * the main thread on every clock tick. With conn_migrate, also asks the
+ * busiest worker to hand one connection to the idlest; repeated each tick
+ * until the gap closes.
+ */
+void threads_load_sample(void) {
+    static struct timespec last;
+    struct timespec now;
+    uint64_t elapsed;
+    int i;
+    int hot = 0;
+    int cold = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (uint64_t)(now.tv_sec - last.tv_sec) * 1000000000 +
+        (now.tv_nsec - last.tv_nsec);
+    if (elapsed == 0)
+        return;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        LIBEVENT_THREAD *t = threads + i;
+        uint64_t busy = __atomic_load_n(&t->busy_ns, __ATOMIC_RELAXED);
+        uint64_t bytes = __atomic_load_n(&t->stats.bytes_read, __ATOMIC_RELAXED) +
+            __atomic_load_n(&t->stats.bytes_written, __ATOMIC_RELAXED);
+
+        if (last.tv_sec != 0) {
+            uint64_t permille = (busy - t->load_busy_ns) * 1000 / elapsed;
+            t->load_busy = permille > 1000 ? 1000 : permille;
+            t->load_bytes = bytes - t->load_bytes_total;
+        }
+        t->load_busy_ns = busy;
+        t->load_bytes_total = bytes;
+
+        if (t->load_busy > threads[hot].load_busy)
+            hot = i;
+        if (t->load_busy < threads[cold].load_busy)
+            cold = i;
+    }
+    last = now;
+
+    if (settings.conn_migrate &&
+            threads[hot].load_busy >= MIGRATE_BUSY_MIN &&
+            threads[hot].load_busy - threads[cold].load_busy >= MIGRATE_BUSY_GAP) {
+        __atomic_store_n(&threads[hot].migrate_to, cold, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Asks a worker to stop and report in through register_thread_initialized(),
+ * where it blocks for as long as worker_hang_lock is held.
+ */
+static void dispatch_worker_pause(int tid) {
+    CQ_ITEM *item = cqi_new();
+    if (item == NULL) {
+        fprintf(stderr, "Failed to allocate memory to pause worker\n");
+        exit(1);
+    }
+    item->mode = queue_pause;
+
+    cq_notify(threads + tid, item);
+}
+
+/*
+ * Stops every worker until the matching resume; returns once all of them
+ * have reported in. Must not be called with any deeper locks held.
+ */
+void pause_threads(enum pause_thread_types type) {
+    int i;
+
+    switch (type) {
+        case PAUSE_ALL_THREADS:
+            lru_maintainer_pause();
+            slabs_rebalancer_pause();
+            lru_crawler_pause();
+#ifdef EXTSTORE
+            storage_compact_pause();
+            storage_write_pause();
+#endif
+        case PAUSE_WORKER_THREADS:
+            pthread_mutex_lock(&worker_hang_lock);
+            break;
+        case RESUME_ALL_THREADS:
+            lru_maintainer_resume();
+            slabs_rebalancer_resume();
+            lru_crawler_resume();
+#ifdef EXTSTORE
+            storage_compact_resume();
+            storage_write_resume();
+#endif
+        case RESUME_WORKER_THREADS:
+            pthread_mutex_unlock(&worker_hang_lock);
+            return;
+        default:
+            fprintf(stderr, "Unknown lock type: %d\n", type);
+            assert(1 == 0);
+            return;
+    }
+
+    // 每个线程都停在register_thread_initialized()里
+    pthread_mutex_lock(&init_lock);
+    init_count = 0;
+    for (i = 0; i < settings.num_threads; i++) {
+        dispatch_worker_pause(i);
+    }
+    wait_for_thread_registration(settings.num_threads);
+    pthread_mutex_unlock(&init_lock);
+}
+
+/*
+ * Epochs, for retiring shared data without stopping the workers. A worker
+ * keeps nothing it read from shared structures across drive_machine()
+ * passes, so the end of each pass is a quiescent state, where it records
+ * the global epoch it has seen. A writer that has unpublished something
+ * advances the epoch; once every worker has seen the new value nobody can
+ * still be using the old data and it can be freed.
+ *
+ * Only workers take part. Background threads reading shared data still
+ * need the item locks.
+ */
+static uint64_t epoch_global = 1;
+
+/* Called by a worker between passes. */
+void epoch_quiescent(LIBEVENT_THREAD *me) {
+    uint64_t e = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+
+    // 没有变化时不写, 免得每次都弄脏这条cache line
+    if (me->epoch_seen != e)
+        __atomic_store_n(&me->epoch_seen, e, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts a grace period covering everything unpublished before the call.
+ * Returns the epoch to hand to epoch_passed().
+ */
+uint64_t epoch_advance(void) {
+    return __atomic_add_fetch(&epoch_global, 1, __ATOMIC_SEQ_CST);
+}
+
+/* True once every worker has been quiescent since epoch e began. */
+bool epoch_passed(uint64_t e) {
+    int i;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        if (__atomic_load_n(&threads[i].epoch_seen, __ATOMIC_ACQUIRE) < e)
+            return false;
+    }
+    return true;
+}
+
+/* Asks a worker to report a quiescent state even if it has nothing to do. */
+static void dispatch_worker_quiesce(int tid) {
+    CQ_ITEM *item = cqi_new();
+    if (item == NULL) {
+        fprintf(stderr, "Failed to allocate memory to wake worker\n");
+        exit(1);
+    }
+    item->mode = queue_quiesce;
+
+    cq_notify(threads + tid, item);
+}
+
+/*
+ * Waits out a full grace period. Busy workers get there on their own at
+ * the end of their current pass; idle ones are woken through their
+ * connection queue. Nobody is stopped. For background threads only: a
+ * worker would be waiting on itself.
+ */
+void epoch_synchronize(void) {
+    const uint64_t e = epoch_advance();
+    int i;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        if (__atomic_load_n(&threads[i].epoch_seen, __ATOMIC_ACQUIRE) < e)
+            dispatch_worker_quiesce(i);
+    }
+    while (!epoch_passed(e)) {
+        usleep(100);
     }
 }
 
@@ -431,7 +1111,14 @@ void memcached_thread_init(int nthreads, void *arg) {
     }
     // 初始化线程配置
     for (i = 0; i < nthreads; i++) {
-        // 创建线程之间的通信管道
+        // 创建线程之间的通信eventfd(或管道)
+#ifdef HAVE_EVENTFD
+        threads[i].notify_event_fd = eventfd(0, EFD_NONBLOCK);
+        if (threads[i].notify_event_fd == -1) {
+            perror("Can't create notify eventfd");
+            exit(1);
+        }
+#else
         int fds[2];
         if (pipe(fds)) {
             perror("Can't create notify pipe");
@@ -440,13 +1127,24 @@ void memcached_thread_init(int nthreads, void *arg) {
 
         threads[i].notify_receive_fd = fds[0];  // 读文件描述符
         threads[i].notify_send_fd = fds[1];     // 写文件描述符
+#endif
 #ifdef EXTSTORE
         threads[i].storage = arg;
 #endif
+        thread_affinity_bind(i);        // 在该线程的CPU上分配它的内存
         setup_thread(&threads[i]);      // 初始化线程的LIBEVENT_THREAD结构体
+#ifdef HAVE_EVENTFD
+        // Reserve three fds for the libevent base, and one for the eventfd
+        stats_state.reserved_fds += 4;
+#else
         // Reserve three fds for the libevent base, and two for the pipe
         stats_state.reserved_fds += 5;
+#endif
+        if (threads[i].epoll_fd != -1) {
+            stats_state.reserved_fds++;
+        }
     }
+    thread_affinity_bind(-1);
 
     // Create threads after we've done all the libevent setup.
     // 创建线程
@@ -1,4 +1,10 @@
 #include "memcached.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
 
 enum try_read_result {
     READ_DATA_RECEIVED,
@@ -51,12 +57,13 @@ static int add_msghdr(conn *c)
 
     assert(c != NULL);
 
+    if (c->msglist == NULL && !resp_alloc(c))
+        return -1;
+
     if (c->msgsize == c->msgused) {
-        msg = realloc(c->msglist, c->msgsize * 2 * sizeof(struct msghdr));
+        msg = resp_grow(c, c->msglist, c->msgsize * sizeof(struct msghdr),
+                        &c->msg_malloced, c->thread->msg_cache);
         if (! msg) {
-            STATS_LOCK();
-            stats.malloc_fails++;
-            STATS_UNLOCK();
             return -1;
         }
         c->msglist = msg;
@@ -176,11 +183,23 @@ static void out_string(conn *c, const char *str) {
     if (settings.verbose > 1)
         fprintf(stderr, ">%d %s\n", c->sfd, str);
 
-    /* Nuke a partial output... */
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    add_msghdr(c);
+    if (c->resp_batched) {
+        /* Only nuke this command's partial output; the responses held back
+         * for the gets before it go out first, with this line last. */
+        c->msgused = c->resp_msgmark;
+        c->iovused = c->resp_iovmark;
+        c->msglist[c->msgused - 1].msg_iovlen = c->resp_iovlenmark;
+    } else {
+        /* Nuke a partial output... */
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            /* not even the descriptors to answer with */
+            conn_set_state(c, conn_closing);
+            return;
+        }
+    }
 
     len = strlen(str);
     if ((len + 2) > c->wsize) {
@@ -194,6 +213,18 @@ static void out_string(conn *c, const char *str) {
     c->wbytes = len + 2;
     c->wcurr = c->wbuf;
 
+    if (c->resp_batched) {
+        /* the batch ends here, wbuf can't be shared with another line */
+        c->resp_batched = false;
+        if (add_iov(c, c->wcurr, c->wbytes) != 0) {
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        conn_set_state(c, conn_mwrite);
+        c->msgcurr = 0;
+        return;
+    }
+
     conn_set_state(c, conn_write);
     c->write_and_go = conn_new_cmd;
     return;
@@ -230,9 +261,7 @@ static void complete_nread_ascii(conn *c) {
     enum store_item_type ret;
     bool is_valid = false;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[ITEM_clsid(it)].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].set_cmds);
 
     if ((it->it_flags & ITEM_CHUNKED) == 0) {
         if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) == 0) {
@@ -537,13 +566,11 @@ static void complete_incr_bin(conn *c) {
                 out_of_memory(c, "SERVER_ERROR Out of memory allocating new item");
             }
         } else {
-            pthread_mutex_lock(&c->thread->stats.mutex);
             if (c->cmd == PROTOCOL_BINARY_CMD_INCREMENT) {
-                c->thread->stats.incr_misses++;
+                THR_STATS_INCR(c->thread, incr_misses);
             } else {
-                c->thread->stats.decr_misses++;
+                THR_STATS_INCR(c->thread, decr_misses);
             }
-            pthread_mutex_unlock(&c->thread->stats.mutex);
 
             write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
         }
@@ -561,9 +588,7 @@ static void complete_update_bin(conn *c) {
 
     item *it = c->item;
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.slab_stats[ITEM_clsid(it)].set_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].set_cmds);
 
     /* We don't actually receive the trailing two characters in the bin
      * protocol, so we're going to just set them here */
@@ -650,6 +675,23 @@ static void write_bin_miss_response(conn *c, char *key, size_t nkey) {
     }
 }
 
+/*
+ * Resolves a batch of keys for a multiget, dropping items whose refcount is
+ * already too high as limited_get() does.
+ */
+static inline void limited_get_batch(char **keys, size_t *nkeys, int count, conn *c,
+                                     uint32_t exptime, bool should_touch, item **items) {
+    int b;
+
+    item_get_batch(keys, nkeys, count, c, exptime, should_touch, items);
+    for (b = 0; b < count; b++) {
+        if (items[b] && items[b]->refcount > IT_REFCOUNT_LIMIT) {
+            item_remove(items[b]);
+            items[b] = NULL;
+        }
+    }
+}
+
 static void process_bin_get_or_touch(conn *c) {
     item *it;
 
@@ -684,15 +726,13 @@ static void process_bin_get_or_touch(conn *c) {
         uint16_t keylen = 0;
         uint32_t bodylen = sizeof(rsp->message.body) + (it->nbytes - 2);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (should_touch) {
-            c->thread->stats.touch_cmds++;
-            c->thread->stats.slab_stats[ITEM_clsid(it)].touch_hits++;
+            THR_STATS_INCR(c->thread, touch_cmds);
+            THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].touch_hits);
         } else {
-            c->thread->stats.get_cmds++;
-            c->thread->stats.lru_hits[it->slabs_clsid]++;
+            THR_STATS_INCR(c->thread, get_cmds);
+            THR_STATS_INCR(c->thread, lru_hits[it->slabs_clsid]);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         if (should_touch) {
             MEMCACHED_COMMAND_TOUCH(c->sfd, ITEM_key(it), it->nkey,
@@ -776,15 +816,13 @@ static void process_bin_get_or_touch(conn *c) {
     }
 
     if (failed) {
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (should_touch) {
-            c->thread->stats.touch_cmds++;
-            c->thread->stats.touch_misses++;
+            THR_STATS_INCR(c->thread, touch_cmds);
+            THR_STATS_INCR(c->thread, touch_misses);
         } else {
-            c->thread->stats.get_cmds++;
-            c->thread->stats.get_misses++;
+            THR_STATS_INCR(c->thread, get_cmds);
+            THR_STATS_INCR(c->thread, get_misses);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         if (should_touch) {
             MEMCACHED_COMMAND_TOUCH(c->sfd, key, nkey, -1, 0);
@@ -808,6 +846,172 @@ static void process_bin_get_or_touch(conn *c) {
     }
 }
 
+/*
+ * Quiet binary gets (GETQ/GETKQ) come from multiget clients as runs of
+ * packets, each answered only on a hit. When a run is already in rbuf its
+ * keys are looked up together like an ASCII multiget, and the header, flags
+ * and key of every hit go into one buffer lent by the worker, so a hit
+ * costs two iovecs: its header and its value.
+ *
+ * Called by dispatch_bin_command() on the first packet of a run. Returns
+ * false with nothing consumed unless at least two complete quiet gets are
+ * buffered; the packet then takes the usual path. Otherwise the whole run
+ * is consumed, less the first packet's header which try_read_command()
+ * steps over.
+ */
+static bool process_bin_getq_batch(conn *c) {
+    protocol_binary_request_header req;
+    protocol_binary_response_get rsp;
+    const size_t rsplen = sizeof(rsp.bytes);
+    char *keys[ITEM_GET_BATCH_MAX];
+    size_t nkeys[ITEM_GET_BATCH_MAX];
+    uint32_t opaques[ITEM_GET_BATCH_MAX];
+    uint8_t opcodes[ITEM_GET_BATCH_MAX];
+    item *items[ITEM_GET_BATCH_MAX];
+    char *p = c->rcurr;
+    char *end = c->rcurr + c->rbytes;
+    size_t need = 0;
+    size_t off = 0;
+    size_t keylen;
+    item *it;
+    int n = 0;
+    int i = 0;
+    int b;
+    bool failed = false;
+
+    if (IS_UDP(c->transport))
+        return false;
+
+    while (n < ITEM_GET_BATCH_MAX && end - p >= (ptrdiff_t)sizeof(req)) {
+        memcpy(&req, p, sizeof(req));
+        keylen = ntohs(req.request.keylen);
+        if (req.request.magic != PROTOCOL_BINARY_REQ ||
+                (req.request.opcode != PROTOCOL_BINARY_CMD_GETQ &&
+                 req.request.opcode != PROTOCOL_BINARY_CMD_GETKQ) ||
+                req.request.extlen != 0 || keylen == 0 ||
+                keylen > KEY_MAX_LENGTH || ntohl(req.request.bodylen) != keylen ||
+                end - p < (ptrdiff_t)(sizeof(req) + keylen)) {
+            break;
+        }
+        keys[n] = p + sizeof(req);
+        nkeys[n] = keylen;
+
+        /* room for the headers should every key hit */
+        if (req.request.opcode == PROTOCOL_BINARY_CMD_GETQ)
+            keylen = 0;
+        if (need + rsplen + keylen > BIN_BATCH_HDR_SIZE)
+            break;
+        need += rsplen + keylen;
+
+        opaques[n] = req.request.opaque;
+        opcodes[n] = req.request.opcode;
+        p += sizeof(req) + nkeys[n];
+        n++;
+    }
+    if (n < 2)
+        return false;
+
+    c->bin_batch_buf = do_cache_alloc(c->thread->bin_batch_cache);
+    if (c->bin_batch_buf == NULL)
+        return false;
+
+    limited_get_batch(keys, nkeys, n, c, 0, false, items);
+
+    for (b = 0; b < n; b++) {
+        it = items[b];
+
+        if (settings.verbose > 1) {
+            fprintf(stderr, "<%d GET ", c->sfd);
+            if (fwrite(keys[b], 1, nkeys[b], stderr)) {}
+            fputc('\n', stderr);
+        }
+        if (settings.detail_enabled) {
+            stats_prefix_record_get(keys[b], nkeys[b], NULL != it);
+        }
+
+        THR_STATS_INCR(c->thread, get_cmds);
+        if (it == NULL) {
+            THR_STATS_INCR(c->thread, get_misses);
+            MEMCACHED_COMMAND_GET(c->sfd, keys[b], nkeys[b], -1, 0);
+            continue;
+        }
+        THR_STATS_INCR(c->thread, lru_hits[it->slabs_clsid]);
+        MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                                it->nbytes, ITEM_get_cas(it));
+        if (failed) {
+            item_remove(it);
+            continue;
+        }
+
+        /* the length has two unnecessary bytes ("\r\n") */
+        keylen = opcodes[b] == PROTOCOL_BINARY_CMD_GETKQ ? nkeys[b] : 0;
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.message.header.response.magic = (uint8_t)PROTOCOL_BINARY_RES;
+        rsp.message.header.response.opcode = opcodes[b];
+        rsp.message.header.response.keylen = (uint16_t)htons(keylen);
+        rsp.message.header.response.extlen = (uint8_t)sizeof(rsp.message.body);
+        rsp.message.header.response.datatype = (uint8_t)PROTOCOL_BINARY_RAW_BYTES;
+        rsp.message.header.response.bodylen =
+            htonl(sizeof(rsp.message.body) + keylen + (it->nbytes - 2));
+        rsp.message.header.response.opaque = opaques[b];
+        rsp.message.header.response.cas = htonll(ITEM_get_cas(it));
+        if (settings.inline_ascii_response) {
+            rsp.message.body.flags = htonl(strtoul(ITEM_suffix(it), NULL, 10));
+        } else if (it->nsuffix > 0) {
+            rsp.message.body.flags = htonl(*((uint32_t *)ITEM_suffix(it)));
+        }
+        memcpy(c->bin_batch_buf + off, rsp.bytes, rsplen);
+        memcpy(c->bin_batch_buf + off + rsplen, ITEM_key(it), keylen);
+
+        if (_ascii_get_expand_ilist(c, i) != 0 ||
+                add_iov(c, c->bin_batch_buf + off, rsplen + keylen) != 0) {
+            item_remove(it);
+            failed = true;
+            continue;
+        }
+        off += rsplen + keylen;
+
+        /* Add the data minus the CRLF */
+#ifdef EXTSTORE
+        if (it->it_flags & ITEM_HDR) {
+            /* an io_wrap owns the reference from here */
+            if (_get_extstore(c, it, c->iovused - 1, 2) != 0) {
+                item_remove(it);
+                failed = true;
+            }
+            continue;
+        } else if ((it->it_flags & ITEM_CHUNKED) == 0) {
+#else
+        if ((it->it_flags & ITEM_CHUNKED) == 0) {
+#endif
+            failed = add_iov(c, ITEM_data(it), it->nbytes - 2) != 0;
+        } else {
+            failed = add_chunked_item_iovs(c, it, it->nbytes - 2) != 0;
+        }
+        *(c->ilist + i) = it;
+        i++;
+    }
+
+    /* try_read_command() steps over the first packet's header */
+    c->rbytes -= (p - c->rcurr) - sizeof(req);
+    c->rcurr = p - sizeof(req);
+
+    c->icurr = c->ilist;
+    c->ileft = i;
+    if (failed) {
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, NULL, 0);
+    } else if (c->iovused == 0) {
+        /* all misses, nothing to answer */
+        do_cache_free(c->thread->bin_batch_cache, c->bin_batch_buf);
+        c->bin_batch_buf = NULL;
+        conn_set_state(c, conn_new_cmd);
+    } else {
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+    }
+    return true;
+}
+
 static void append_bin_stats(const char *key, const uint16_t keln,
                                 const char *val, const uint32_t vlen,
                                 conn *c) {
@@ -1004,11 +1208,8 @@ static void bin_read_key(conn *c, enum bin_substates next_substate, int extra) {
                 fprintf(stderr, "%d: Need to grow buffer from %lu to %lu\n",
                     c->sfd, (unsigned long)c->rsize, (unsigned long)nsize);
             }
-            char *newm = realloc(c->rbuf, nsize);
-            if (newm == NULL) {
-                STATS_LOCK();
-                stats.malloc_fails++;
-                STATS_UNLOCK();
+            /* rcurr keeps pointing to the same offset in the packet */
+            if (!rbuf_resize(c, nsize)) {
                 if (settings.verbose) {
                     fprintf(stderr, "%d: Failed to grow buffer.. closing connection\n",
                                 c->sfd);
@@ -1016,11 +1217,6 @@ static void bin_read_key(conn *c, enum bin_substates next_substate, int extra) {
                 conn_set_state(c, conn_closing);
                 return;
             }
-
-            c->rbuf = newm;
-            /* rcurr should point to the same offset in the packet */
-            c->rcurr = c->rbuf + offset - sizeof(protocol_binary_request_header);
-            c->rsize = nsize;
         }
         if (c->rbuf != c->rcurr) {
             memmove(c->rbuf, c->rcurr, c->rbytes);
@@ -1205,9 +1401,7 @@ static void process_bin_complete_sasl_auth(conn *c) {
      case SASL_OK:
         c->authenticated = true;
         write_bin_response(c, "Authenticated", 0, 0, strlen("Authenticated"));
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.auth_cmds++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, auth_cmds);
         break;
      case SASL_CONTINUE:
         add_bin_header(c, PROTOCOL_BINARY_RESPONSE_AUTH_CONTINUE, 0, 0, outlen);
@@ -1221,10 +1415,8 @@ static void process_bin_complete_sasl_auth(conn *c) {
         if (settings.verbose)
             fprintf(stderr, "Unknown sasl response: %d\n", result);
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_AUTH_ERROR, NULL, 0);
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.auth_cmds++;
-        c->thread->stats.auth_errors++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, auth_cmds);
+        THR_STATS_INCR(c->thread, auth_errors);
      }
 }
 
@@ -1279,6 +1471,12 @@ static void dispatch_bin_command(conn *c) {
         return;
     }
 
+    /* a run of quiet gets already buffered is looked up in one go */
+    if ((c->cmd == PROTOCOL_BINARY_CMD_GETQ ||
+            c->cmd == PROTOCOL_BINARY_CMD_GETKQ) && process_bin_getq_batch(c)) {
+        return;
+    }
+
     switch (c->cmd) {
     case PROTOCOL_BINARY_CMD_SETQ:
         c->cmd = PROTOCOL_BINARY_CMD_SET;
@@ -1443,6 +1641,244 @@ static void dispatch_bin_command(conn *c) {
         handle_binary_protocol_error(c);
 }
 
+typedef struct token_s {
+    char *value;
+    size_t length;
+} token_t;
+
+#define COMMAND_TOKEN 0
+#define SUBCOMMAND_TOKEN 1
+#define KEY_TOKEN 1
+
+#define MAX_TOKENS 8
+
+/* First size of a worker's token array; get lines grow it as needed */
+#define TOKENS_INITIAL 64
+/* Past this the array goes back to TOKENS_INITIAL once the line is done */
+#define TOKENS_HIGHWAT 1024
+
+/*
+ * Byte classes for the ASCII tokenizer: for the 32 bytes at p, a mask of the
+ * spaces in the low word and a mask of the newlines in the high word.
+ */
+static uint64_t ascii_scan_sw(const char *p, const size_t n) {
+    uint32_t sp = 0, nl = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        sp |= (uint32_t)(p[i] == ' ') << i;
+        nl |= (uint32_t)(p[i] == '\n') << i;
+    }
+    return (uint64_t)nl << 32 | sp;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+static uint64_t ascii_scan32_sse2(const char *p) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    __m128i lo = _mm_loadu_si128((const __m128i *)p);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+    uint32_t sp = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, space)) |
+        (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, space)) << 16;
+    uint32_t nl = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, newline)) |
+        (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, newline)) << 16;
+    return (uint64_t)nl << 32 | sp;
+}
+
+__attribute__((target("avx2")))
+static uint64_t ascii_scan32_avx2(const char *p) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t sp = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+    uint32_t nl = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return (uint64_t)nl << 32 | sp;
+}
+#else
+static uint64_t ascii_scan32_generic(const char *p) {
+    return ascii_scan_sw(p, 32);
+}
+#endif
+
+/* Picks the widest scan the CPU has on first use. */
+static uint64_t ascii_scan32_pick(const char *p);
+static uint64_t (*ascii_scan32)(const char *p) = ascii_scan32_pick;
+
+static uint64_t ascii_scan32_pick(const char *p) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+    ascii_scan32 = __builtin_cpu_supports("avx2") ? ascii_scan32_avx2
+                                                  : ascii_scan32_sse2;
+#else
+    ascii_scan32 = ascii_scan32_generic;
+#endif
+    return ascii_scan32(p);
+}
+
+static inline bool is_get_command(const char *cmd, const size_t len) {
+    return (len == 3 && memcmp(cmd, "get", 3) == 0) ||
+           (len == 4 && (memcmp(cmd, "gets", 4) == 0 ||
+                         memcmp(cmd, "bget", 4) == 0)) ||
+           (len == 3 && memcmp(cmd, "gat", 3) == 0) ||
+           (len == 4 && memcmp(cmd, "gats", 4) == 0);
+}
+
+/*
+ * Finds the end of the command line at the start of line and splits it at
+ * spaces, in one pass over the bytes. len is how much of the buffer holds
+ * data; avail is how much may be read, so whole 32 byte blocks can be
+ * loaded past the data.
+ *
+ * Returns the '\n' ending the line, or NULL if there isn't one yet, in which
+ * case nothing was written. Otherwise the line is NUL terminated in place
+ * of its "\r\n" or "\n", and *ntokens tokens are in c->thread->tokens, the
+ * last of them the terminal token (length zero, value pointing at the first
+ * unprocessed character or NULL if the line was consumed). Token values
+ * aren't terminated yet; see process_command().
+ *
+ * get lines are split completely, however many keys they carry; anything
+ * else stops at MAX_TOKENS like before. *ntokens is 0 if the token array
+ * couldn't grow.
+ */
+static char *tokenize_line(conn *c, char *line, const size_t len,
+                           const size_t avail, size_t *ntokens) {
+    LIBEVENT_THREAD *t = c->thread;
+    token_t *tokens = t->tokens;
+    size_t limit = MAX_TOKENS;
+    size_t n = 0;
+    size_t start = 0;   // start of the token being scanned
+    size_t rest = 0;    // first unprocessed byte once the limit is hit
+    bool full = false;
+    size_t off, pos;
+    uint64_t m;
+    uint32_t sp, nl, bits;
+    char *e;
+
+    if (t->tokens_size < MAX_TOKENS) {
+        tokens = realloc(t->tokens, TOKENS_INITIAL * sizeof(token_t));
+        if (tokens == NULL)
+            goto oom;
+        t->tokens = tokens;
+        t->tokens_size = TOKENS_INITIAL;
+    }
+
+    for (off = 0; off < len; off += 32) {
+        if (off + 32 <= avail) {
+            m = ascii_scan32(line + off);
+        } else {
+            m = ascii_scan_sw(line + off, len - off < 32 ? len - off : 32);
+        }
+        sp = (uint32_t)m;
+        nl = (uint32_t)(m >> 32);
+        if (len - off < 32) {
+            sp &= (1U << (len - off)) - 1;
+            nl &= (1U << (len - off)) - 1;
+        }
+        bits = full ? nl : sp | nl;
+
+        while (bits) {
+            pos = off + __builtin_ctz(bits);
+            if (nl & (1U << (pos - off)))
+                goto eol;
+            bits &= bits - 1;
+
+            if (pos > start) {
+                if (n == 0 && is_get_command(line + start, pos - start))
+                    limit = SIZE_MAX;
+                if (n + 2 > t->tokens_size) {
+                    tokens = realloc(t->tokens, t->tokens_size * 2 * sizeof(token_t));
+                    if (tokens == NULL)
+                        goto oom;
+                    t->tokens = tokens;
+                    t->tokens_size *= 2;
+                }
+                tokens[n].value = line + start;
+                tokens[n].length = pos - start;
+                n++;
+                if (n == limit - 1) {
+                    full = true;
+                    rest = pos + 1;
+                    bits &= nl;
+                }
+            }
+            start = pos + 1;
+        }
+    }
+    return NULL;
+
+eol:
+    e = line + pos;
+    if (pos > 1 && *(e - 1) == '\r') {
+        e--;
+    }
+    if (full) {
+        tokens[n].value = line + rest < e ? line + rest : NULL;
+    } else {
+        if (line + start < e) {
+            tokens[n].value = line + start;
+            tokens[n].length = e - (line + start);
+            n++;
+        }
+        tokens[n].value = NULL;
+    }
+    tokens[n].length = 0;
+    *ntokens = n + 1;
+    *e = '\0';
+    return line + pos;
+
+oom:
+    /* Still report the line end so the caller can answer and skip it */
+    e = memchr(line, '\n', len);
+    *ntokens = 0;
+    return e;
+}
+
+/*
+ * With -o sched_coalesce, decides whether the response to the get just
+ * processed waits for the next command, so a pipelined run of gets is
+ * answered with one sendmsg(). Only if the next line is already buffered and
+ * is a get as well, the turn has room for it and the batch still fits one
+ * msghdr. Other responses may live in wbuf and are never held back.
+ */
+static bool sched_coalesce(conn *c) {
+    char *el, *p, *end;
+
+    if (!settings.sched_coalesce || c->state != conn_mwrite ||
+            c->protocol != ascii_prot || IS_UDP(c->transport)) {
+        return false;
+    }
+#ifdef EXTSTORE
+    if (c->io_wraplist)
+        return false;
+#endif
+    if (c->thread->sched_reqs <= 0 || c->msgused != 1 ||
+            c->msglist[0].msg_iovlen >= IOV_MAX / 2) {
+        return false;
+    }
+
+    if (c->rbytes <= 0 || (el = memchr(c->rcurr, '\n', c->rbytes)) == NULL)
+        return false;
+    for (p = c->rcurr; p < el && *p == ' '; p++)
+        ;
+    for (end = p; end < el && *end != ' ' && *end != '\r'; end++)
+        ;
+    return is_get_command(p, end - p);
+}
+
+/*
+ * Gives back the token array a huge get line grew, like conn_shrink() does
+ * for ilist. Only called once nothing points into the tokens any more.
+ */
+static void tokens_shrink(LIBEVENT_THREAD *t) {
+    if (t->tokens_size > TOKENS_HIGHWAT) {
+        token_t *tokens = realloc(t->tokens, TOKENS_INITIAL * sizeof(token_t));
+        if (tokens) {
+            t->tokens = tokens;
+            t->tokens_size = TOKENS_INITIAL;
+        }
+    }
+}
+
 /*
  * if we have a complete line in the buffer, process it.
  */
@@ -1532,11 +1968,14 @@ static int try_read_command(conn *c) {
         }
     } else {
         char *el, *cont;
+        size_t ntokens;
+        bool held, get;
 
         if (c->rbytes == 0)
             return 0;
 
-        el = memchr(c->rcurr, '\n', c->rbytes);
+        el = tokenize_line(c, c->rcurr, c->rbytes,
+                           c->rbuf + c->rsize - c->rcurr, &ntokens);
         if (!el) {
             if (c->rbytes > 1024) {
                 /*
@@ -1559,20 +1998,33 @@ static int try_read_command(conn *c) {
             return 0;
         }
         cont = el + 1;
-        if ((el - c->rcurr) > 1 && *(el - 1) == '\r') {
-            el--;
-        }
-        *el = '\0';
 
         assert(cont <= (c->rcurr + c->rbytes));
 
         c->last_cmd_time = current_time;
-        process_command(c, c->rcurr);
+        held = c->resp_batched;
+        get = ntokens > 0 && is_get_command(c->thread->tokens[0].value,
+                                            c->thread->tokens[0].length);
+        if (ntokens == 0) {
+            out_of_memory(c, "SERVER_ERROR out of memory tokenizing command");
+        } else {
+            process_command(c, c->rcurr, c->thread->tokens, ntokens);
+            tokens_shrink(c->thread);
+        }
 
         c->rbytes -= (cont - c->rcurr);
         c->rcurr = cont;
 
         assert(c->rcurr <= (c->rbuf + c->rsize));
+
+        /* Hold a get's response back while the next line is another get,
+         * unless out_string() just ended the batch with an error line. */
+        if (get && (c->resp_batched || !held) && sched_coalesce(c)) {
+            c->resp_batched = true;
+            conn_set_state(c, conn_new_cmd);
+        } else {
+            c->resp_batched = false;
+        }
     }
 
     return 1;
@@ -1762,9 +2214,7 @@ static void process_bin_flush(conn *c) {
         settings.oldest_live = new_oldest;
     }
 
-    pthread_mutex_lock(&c->thread->stats.mutex);
-    c->thread->stats.flush_cmds++;
-    pthread_mutex_unlock(&c->thread->stats.mutex);
+    THR_STATS_INCR(c->thread, flush_cmds);
 
     write_bin_response(c, NULL, 0, 0, 0);
 }
@@ -1797,9 +2247,7 @@ static void process_bin_delete(conn *c) {
         uint64_t cas = ntohll(req->message.header.request.cas);
         if (cas == 0 || cas == ITEM_get_cas(it)) {
             MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.slab_stats[ITEM_clsid(it)].delete_hits++;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].delete_hits);
             item_unlink(it);
             STORAGE_delete(c->thread->storage, it);
             write_bin_response(c, NULL, 0, 0, 0);
@@ -1809,9 +2257,7 @@ static void process_bin_delete(conn *c) {
         item_remove(it);    // release out reference
     } else {
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, NULL, 0);
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, delete_misses);
     }
 }
 
@@ -1866,7 +2312,9 @@ static void reset_cmd_handler(conn *c) {
         item_remove(c->item);
         c->item = NULL;
     }
-    conn_shrink(c);
+    /* a held back response still needs its buffers */
+    if (!c->resp_batched)
+        conn_shrink(c);
     if (c->rbytes > 0) {
         conn_set_state(c, conn_parse_cmd);
     } else {
@@ -1886,78 +2334,6 @@ static void complete_nread(conn *c) {
     }
 }
 
-typedef struct token_s {
-    char *value;
-    size_t length;
-} token_t;
-
-#define COMMAND_TOKEN 0
-#define SUBCOMMAND_TOKEN 1
-#define KEY_TOKEN 1
-
-#define MAX_TOKENS 8
-
-/*
- * Tokenize the command string by replacing whitespace with '\0' and update
- * the token array tokens with pointer to start of each token and length.
- * Returns total number of tokens. The last valid token is the terminal
- * token (value points to the first unprocessed character of the string and
- * length zero)
- *
- * Usage example:
- *
- *  while(tokenize_command(command, ncommand, tokens, max_tokens > 0) {
- *      for(int ix = 0; tokens[ix].length != 0; ix++) {
- *          ···
- *      }
- *      ncommand = tokens[ix].value - command;
- *      command = tokens[ix].value;
- *  }
- */
-static size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
-    char *s, *e;
-    size_t ntokens = 0;
-    size_t len = strlen(command);
-    unsigned int i = 0;
-
-    assert(command != NULL && tokens != NULL && max_tokens > 1);
-
-    s = e = command;
-    for (i = 0; i < len; i++) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = '\0';
-                if (ntokens == max_tokens - 1) {
-                    e++;
-                    s = e; // so we don't add an extra token
-                    break;
-                }
-            }
-            s = e + 1;
-        }
-        e++;
-    }
-
-    if (s != e) {
-        tokens[ntokens].value = s;
-        tokens[ntokens].length = e - s;
-        ntokens++;
-    }
-
-    /*
-     * If we scanned the whole string, the terminal value pointer is null,
-     * otherwise it si the first unprocessed character.
-     */
-    tokens[ntokens].value = *e == '\0' ? NULL : e;
-    tokens[ntokens].length = 0;
-    ntokens++;
-
-    return ntokens;
-}
-
 /* set up a connection to write a buffer then free it, used for stats */
 static void write_and_free(conn *c, char *buf, int bytes) {
     if (buf) {
@@ -2163,6 +2539,13 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("detail_enabled", "%s",
             settings.detail_enabled ? "yes" : "no");
     APPEND_STAT("reqs_per_event", "%d", settings.reqs_per_event);
+    APPEND_STAT("sched_bytes", "%d", settings.sched_bytes);
+    APPEND_STAT("sched_usec", "%d", settings.sched_usec);
+    APPEND_STAT("sched_coalesce", "%s", settings.sched_coalesce ? "yes" : "no");
+    APPEND_STAT("worker_cpus", "%s", settings.worker_cpus ? settings.worker_cpus : "NULL");
+    APPEND_STAT("worker_nodes", "%s", settings.worker_nodes ? settings.worker_nodes : "NULL");
+    APPEND_STAT("worker_rxq", "%s", settings.worker_rxq ? settings.worker_rxq : "NULL");
+    APPEND_STAT("bg_cpus", "%s", settings.bg_cpus ? settings.bg_cpus : "NULL");
     APPEND_STAT("cas_enabled", "%s", settings.use_cas ? "yes" : "no");
     APPEND_STAT("tcp_backlog", "%d", settings.backlog);
     APPEND_STAT("binding_protocol", "%s", prot_text(settings.binding_protocol));
@@ -2182,6 +2565,8 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("flush_enabled", "%s", settings.flush_enabled ? "yes" : "no");
     APPEND_STAT("dump_enabled", "%s", setitngs.dump_enabled ? "yes" : "no");
     APPEND_STAT("hash_algorithm", "%s", settings.hash_algorithm);
+    APPEND_STAT("hash_index", "%s",
+            settings.hash_index == HASH_INDEX_BUCKETED ? "bucketed" : "chained");
     APPEND_STAT("lru_maintainer_thread", "%s", settings.lru_maintainer_thread ? "yes" : "no");
     APPEND_STAT("lru_segmented", "%s", settings.lru_segmented ? "yes" : "no");
     APPEND_STAT("hot_lru_pct", "%d", settings.hot_lru_pct);
@@ -2326,18 +2711,26 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
 
 /**
  * FIXME: the 'breaks' around memory malloc's should break all the way down
- * fill ileft/suffixleft, then run conn_releaseitems()
- * ntokens is overwritten here... shrung... */
+ * fill ileft/suffixleft, then run conn_releaseitems() */
 static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas, bool should_touch) {
     char *key;
     size_t nkey;
-    int i = 0;
-    int si = 0;
+    /* a held back batch keeps its items and suffixes in front of ours */
+    const int istart = c->resp_batched ? c->ileft : 0;
+    const int sistart = c->resp_batched ? c->suffixleft : 0;
+    int i = istart;
+    int si = sistart;
     item *it;
     token_t *key_token = &tokens[KEY_TOKEN];
     char *suffix;
     int32_t exptime_int = 0;
     rel_time_t exptime = 0;
+    char *keys[ITEM_GET_BATCH_MAX];
+    size_t nkeys[ITEM_GET_BATCH_MAX];
+    item *items[ITEM_GET_BATCH_MAX];
+    int nbatch;
+    int b;
+    bool failed = false;
     assert(c != NULL);
 
     if (should_touch) {
@@ -2351,23 +2744,35 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     }
 
     do {
-        while (key_token->length != 0) {
-            
-            key = key_token->value;
-            nkey = key_token->length;
-
-            if (nkey > KEY_MAX_LENGTH) {
+        /*
+         * Collect up to a batch worth of keys so they can be looked up
+         * together. tokenize_line() split the whole line up front.
+         */
+        nbatch = 0;
+        while (nbatch < ITEM_GET_BATCH_MAX && key_token->length != 0) {
+            if (key_token->length > KEY_MAX_LENGTH) {
                 out_string(c, "CLIENT_ERROR bad command line format");
-                while (i-- > 0) {
+                while (i-- > istart) {
                     item_remove(*(c->ilist + i));
-                    if (return_cas || !settings.inline_ascii_response) {
-                        do_cache_free(c->thread->suffix_cache, *(c->suffixlist + i));
-                    }
+                }
+                while (si-- > sistart) {
+                    do_cache_free(c->thread->suffix_cache, *(c->suffixlist + si));
                 }
                 return;
             }
+            keys[nbatch] = key_token->value;
+            nkeys[nbatch] = key_token->length;
+            nbatch++;
+            key_token++;
+        }
+
+        limited_get_batch(keys, nkeys, nbatch, c, exptime, should_touch, items);
+
+        for (b = 0; b < nbatch; b++) {
+            key = keys[b];
+            nkey = nkeys[b];
+            it = items[b];
 
-            it = limited_get(key, nkey, c, exptime, should_touch);
             if (settings.detail_enabled) {
                 stats_prifix_record_get(key, nkey, NULL != it);
             }
@@ -2449,15 +2854,13 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 }
 
                 /* item_get() has incremented it->refcount for us */
-                pthread_mutex_lock(&c->thread->stats.mutex);
                 if (should_touch) {
-                    c->thread->stats.touch_cmds++;
-                    c->thread->stats.slab_stats[ITEM_clsid(it)].touch_hits++;
+                    THR_STATS_INCR(c->thread, touch_cmds);
+                    THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].touch_hits);
                 } else {
-                    c->thread->stats.lru_hits[it->slabs_clsid]++;
-                    c->thread->stats.get_cmds++;
+                    THR_STATS_INCR(c->thread, lru_hits[it->slabs_clsid]);
+                    THR_STATS_INCR(c->thread, get_cmds);
                 }
-                pthread_mutex_unlock(&c->thread->stats.mutex);
 #ifdef EXTSTORE
                 /* If ITEM_HDR, an io_wrap owns the reference. */
                 if ((it->it_flags & ITEM_HDR) == 0) {
@@ -2469,31 +2872,27 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 i++;
 #endif
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
                 if (should_touch) {
-                    c->thread->stats.touch_cmds++;
-                    c->thread->stats.touch_misses++;
+                    THR_STATS_INCR(c->thread, touch_cmds);
+                    THR_STATS_INCR(c->thread, touch_misses);
                 } else {
-                    c->thread->stats.get_misses++;
-                    c->thread->stats.get_cmds++;
+                    THR_STATS_INCR(c->thread, get_misses);
+                    THR_STATS_INCR(c->thread, get_cmds);
                 }
                 MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
-                pthread_mutex_unlock(&c->thread->stats.mutex);
             }
-
-            key_token++;
         }
 
-        /*
-         * If the command string hasn't been fully processed, get the next set
-         * of tokens
-         */
-        if (key_token->value != NULL) {
-            ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
-            key_token = tokens;
+        if (b < nbatch) {
+            /* bailed out on the b'th key; drop the rest of the batch */
+            failed = true;
+            while (++b < nbatch) {
+                if (items[b]) {
+                    item_remove(items[b]);
+                }
+            }
         }
-    
-    } while (key_token->value != NULL);
+    } while (!failed && key_token->length != 0);
 
     c->icurr = c->ilist;
     c->ileft = i;
@@ -2510,7 +2909,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
      * reliable to add END\r\n to the buffer, because it might not end
      * in \r\n. So we send SERVER_ERROR instead.
      */
-    if (key_token->value != NULL || add_iov(c, "END\r\n", 5) != 0 
+    if (failed || add_iov(c, "END\r\n", 5) != 0 
             || (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
         out_of_memory(c, "SERVER_ERROR out of memory writing get response");
     } else {
@@ -2641,18 +3040,14 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
 
     it = item_touch(key, nkey, realtime(exptime_int), c);
     if (it) {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.touch_cmds++;
-        c->thread->stats.slab_stats[ITEM_clsid(it)].touch_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, touch_cmds);
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].touch_hits);
 
         out_string(c, "TOUCHED");
         item_remove(it);
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.touch_cmds++;
-        c->thread->stats.touch_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, touch_cmds);
+        THR_STATS_INCR(c->thread, touch_misses);
 
         out_string(c, "NOT_FOUND");
     }
@@ -2692,13 +3087,11 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         out_of_memory(c, "SERVER_ERROR out of memory");
         break;
     case DELTA_ITEM_NOT_FOUND:
-        pthread_mutex_lock(&c->thread->stats.mutex);
         if (incr) {
-            c->thread->stats.incr_misses++;
+            THR_STATS_INCR(c->thread, incr_misses);
         } else {
-            c->thread->stats.decr_misses++;
+            THR_STATS_INCR(c->thread, decr_misses);
         }
-        pthread_mutex_unlock(&c->thread->stats.mutex);
 
         out_string(c, "NOT_FOUND");
         break;
@@ -2742,18 +3135,14 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
     if (it) {
         MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.slab_stats[ITEM_clsid(it)].delete_hits++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, slab_stats[ITEM_clsid(it)].delete_hits);
 
         item_unlink(it);
         STORAGE_delete(c->thread->storage, it);
         item_remove(it);        // release our reference
         out_string(c, "DELETED");
     } else {
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.delete_misses++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, delete_misses);
 
         out_string(c, "NOT_FOUND");
     }
@@ -2839,6 +3228,7 @@ static void process_watch_command(conn *c, token_t *tokens, const size_t ntokens
         case LOGGER_ADD_WATCHER_OK:
             conn_set_state(c, conn_watch);
             event_del(&c->event);
+            conn_epoll_detach(c);
             break;
     }
 }
@@ -2987,10 +3377,9 @@ static void process_extstore_command(conn *c, token_t *tokens, const size_t ntok
 }
 #endif
 
-static void process_command(conn *c, char *command) {
-    token_t tokens[MAX_TOKENS];
-    size_t ntokens;
+static void process_command(conn *c, char *command, token_t *tokens, const size_t ntokens) {
     int comm;
+    size_t i;
 
     assert(c != NULL);
 
@@ -3003,15 +3392,27 @@ static void process_command(conn *c, char *command) {
      * for commands set/add/replace, we build an item and read the data
      * directyle into it, then continue in nread_complete().
      */
-    c->msgcurr = 0;
-    c->msgused = 0;
-    c->iovused = 0;
-    if (add_msghdr(c) != 0) {
-        out_of_memory(c, "SERVER_ERROR out of memory preparing response");
-        return;
+    if (c->resp_batched) {
+        /* Append to the responses held back for the gets before this one;
+         * remember where ours starts in case it has to be taken back. */
+        c->resp_msgmark = c->msgused;
+        c->resp_iovmark = c->iovused;
+        c->resp_iovlenmark = c->msglist[c->msgused - 1].msg_iovlen;
+    } else {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            out_of_memory(c, "SERVER_ERROR out of memory preparing response");
+            return;
+        }
+    }
+
+    /* tokenize_line() left the separators alone for the line above */
+    for (i = 0; i < ntokens - 1; i++) {
+        tokens[i].value[tokens[i].length] = '\0';
     }
 
-    ntokens = tokenize_command(comand, tokens, MAX_TOKENS);
     if (ntokens >= 3 && 
             ((strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ||
              (strcmp(tokens[COMMAND_TOKEN].value, "bget") == 0))) {
@@ -3069,9 +3470,7 @@ static void process_command(conn *c, char *command) {
 
         set_noreply_maybe(c, tokens, ntokens);
 
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.flush_cmds++;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_INCR(c->thread, flush_cmds);
 
         if (!settings.flush_enabled) {
             // flush_all is not allowed but we log it on stats
@@ -3214,6 +3613,7 @@ static void process_command(conn *c, char *command) {
                 // TODO: Don't reuse conn_watch here
                 conn_set_state(c, conn_watch);
                 event_del(&c->event);
+                conn_epoll_detach(c);
                 break;
             case CRAWLER_RUNNING:
                 out_string(c, "BUSY currently processing crawler request");
@@ -3298,6 +3698,260 @@ static void process_command(conn *c, char *command) {
     return;
 }
 
+/*
+ * Batched UDP (-o udp_batch=N).
+ *
+ * Each UDP conn keeps a ring of N datagram slots filled by one recvmmsg()
+ * and hands them to the parser one at a time, so a burst of small requests
+ * costs one syscall instead of one each. Multi-packet requests are put back
+ * together here; the worker's socket is its own SO_REUSEPORT member, so
+ * all of a client's datagrams arrive on it.
+ */
+
+/* Datagrams bigger than this are dropped as truncated */
+#define UDP_SLOT_SIZE 8192
+/* Multi-packet requests being reassembled at once, per conn */
+#define UDP_REASM_MAX 8
+/* Most datagrams in one request */
+#define UDP_REASM_FRAGS 64
+/* Seconds to wait for the rest of a request */
+#define UDP_REASM_TIMEOUT 2
+
+struct udp_reasm {
+    struct sockaddr_in6 addr;
+    socklen_t addrlen;
+    int request_id;
+    int total;                      // datagrams in the request
+    int received;
+    rel_time_t started;
+    uint64_t have;                  // bit per sequence number received
+    uint32_t off[UDP_REASM_FRAGS];  // where each datagram's payload sits in buf
+    uint32_t len[UDP_REASM_FRAGS];
+    uint32_t used;
+    uint32_t size;
+    char *buf;
+};
+
+struct udp_batch {
+    int count;                      // datagrams from the last recvmmsg
+    int next;                       // next one to hand to the parser
+    bool gso_off;                   // UDP_SEGMENT failed on this socket
+    struct udp_reasm *reasm[UDP_REASM_MAX];
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iov[UDP_BATCH_MAX];
+    struct sockaddr_in6 addr[UDP_BATCH_MAX];
+    char data[];                    // UDP_SLOT_SIZE per slot
+};
+
+static void udp_reasm_free(struct udp_reasm *r) {
+    free(r->buf);
+    free(r);
+}
+
+void conn_udp_free(conn *c) {
+    int i;
+
+    for (i = 0; i < UDP_REASM_MAX; i++) {
+        if (c->udp->reasm[i])
+            udp_reasm_free(c->udp->reasm[i]);
+    }
+    free(c->udp);
+    c->udp = NULL;
+}
+
+/* Datagrams received but not yet parsed */
+static bool udp_batch_pending(conn *c) {
+    return c->udp != NULL && c->udp->next < c->udp->count;
+}
+
+static void udp_set_request(conn *c, int request_id,
+                            const struct sockaddr_in6 *addr, socklen_t addrlen) {
+    c->request_id = request_id;
+    if (addrlen > sizeof(c->request_addr))
+        addrlen = sizeof(c->request_addr);
+    memcpy(&c->request_addr, addr, addrlen);
+    c->request_addr_size = addrlen;
+}
+
+/*
+ * Adds one datagram of a multi-packet request. Returns true once the last
+ * one is in, with the whole request copied to rbuf.
+ */
+static bool udp_reassemble(conn *c, const unsigned char *buf, int len,
+                           const struct sockaddr_in6 *addr, socklen_t addrlen) {
+    struct udp_batch *b = c->udp;
+    struct udp_reasm *r = NULL;
+    int request_id = buf[0] * 256 + buf[1];
+    int seq = buf[2] * 256 + buf[3];
+    int total = buf[4] * 256 + buf[5];
+    int i, slot = -1;
+
+    if (total == 0 || total > UDP_REASM_FRAGS || seq >= total)
+        return false;
+    buf += UDP_HEADER_SIZE;
+    len -= UDP_HEADER_SIZE;
+
+    for (i = 0; i < UDP_REASM_MAX; i++) {
+        struct udp_reasm *e = b->reasm[i];
+        if (e == NULL) {
+            if (slot == -1)
+                slot = i;
+            continue;
+        }
+        if (e->request_id == request_id && e->addrlen == addrlen &&
+                memcmp(&e->addr, addr, addrlen) == 0) {
+            r = e;
+            slot = i;
+            break;
+        }
+        if (current_time - e->started > UDP_REASM_TIMEOUT) {
+            udp_reasm_free(e);
+            b->reasm[i] = NULL;
+            if (slot == -1)
+                slot = i;
+        }
+    }
+
+    if (r == NULL) {
+        if (slot == -1) {
+            /* Table full of live requests; the oldest gives way */
+            slot = 0;
+            for (i = 1; i < UDP_REASM_MAX; i++) {
+                if (b->reasm[i]->started < b->reasm[slot]->started)
+                    slot = i;
+            }
+            udp_reasm_free(b->reasm[slot]);
+            b->reasm[slot] = NULL;
+        }
+        r = calloc(1, sizeof(struct udp_reasm));
+        if (r == NULL)
+            return false;
+        memcpy(&r->addr, addr, addrlen);
+        r->addrlen = addrlen;
+        r->request_id = request_id;
+        r->total = total;
+        r->started = current_time;
+        b->reasm[slot] = r;
+    }
+
+    if (total != r->total || (r->have & ((uint64_t)1 << seq)))
+        return false;   // inconsistent or a duplicate
+
+    if (r->used + len > (uint32_t)c->rsize) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Multi-packet UDP request larger than %d bytes\n", c->rsize);
+        udp_reasm_free(r);
+        b->reasm[slot] = NULL;
+        return false;
+    }
+    if (r->used + len > r->size) {
+        uint32_t size = r->size ? r->size * 2 : UDP_SLOT_SIZE;
+        char *nbuf;
+        while (size < r->used + len)
+            size *= 2;
+        if ((nbuf = realloc(r->buf, size)) == NULL) {
+            udp_reasm_free(r);
+            b->reasm[slot] = NULL;
+            return false;
+        }
+        r->buf = nbuf;
+        r->size = size;
+    }
+    memcpy(r->buf + r->used, buf, len);
+    r->off[seq] = r->used;
+    r->len[seq] = len;
+    r->used += len;
+    r->have |= (uint64_t)1 << seq;
+    if (++r->received < r->total)
+        return false;
+
+    c->rbytes = 0;
+    for (i = 0; i < r->total; i++) {
+        memcpy(c->rbuf + c->rbytes, r->buf + r->off[i], r->len[i]);
+        c->rbytes += r->len[i];
+    }
+    c->rcurr = c->rbuf;
+    udp_set_request(c, r->request_id, &r->addr, r->addrlen);
+    udp_reasm_free(r);
+    b->reasm[slot] = NULL;
+    return true;
+}
+
+/*
+ * read a UDP request from the conn's datagram ring, refilling it with one
+ * recvmmsg() when empty. Only refills once per call so a flood of partial
+ * requests can't keep the worker here.
+ */
+static enum try_read_result try_read_udp_batch(conn *c) {
+    struct udp_batch *b = c->udp;
+    bool refilled = false;
+    int i;
+
+    if (b == NULL) {
+        b = calloc(1, sizeof(struct udp_batch) +
+                    (size_t)settings.udp_batch * UDP_SLOT_SIZE);
+        if (b == NULL) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return READ_NO_DATA_RECEIVED;
+        }
+        c->udp = b;
+    }
+
+    for (;;) {
+        unsigned char *buf;
+        int len;
+
+        if (b->next == b->count) {
+            int res;
+
+            if (refilled)
+                return READ_NO_DATA_RECEIVED;
+            for (i = 0; i < settings.udp_batch; i++) {
+                b->iov[i].iov_base = b->data + (size_t)i * UDP_SLOT_SIZE;
+                b->iov[i].iov_len = UDP_SLOT_SIZE;
+                memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+                b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+                b->msgs[i].msg_hdr.msg_iovlen = 1;
+                b->msgs[i].msg_hdr.msg_name = &b->addr[i];
+                b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+            }
+            b->next = b->count = 0;
+            res = recvmmsg(c->sfd, b->msgs, settings.udp_batch, MSG_DONTWAIT, NULL);
+            if (res <= 0)
+                return READ_NO_DATA_RECEIVED;
+            b->count = res;
+            refilled = true;
+        }
+
+        i = b->next++;
+        buf = (unsigned char *)b->iov[i].iov_base;
+        len = b->msgs[i].msg_len;
+        THR_STATS_ADD(c->thread, bytes_read, len);
+
+        if (len < UDP_HEADER_SIZE || (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "Dropping bad or oversized UDP datagram\n");
+            continue;
+        }
+
+        if (buf[4] == 0 && buf[5] == 1) {
+            /* Single-packet request; the common case */
+            len -= UDP_HEADER_SIZE;
+            memcpy(c->rbuf, buf + UDP_HEADER_SIZE, len);
+            c->rbytes = len;
+            c->rcurr = c->rbuf;
+            udp_set_request(c, buf[0] * 256 + buf[1], &b->addr[i],
+                            b->msgs[i].msg_hdr.msg_namelen);
+            return READ_DATA_RECEIVED;
+        }
+
+        if (udp_reassemble(c, buf, len, &b->addr[i], b->msgs[i].msg_hdr.msg_namelen))
+            return READ_DATA_RECEIVED;
+    }
+}
+
 /*
  * read a UDP request.
  */
@@ -3306,15 +3960,16 @@ static enum try_read_result try_read_udp(conn *c) {
 
     assert(c != NULL);
 
+    if (settings.udp_batch > 0)
+        return try_read_udp_batch(c);
+
     c->request_addr_size = sizeof(c->request_addr);
     res = recvfrom(c->sfd, c->rbuf, c->rsize,
                     0, (struct sockaddr *)&c->request_addr,
                     &c->request_addr_size);
-    if (res > 0) {
+    if (res > 8) {
         unsigned char *buf = (unsigned char *)c->rbuf;
-        pthread_mutex_lock(&c->thread->stats.mutex);
-        c->thread->stats.bytes_read += res;
-        pthread_mutex_unlock(&c->thread->stats.mutex);
+        THR_STATS_ADD(c->thread, bytes_read, res);
 
         /* Beginning of UDP packet is the request ID; save it */
         c->request_id = buf[0] * 256 + buf[1];
@@ -3326,7 +3981,7 @@ static enum try_read_result try_read_udp(conn *c) {
         }
 
         /* Don't care about any of the rest of the header */
-        res -= 0;
+        res -= 8;
         memmove(c->rbuf, c->rbuf + 8, res);
 
         c->rbytes = res;
@@ -3339,61 +3994,58 @@ static enum try_read_result try_read_udp(conn *c) {
 /*
  * read from network as much as we can, handle buffer overflow and connection
  * close.
- * before reading, move the remaining incomplete fragment of a command
- * (if any) to the beginning of the buffer.
+ * before reading, borrow a read buffer if the connection has none, and move
+ * the remaining incomplete fragment of a command (if any) to the beginning
+ * of it.
  *
- * To protect us from someone flooding a connection with bogus data causing
- * the connection to eat up all available memory, break out and start looking
- * at the data I've got after a number of reallocs...
+ * The buffer is not grown to swallow a pipeline: once it is full the parser
+ * drains it and we come back for more. It is only grown, one doubling per
+ * call, when a single incomplete command fills it entirely.
  *
  * @return enum try_read_result
  */
 static enum try_read_result try_read_network(conn *c) {
     enum try_read_result gotdata = READ_NO_DATA_RECEIVED;
     int res;
-    int num_allocs = 0;
     assert(c != NULL);
 
+    if (c->rbuf == NULL && !rbuf_alloc(c)) {
+        if (settings.verbose > 0) {
+            fprintf(stderr, "Couldn't allocate input buffer\n");
+        }
+        out_of_memory(c, "SERVER_ERROR out of memory reading request");
+        c->write_and_go = conn_closing;
+        return READ_MEMORY_ERROR;
+    }
+
     if (c->rcurr != c->rbuf) {
         if (c->rbytes != 0) /* otherwise there's nothing to copy */
             memmove(c->rbuf, c->rcurr, c->rbytes);
         c->rcurr = c->rbuf;
     }
 
-    while (1) {
-        if (c->rbytes >= c->rsize) {
-            if (num_allocs == 4) {
-                return gotdata;
-            }
-            ++num_allocs;
-            char *new_rbuf = realloc(c->rbuf, c->rsize * 2);
-            if (!new_rbuf) {
-                STATS_LOCK();
-                stats.malloc_fails++;
-                STATS_UNLOCK();
-                if (settings.verbose > 0) {
-                    fprintf(stderr, "Couldn't realloc input buffer\n");
-                }
-                c->rbytes = 0;  // ignore what we read
-                out_of_memory(c, "SERVER_ERROR out of memory reading request");
-                c->write_and_go = conn_closing;
-                return READ_MEMORY_ERROR;
-            }
-            c->rcurr = c->rbuf = new_rbuf;
-            c->rsize *= 2;
+    if (c->rbytes >= c->rsize && !rbuf_resize(c, c->rsize * 2)) {
+        if (settings.verbose > 0) {
+            fprintf(stderr, "Couldn't realloc input buffer\n");
         }
+        c->rbytes = 0;  // ignore what we read
+        out_of_memory(c, "SERVER_ERROR out of memory reading request");
+        c->write_and_go = conn_closing;
+        return READ_MEMORY_ERROR;
+    }
 
+    while (c->rbytes < c->rsize) {
         int avail = c->rsize - c->rbytes;
         res = read(c->sfd, c->rbuf + c->rbytes, avail);
         if (res > 0) {
-            pthread_mutex_lock(&c->thread->stats.mutex);
-            c->thread->stats.bytes_read += res;
-            pthread_mutex_unlock(&c->thread->stats.mutex);
+            THR_STATS_ADD(c->thread, bytes_read, res);
             gotdata = READ_DATA_RECEIVED;
             c->rbytes += res;
             if (res == avail) {
                 continue;
             } else {
+                /* short read, the socket is drained */
+                c->ep_ready &= ~EV_READ;
                 break;
             }
         }
@@ -3402,6 +4054,7 @@ static enum try_read_result try_read_network(conn *c) {
         }
         if (res == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->ep_ready &= ~EV_READ;
                 break;
             }
             return READ_ERROR;
@@ -3413,6 +4066,13 @@ static enum try_read_result try_read_network(conn *c) {
 static bool update_event(conn *c, const int new_flags) {
     assert(c != NULL);
 
+    /* The epoll registration covers both directions and is never re-armed;
+     * conn_epoll_run() only looks at what we want next. */
+    if (c->epoll) {
+        c->ev_flags = new_flags;
+        return true;
+    }
+
     struct event_base *base = c->event.ev_base;
     if (c->ev_flags == new_flags)
         return true;
@@ -3424,6 +4084,226 @@ static bool update_event(conn *c, const int new_flags) {
     return true;
 }
 
+/*
+ * Whether to send the current message with MSG_ZEROCOPY. Only ASCII get
+ * responses qualify: everything they point at is an item or a suffix buffer,
+ * which conn_release_items() can hold until the kernel is done. Binary
+ * headers live in wbuf, which the next response overwrites, and extstore
+ * hits are released through their io_wraps. Copies instead when no hold
+ * can be reserved for the response.
+ */
+static bool transmit_zerocopy(conn *c, struct msghdr *m) {
+#ifdef MSG_ZEROCOPY
+    size_t bytes = 0;
+    size_t i;
+
+    if (!c->zerocopy || c->state != conn_mwrite || c->protocol != ascii_prot)
+        return false;
+#ifdef EXTSTORE
+    if (c->io_wraplist)
+        return false;
+#endif
+    for (i = 0; i < m->msg_iovlen; i++) {
+        bytes += m->msg_iov[i].iov_len;
+        if (bytes >= (size_t)settings.zerocopy_min)
+            return conn_zerocopy_reserve(c);
+    }
+#endif
+    return false;
+}
+
+/* UDP_SEGMENT limits: segments per send, and bytes per send */
+#define UDP_GSO_SEGS 64
+#define UDP_GSO_BYTES 60000
+
+/*
+ * Sends the rest of a multi-datagram UDP response at once. When the
+ * datagrams are all the same size but the last, which is how add_iov()
+ * cuts them, they go down as one UDP_SEGMENT (GSO) send the stack splits
+ * up; otherwise with one sendmmsg(). UDP sends never go out partially.
+ */
+static enum transmit_result transmit_udp_batch(conn *c) {
+    struct udp_batch *b = c->udp;
+    struct msghdr *m = &c->msglist[c->msgcurr];
+    int n = c->msgused - c->msgcurr;
+    int res, i;
+
+    if (n > UDP_BATCH_MAX)
+        n = UDP_BATCH_MAX;
+
+#ifdef UDP_SEGMENT
+    if (!b->gso_off) {
+        size_t seg = 0, total = 0, bytes;
+        int iovlen = 0;
+        int k;
+
+        for (k = 0; k < n && k < UDP_GSO_SEGS; k++) {
+            bytes = 0;
+            for (i = 0; i < m[k].msg_iovlen; i++)
+                bytes += m[k].msg_iov[i].iov_len;
+            if (k == 0)
+                seg = bytes;
+            if (bytes > seg || total + bytes > UDP_GSO_BYTES ||
+                    iovlen + m[k].msg_iovlen > IOV_MAX)
+                break;
+            total += bytes;
+            iovlen += m[k].msg_iovlen;
+            if (bytes < seg) {
+                k++;    // a short datagram can only be the last one
+                break;
+            }
+        }
+
+        if (k > 1) {
+            char control[CMSG_SPACE(sizeof(uint16_t))];
+            struct msghdr gm = m[0];
+            struct cmsghdr *cm;
+
+            memset(control, 0, sizeof(control));
+            gm.msg_iovlen = iovlen;
+            gm.msg_control = control;
+            gm.msg_controllen = sizeof(control);
+            cm = CMSG_FIRSTHDR(&gm);
+            cm->cmsg_level = IPPROTO_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cm) = seg;
+
+            res = sendmsg(c->sfd, &gm, 0);
+            if (res > 0) {
+                THR_STATS_ADD(c->thread, bytes_written, res);
+                for (i = 0; i < k; i++)
+                    m[i].msg_iovlen = 0;
+                c->msgcurr += k - 1;
+                return TRANSMIT_INCOMPLETE;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                /* No GSO on this kernel or route; stop trying */
+                b->gso_off = true;
+            }
+        }
+    }
+#endif
+
+    {
+        struct mmsghdr vec[UDP_BATCH_MAX];
+
+        for (i = 0; i < n; i++) {
+            vec[i].msg_hdr = m[i];
+            vec[i].msg_len = 0;
+        }
+        res = sendmmsg(c->sfd, vec, n, 0);
+        if (res > 0) {
+            for (i = 0; i < res; i++) {
+                THR_STATS_ADD(c->thread, bytes_written, vec[i].msg_len);
+                m[i].msg_iovlen = 0;
+            }
+            c->msgcurr += res - 1;
+            return TRANSMIT_INCOMPLETE;
+        }
+    }
+
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "Couldn't update event\n");
+            conn_set_state(c, conn_closing);
+            return TRANSMIT_HEAD_ERROR;
+        }
+        return TRANSMIT_SOFT_ERROR;
+    }
+    if (settings.verbose > 0)
+        perror("Failed to write, and not due to blocking");
+    conn_set_state(c, conn_read);
+    return TRANSMIT_HEAD_ERROR;
+}
+
+/*
+ * Transmit the next chunk of data from our list of msgbuf structures.
+ *
+ * Returns:
+ *   TRANSMIT_COMPLETE   All done writing.
+ *   TRANSMIT_INCOMPLETE More data remaining to write.
+ *   TRANSMIT_SOFT_ERROR Can't write any more right now.
+ *   TRANSMIT_HEAD_ERROR Can't write (c->state is set to conn_closing)
+ */
+static enum transmit_result transmit(conn *c) {
+    assert(c != NULL);
+
+    if (c->msgcurr < c->msgused &&
+            c->msglist[c->msgcurr].msg_iovlen == 0) {
+        /* Finished writing the current msg; advance to the next. */
+        c->msgcurr++;
+    }
+    if (IS_UDP(c->transport) && c->udp != NULL && c->msgused - c->msgcurr > 1)
+        return transmit_udp_batch(c);
+    if (c->msgcurr < c->msgused) {
+        ssize_t res;
+        struct msghdr *m = &c->msglist[c->msgcurr];
+        int flags = 0;
+
+#ifdef MSG_ZEROCOPY
+        if (transmit_zerocopy(c, m))
+            flags = MSG_ZEROCOPY;
+#endif
+        res = sendmsg(c->sfd, m, flags);
+#ifdef MSG_ZEROCOPY
+        if (res == -1 && flags && errno == ENOBUFS) {
+            /* out of optmem for the notifications; copy this one */
+            res = sendmsg(c->sfd, m, 0);
+            flags = 0;
+        }
+#endif
+        if (res > 0) {
+            THR_STATS_ADD(c->thread, bytes_written, res);
+#ifdef MSG_ZEROCOPY
+            if (flags) {
+                /* the kernel numbers every zerocopy send on the socket */
+                c->zc_seq++;
+                c->zc_used = true;
+            }
+#endif
+
+            /* We've written some of the data. Remove the completed
+               iovec entries from the list of pending writes. */
+            while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
+                res -= m->msg_iov->iov_len;
+                m->msg_iovlen--;
+                m->msg_iov++;
+            }
+
+            /* Might have written just part of the last iovec entry;
+               adjust it so the next write will do the rest. */
+            if (res > 0) {
+                m->msg_iov->iov_base = (caddr_t)m->msg_iov->iov_base + res;
+                m->msg_iov->iov_len -= res;
+            }
+            return TRANSMIT_INCOMPLETE;
+        }
+        if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+                if (settings.verbose > 0)
+                    fprintf(stderr, "Couldn't update event\n");
+                conn_set_state(c, conn_closing);
+                return TRANSMIT_HEAD_ERROR;
+            }
+            return TRANSMIT_SOFT_ERROR;
+        }
+        /* if res == 0 or res == -1 and error is not EAGAIN or EWOULDBLOCK,
+           we have a real error, on which we close the connection */
+        if (settings.verbose > 0)
+            perror("Failed to write, and not due to blocking");
+
+        if (IS_UDP(c->transport))
+            conn_set_state(c, conn_read);
+        else
+            conn_set_state(c, conn_closing);
+        return TRANSMIT_HEAD_ERROR;
+    } else {
+        return TRANSMIT_COMPLETE;
+    }
+}
+
 /**
  * Convert a state name to a human readable form.
  */
@@ -3478,12 +4358,10 @@ static int ensure_iov_space(conn *c) {
 
     if (c->iovused >= c->iovsize) {
         int i, iovnum;
-        struct iovec *new_iov = (struct iovec *)realloc(c->iov,
-                                    (c->iovsize * 2) * sizeof(struct iovec));
+        struct iovec *new_iov = resp_grow(c, c->iov,
+                                    c->iovsize * sizeof(struct iovec),
+                                    &c->iov_malloced, c->thread->iov_cache);
         if (! new_iov) {
-            STATS_LOCK();
-            stats.malloc_fails++;
-            STATS_UNLOCK();
             return -1;
         }
         c->iov = new_iov;
@@ -3541,12 +4419,51 @@ void do_accept_new_conns(const bool do_accept) {
     }
 }
 
+/*
+ * Fairness between the connections of a worker. Each event gives a
+ * connection one turn: at most reqs_per_event commands and, with
+ * -o sched_bytes / sched_usec, at most that many bytes read and written or
+ * that much time. A connection that ends its turn with input left goes to
+ * the back of the worker's ready queue, see conn_sched_defer().
+ */
+static void sched_turn_begin(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (me == NULL)
+        return;
+    me->sched_reqs = settings.reqs_per_event;
+    if (settings.sched_bytes > 0)
+        me->sched_bytes = me->stats.bytes_read + me->stats.bytes_written;
+    if (settings.sched_usec > 0)
+        clock_gettime(CLOCK_MONOTONIC, &me->sched_start);
+}
+
+/* Charges the next command to the turn. Returns true if the turn is over. */
+static bool sched_turn_over(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (--me->sched_reqs < 0)
+        return true;
+    if (settings.sched_bytes > 0 &&
+            me->stats.bytes_read + me->stats.bytes_written - me->sched_bytes >=
+                (uint64_t)settings.sched_bytes)
+        return true;
+    if (settings.sched_usec > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((int64_t)(now.tv_sec - me->sched_start.tv_sec) * 1000000 +
+                (now.tv_nsec - me->sched_start.tv_nsec) / 1000 >= settings.sched_usec)
+            return true;
+    }
+    return false;
+}
+
 static void drive_machine(conn *c) {
+    LIBEVENT_THREAD *me;
     bool stop = false;
     int sfd;
     socklen_t addrlen;
     struct sockaddr_storage addr;
-    int nreqs = settings.reqs_per_event;
     int res;
     const char *str;
 #ifdef HAVE_ACCEPT4
@@ -3557,6 +4474,9 @@ static void drive_machine(conn *c) {
 
     assert(c != NULL);
 
+    me = c->thread;
+    sched_turn_begin(c);
+
     while (!stop) {
         
         switch (c->state) {
@@ -3616,6 +4536,13 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_waiting:
+            /* nothing left to parse; the buffer goes back to the worker */
+            rbuf_release(c);
+            if (udp_batch_pending(c)) {
+                /* the last recvmmsg brought more; no need to wait */
+                conn_set_state(c, conn_read);
+                break;
+            }
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
                     fprintf(stderr, "Couldn't update event\n");
@@ -3655,26 +4582,27 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_new_cmd:
-            /* Only process nreqs at a time to avoid starving other 
-             * connections */
+            /* Only process a turn's worth at a time to avoid starving
+             * other connections */
 
-            --nreqs;
-            if (nreqs >= 0) {
+            if (!sched_turn_over(c)) {
                 reset_cmd_handler(c);
+            } else if (c->resp_batched) {
+                /* send what the batch holds before giving up the turn */
+                c->resp_batched = false;
+                conn_set_state(c, conn_mwrite);
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.conn_yields++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
-                if (c->rbytes > 0) {
+                THR_STATS_INCR(c->thread, conn_yields);
+                if (c->rbytes > 0 || udp_batch_pending(c)) {
                     /* We have already read in data into the input buffer,
                      * so libevent will most likely not signal read events
-                     * on the socket (unless more data is available. As a
-                     * hack we should just put in a request to write data,
-                     * because that should be possible
+                     * on the socket (unless more data is available). Queue
+                     * it to be driven again once the other connections of
+                     * this worker had their turn.
                      */
-                    if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+                    if (!conn_sched_defer(c)) {
                         if (settings.verbose > 0)
-                            fprintf(stderr, "Couldn't update event\n");
+                            fprintf(stderr, "Couldn't queue connection\n");
                         conn_set_state(c, conn_closing);
                         break;
                     }
@@ -3717,9 +4645,7 @@ static void drive_machine(conn *c) {
                 /* now try reading from the socket */
                 res = read(c->sfd, c->ritem, c->rlbytes);
                 if (res > 0) {
-                    pthread_mutex_lock(&c->thread->stats.mutex);
-                    c->thread->stats.bytes_read += res;
-                    pthread_mutex_unlock(&c->thread->stats.mutex);
+                    THR_STATS_ADD(c->thread, bytes_read, res);
                     if (c->rcurr == c->ritem) {
                         c->rcurr += res;
                     }
@@ -3739,6 +4665,7 @@ static void drive_machine(conn *c) {
             }
 
             if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                c->ep_ready &= ~EV_READ;
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't update event\n");
@@ -3785,11 +4712,13 @@ static void drive_machine(conn *c) {
             }
 
             /* now try reading from the socket */
+            if (c->rbuf == NULL && !rbuf_alloc(c)) {
+                conn_set_state(c, conn_closing);
+                break;
+            }
             res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (res > 0) {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.bytes_read += res;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
+                THR_STATS_ADD(c->thread, bytes_read, res);
                 c->sbytes -= res;
                 break;
             }
@@ -3798,6 +4727,7 @@ static void drive_machine(conn *c) {
                 break;
             }
             if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                c->ep_ready &= ~EV_READ;
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't update event\n");
@@ -3842,6 +4772,7 @@ static void drive_machine(conn *c) {
                 // TODO: create proper state for this condition
                 conn_set_state(c, conn_watch);
                 event_del(&c->event);
+                conn_epoll_detach(c);
                 c->io_queued = true;
                 extstore_submit(c->thread->storage, &c->io_wraplist->io);
                 stop = true;
@@ -3855,7 +4786,7 @@ static void drive_machine(conn *c) {
                 conn_set_state(c, conn_closing);
                 break;
             }
-            switch (trasmit(c)) {
+            switch (transmit(c)) {
             case TRANSMIT_COMPLETE:
                 if (c->state == conn_mwrite) {
                     conn_release_items(c);
@@ -3883,6 +4814,8 @@ static void drive_machine(conn *c) {
                 break;          // Continue in state machine
 
             case TRANSMIT_SOFT_ERROR:
+                /* the send buffer is full; wait for the next EPOLLOUT edge */
+                c->ep_ready &= ~EV_WRITE;
                 stop = true;
                 break;
             }
@@ -3911,5 +4844,9 @@ static void drive_machine(conn *c) {
         }
     }
 
+    /* Nothing read from shared structures is held past this point. The
+     * main thread's listening connections have no worker and take no part. */
+    if (me != NULL)
+        epoch_quiescent(me);
     return;
 }
@@ -89,6 +89,7 @@ struct slab_stats {
     X(incr_misses) \
     X(decr_misses) \
     X(cas_misses) \
+    X(bytes_read) \
     X(bytes_written) \
     X(flush_cmds) \
     X(conn_yields) /* of yields for connections (-R option)*/ \
@@ -105,10 +106,12 @@ struct slab_stats {
 #endif
 
 /**
- * Stats stored per-thread
+ * Stats stored per-thread. Only the owning worker ever writes these, so
+ * there is no mutex: updates are plain loads plus a relaxed atomic store
+ * (no lock prefix), and aggregation reads each counter with a relaxed load.
+ * Aligned so neighbouring threads' counters never share a cache line.
  */
 struct thread_stats {
-    pthread_mutex_t mutex;
 #define X(name) uint64_t name;
     THREAD_STATS_FIELDS
 #ifdef EXTSTORE
@@ -116,8 +119,13 @@ struct thread_stats {
 #endif
 #undef X
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
-    uint64_t lru_hits[POWER_LARGEST]；
-};
+    uint64_t lru_hits[POWER_LARGEST];
+} __attribute__((aligned(64)));
+
+/* Update a counter in the calling worker's own thread_stats. */
+#define THR_STATS_ADD(t, field, n) \
+    __atomic_store_n(&(t)->stats.field, (t)->stats.field + (n), __ATOMIC_RELAXED)
+#define THR_STATS_INCR(t, field) THR_STATS_ADD(t, field, 1)
 
 typedef struct {
     pthread_t thread_id;        // unique ID of this thread
@@ -126,14 +134,29 @@ typedef struct {
     int notify_receive_fd;      // receiving end of notify pipe
     int notify_send_fd;         // sending end of notify pipe
     struct thread_stats stats;  // Stats generated by this thread
+    struct thread_stats stats_base; // snapshot taken by the last "stats reset"
     struct conn_queue *new_conn_queue;  // queue of new connections to handle
     cache_t *suffix_cache;      // suffix cache
+    cache_t *rbuf_cache;        // read buffers lent to connections
+    cache_t *iov_cache;         // response iovecs lent to connections
+    cache_t *msg_cache;         // response msghdrs lent to connections
+    cache_t *bin_batch_cache;   // headers of batched quiet binary gets
 #ifdef EXTSTORE
     cache_t *io_cache;          // IO objects
     void *storage;              // data object for storage system
 #endif
     logger *l;                  // logger buffer
     void *lru_bump_buf;         // async LRU bump buffer
+    struct token_s *tokens;     // ASCII command tokens, grown for long get lines
+    size_t tokens_size;         // entries allocated in tokens
+    struct event sched_event;   // runs the ready queue after the next poll
+    struct conn *sched_head;    // connections that used up their turn with input left
+    struct conn **sched_tail;
+    int sched_count;
+    int sched_reqs;             // commands left in the current turn
+    uint64_t sched_bytes;       // bytes_read + bytes_written when the turn began
+    struct timespec sched_start;    // when the turn began, with sched_usec
+    uint64_t epoch_seen;        // global epoch at the last quiescent state
 } LIBEVENT_THREAD;
 
 /**
@@ -149,11 +172,20 @@ struct conn {
     struct event event;
     short ev_flags;
     short which;    /** which events were just triggered */
+    struct conn *sched_next;    /** worker ready queue */
+    struct conn **sched_pprev;  /** NULL while not queued */
+    bool epoll;     /** registered with the worker's epoll instance */
+    bool ep_queued; /** on the worker's epoll_ready list */
+    short ep_ready; /** EV_READ/EV_WRITE seen and not yet run into EAGAIN */
+    bool zerocopy;  /** SO_ZEROCOPY is on for this socket */
+    bool zc_used;   /** the response being written went out with MSG_ZEROCOPY */
+    uint32_t zc_seq;/** zerocopy sends issued on this socket so far */
 
     char *rbuf;     /** buffer to read commands into */
     char *rcurr;    /** but if we parsed some already, this is where we stopped */
     int  rsize;     /** total allocated size of rbuf */
     int  rbytes;    /** how much data, staring from rcur, do we have unparsed */
+    bool rbuf_malloced; /** rbuf is private, not borrowed from the thread's rbuf_cache */
 
     char *wbuf;
     char *wcurr;
@@ -183,12 +215,18 @@ struct conn {
     struct iovec *iov;
     int  iovsize;   // number of elements allocated in iov[]
     int  iovused;   // number of elements used in iov[]
+    bool iov_malloced;  // iov is private, not borrowed from the thread's iov_cache
 
     struct msghdr *msglist;
     int  msgsize;   // number of elemments allocated in msglist[]
+    bool msg_malloced;  // msglist is private, not borrowed from msg_cache
     int  msgused;   // number of slements used in msglist[]
     int  msgcurr;   // element in msglist[] being transmitted now
     int  msgbytes;  // number of bytes in current msg
+    bool resp_batched;  // response held back to go out with the next pipelined get
+    int  resp_msgmark;  // msgused when the current command started
+    int  resp_iovmark;  // iovused when the current command started
+    int  resp_iovlenmark;   // msg_iovlen of the last msghdr then
 
     item **ilist;   // list of items to write out
     int  isize;
@@ -199,6 +237,7 @@ struct conn {
     int  suffixsize;
     char **suffixcurr;
     int  suffixleft;
+    char *bin_batch_buf;    // headers of a batched GETQ/GETKQ response, from bin_batch_cache
 #ifdef EXTSTORE
     int  io_wrapleft;
     unsigned int recache_counter;
@@ -212,6 +251,7 @@ struct conn {
     int  request_id;    // Incomming UDP request ID, if this is a UDP "connection"
     struct sockaddr_in6 request_addr;   // udp: Who sent the most recent request
     socklen_t request_addr_size;
+    struct udp_batch *udp;  // udp: recvmmsg ring and reassembly, see try_read_udp_batch()
     unsigned char *hdrbuf;  // udp pakcets headers
     int  hdrsize;   // number of headers' worth of space is allocated
 
@@ -234,7 +274,20 @@ struct conn {
     LIBEVENT_THREAD *thread; // Pointer to the thread object serving this connection
 };
 
+/* Most keys of a multiget looked up together */
+#define ITEM_GET_BATCH_MAX 64
+
+/* Most datagrams moved by one recvmmsg/sendmmsg */
+#define UDP_BATCH_MAX 64
+
+/* Response headers of one batch of quiet binary gets */
+#define BIN_BATCH_HDR_SIZE 8192
+
+void item_get_batch(char **keys, size_t *nkeys, const int count, conn *c,
+                    const uint32_t exptime, const bool should_touch, item **items);
 
+void threadlocal_stats_reset(void);
+void threadlocal_stats_aggregate(struct thread_stats *stats);
 
 
 
@@ -90,6 +90,125 @@ void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
 
 
 
+/*
+ * Looks up a batch of keys for a multiget. Every key is hashed up front and
+ * its hash bucket prefetched. In bucketed mode plain gets are then tried
+ * without any lock (see do_item_get_lockless()); what is left is resolved
+ * grouped by item lock so each lock is taken once per batch instead of once
+ * per key. items[] is filled in key order, NULL for misses.
+ */
+void item_get_batch(char **keys, size_t *nkeys, const int count, conn *c,
+                    const uint32_t exptime, const bool should_touch, item **items) {
+    uint32_t hv[ITEM_GET_BATCH_MAX];
+    int order[ITEM_GET_BATCH_MAX];
+    const uint32_t lock_mask = hashmask(item_lock_hashpower);
+    const bool lockless = settings.hash_index == HASH_INDEX_BUCKETED && !should_touch;
+    int i, j, n;
+
+    assert(count <= ITEM_GET_BATCH_MAX);
+    hash_batch((const void * const *)keys, nkeys, count, hv);
+
+    for (i = 0; i < count; i++) {
+        assoc_prefetch(hv[i]);
+    }
+
+    for (i = 0, n = 0; i < count; i++) {
+        bool retry = true;
+        if (lockless) {
+            items[i] = do_item_get_lockless(keys[i], nkeys[i], hv[i], c, &retry);
+        }
+        if (retry) {
+            order[n++] = i;
+        }
+    }
+
+    /* Batches are small; an insertion sort on the lock index is plenty. */
+    for (i = 1; i < n; i++) {
+        int k = order[i];
+        for (j = i; j > 0 && (hv[order[j - 1]] & lock_mask) > (hv[k] & lock_mask); j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = k;
+    }
+
+    for (i = 0; i < n; i = j) {
+        uint32_t lock = hv[order[i]];
+        item_lock(lock);
+        for (j = i; j < n && (hv[order[j]] & lock_mask) == (lock & lock_mask); j++) {
+            int k = order[j];
+            if (should_touch) {
+                items[k] = do_item_touch(keys[k], nkeys[k], exptime, hv[k], c);
+            } else {
+                items[k] = do_item_get(keys[k], nkeys[k], hv[k], c, DO_UPDATE);
+            }
+        }
+        item_unlock(lock);
+    }
+}
+
+/******************************* GLOBAL STATS ******************************/
+
+/*
+ * Workers bump their own counters without a lock, so a reset cannot zero
+ * them from here. Instead remember where each counter stood; aggregation
+ * reports the distance travelled since. Called with STATS_LOCK held.
+ */
+void threadlocal_stats_reset(void) {
+    int ii, sid;
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        struct thread_stats *cur = &threads[ii].stats;
+        struct thread_stats *base = &threads[ii].stats_base;
+#define X(name) base->name = __atomic_load_n(&cur->name, __ATOMIC_RELAXED);
+        THREAD_STATS_FIELDS
+#ifdef EXTSTORE
+        EXTSTORE_THREAD_STATS_FIELDS
+#endif
+#undef X
+        for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
+#define X(name) base->slab_stats[sid].name = \
+            __atomic_load_n(&cur->slab_stats[sid].name, __ATOMIC_RELAXED);
+            SLAB_STATS_FIELDS
+#undef X
+        }
+        for (sid = 0; sid < POWER_LARGEST; sid++) {
+            base->lru_hits[sid] =
+                __atomic_load_n(&cur->lru_hits[sid], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void threadlocal_stats_aggregate(struct thread_stats *stats) {
+    int ii, sid;
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        struct thread_stats *cur = &threads[ii].stats;
+        struct thread_stats *base = &threads[ii].stats_base;
+#define X(name) stats->name += \
+            __atomic_load_n(&cur->name, __ATOMIC_RELAXED) - base->name;
+        THREAD_STATS_FIELDS
+#ifdef EXTSTORE
+        EXTSTORE_THREAD_STATS_FIELDS
+#endif
+#undef X
+        for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
+#define X(name) stats->slab_stats[sid].name += \
+            __atomic_load_n(&cur->slab_stats[sid].name, __ATOMIC_RELAXED) - \
+            base->slab_stats[sid].name;
+            SLAB_STATS_FIELDS
+#undef X
+        }
+
+        for (sid = 0; sid < POWER_LARGEST; sid++) {
+            uint64_t hits = __atomic_load_n(&cur->lru_hits[sid], __ATOMIC_RELAXED) -
+                base->lru_hits[sid];
+            stats->lru_hits[sid] += hits;
+            stats->slab_stats[CLEAR_LRU(sid)].get_hits += hits;
+        }
+    }
+}
+
 /*
  * Initializes the thread subsystem, creating various worker threads.
  *
@@ -145,11 +264,12 @@ void memcached_thread_init(int nthreads, void *arg) {
         pthread_mutex_init(&item_locks[i], NULL);
     }
 
-    threads = calloc(nthreads, sizeof(LIBEVENT_THREAD));
-    if (! threads) {
+    /* Cache-line aligned so each worker's stats stay on lines of its own */
+    if (posix_memalign((void **)&threads, 64, nthreads * sizeof(LIBEVENT_THREAD)) != 0) {
         perror("Can't allocate thread descriptors");
         exit(1);
     }
+    memset(threads, 0, nthreads * sizeof(LIBEVENT_THREAD));
 
     for (i = 0; i < nthreads; i++) {
         int fds[2];